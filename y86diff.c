@@ -0,0 +1,779 @@
+#include "y86sim.h"
+#include <stddef.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <dirent.h>
+#include <signal.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/wait.h>
+
+// Differential tester: every program is run by every engine (separate processes), outputs are compared
+// The first engine is the reference (y86sim_int), the output format is the same in all versions
+// Engines without step counting (y86sim_max) are compared only if the reference is not stopped by steps
+// A divergence is minimized (insts replaced by nop while it still diverges the same way) and saved
+
+#define Y_DIFF_ENGINES 8
+#define Y_DIFF_ARGS 16
+#define Y_DIFF_OUT 0x10000 // Output kept of a run
+#define Y_DIFF_IMAGE 0x180 // Random programs, below the default code area
+#define Y_DIFF_TRIES 2000 // Runs of a minimization at most
+#define Y_DIFF_FILE 0x100000 // Programs read at most
+
+typedef struct {
+    Y_char *spec; // Command line, split by spaces
+    Y_char *argv[Y_DIFF_ARGS + 3];
+    Y_word same;
+    Y_word diff;
+    Y_word skip;
+} Y_engine;
+
+typedef struct {
+    Y_char text[Y_DIFF_OUT];
+    Y_word ok; // Exited, with the "Stopped" line
+    Y_word steps; // -1 if not counted
+    Y_word aok; // Stopped by steps
+    Y_char *error; // Lines of the output (in text), or 0
+    Y_char *state;
+    Y_char *reg;
+    Y_char *mem;
+} Y_result;
+
+typedef enum {
+    yd_same = 0,
+    yd_output, // Crashed, timed out, or not parsed
+    yd_error,
+    yd_state, // PC, status and CC
+    yd_steps,
+    yd_reg,
+    yd_mem,
+    yd_skip // Not comparable (no step counting)
+} Y_diff;
+
+const Y_char *f_diff_names[] = {"same", "output", "error", "state", "steps", "registers", "memory", "skipped"};
+
+Y_engine f_engines[Y_DIFF_ENGINES];
+Y_word f_engine_cnt;
+Y_word f_step = 10000;
+Y_word f_timeout = 5;
+Y_char *f_out_dir = ".";
+Y_char f_tmp[4096];
+volatile pid_t f_child;
+volatile sig_atomic_t f_timed_out;
+
+void f_usage(Y_char *pname) {
+    fprintf(stderr, "Usage: %s [-s max_steps] [-t timeout] [-r random_count] [-x seed] [-o out_dir] -e engine [-e engine ...] [file.bin|dir ...]\n", pname);
+}
+
+Y_word f_inst_len(Y_char op) {
+    // As the decoders, by the high half of the first byte
+    switch (op & 0xF0) {
+        case yi_rrmovl:
+        case yi_addl:
+        case yi_pushl:
+        case yi_popl:
+            return 2;
+        case yi_irmovl:
+        case yi_rmmovl:
+        case yi_mrmovl:
+            return 6;
+        case yi_jmp:
+        case yi_call:
+            return 5;
+        default:
+            return 1;
+    }
+}
+
+void f_engine_add(Y_char *spec) {
+    Y_engine *e = &(f_engines[f_engine_cnt]);
+    Y_char *pos;
+    Y_word argc = 0;
+
+    if (f_engine_cnt >= Y_DIFF_ENGINES) {
+        fprintf(stderr, "Too many engines\n");
+        exit(1);
+    }
+
+    // "path [options]", the file and max_steps are appended
+    e->spec = spec;
+    pos = strdup(spec);
+    for (pos = strtok(pos, " "); pos && argc < Y_DIFF_ARGS; pos = strtok(0, " ")) {
+        e->argv[argc++] = pos;
+    }
+    e->argv[argc] = 0;
+
+    ++f_engine_cnt;
+}
+
+Y_char *f_line(Y_char **pos) {
+    Y_char *line = *pos;
+    Y_char *end = strchr(line, '\n');
+
+    if (end) {
+        *end = 0;
+        *pos = end + 1;
+    } else {
+        *pos = line + strlen(line);
+    }
+
+    return line;
+}
+
+void f_parse(Y_result *r) {
+    Y_char *pos = r->text;
+    Y_char *line;
+    Y_char *mark;
+
+    r->ok = 0;
+    r->steps = -1;
+    r->error = 0;
+    r->state = 0;
+    r->reg = 0;
+    r->mem = 0;
+
+    // [error line] "Stopped ..." "Changes to registers:" ... "" "Changes to memory:" ...
+    line = f_line(&pos);
+    if (!strncmp(line, "PC = ", 5)) {
+        r->error = line;
+        line = f_line(&pos);
+    }
+    if (strncmp(line, "Stopped ", 8)) {
+        return;
+    }
+
+    // "Stopped in N steps at PC = ..." or "Stopped at PC = ...", compared without N
+    if (sscanf(line, "Stopped in %d steps", &(r->steps)) == 1) {
+        mark = strstr(line, " at PC");
+        memmove(line + 7, mark, strlen(mark) + 1);
+    }
+    r->state = line;
+    r->aok = strstr(line, "'AOK'") != 0;
+
+    line = f_line(&pos);
+    if (strcmp(line, "Changes to registers:")) {
+        return;
+    }
+    r->reg = pos;
+    mark = strstr(pos, "\nChanges to memory:\n");
+    if (!mark) {
+        return;
+    }
+    *mark = 0;
+    r->mem = mark + strlen("\nChanges to memory:\n");
+
+    r->ok = 1;
+}
+
+void f_timeout_kill(int sig) {
+    (void) sig;
+
+    // The engine and its children (scripts), the read in f_exec is interrupted
+    if (f_child > 0) {
+        kill(-f_child, SIGKILL);
+        f_timed_out = 1;
+    }
+}
+
+void f_exec(Y_engine *e, Y_char *fname, Y_result *r) {
+    Y_char step[16];
+    Y_char drop[4096];
+    Y_word len = 0;
+    Y_word argc = 0;
+    ssize_t got;
+    int fd[2];
+    int status = 0;
+    pid_t pid;
+
+    r->text[0] = 0;
+    r->ok = 0;
+
+    snprintf(step, sizeof(step), "%d", f_step);
+    while (e->argv[argc]) {
+        ++argc;
+    }
+    e->argv[argc] = fname;
+    e->argv[argc + 1] = step;
+    e->argv[argc + 2] = 0;
+
+    if (pipe(fd)) {
+        fprintf(stderr, "pipe() failed\n");
+        exit(1);
+    }
+
+    f_timed_out = 0;
+    pid = fork();
+    if (pid == 0) {
+        // Output to the pipe, errors dropped, in a new group (killed together)
+        setpgid(0, 0);
+        dup2(fd[1], 1);
+        close(fd[0]);
+        close(fd[1]);
+        close(2);
+        open("/dev/null", O_WRONLY);
+        execvp(e->argv[0], e->argv);
+        _exit(127);
+    }
+
+    // Killed if too slow (no step counting, or a hang)
+    f_child = pid;
+    if (pid > 0) {
+        setpgid(pid, pid);
+        alarm(f_timeout);
+    }
+
+    close(fd[1]);
+    while (pid > 0) {
+        // Read to the end (the rest dropped), the engine does not block on a full pipe
+        if (len < Y_DIFF_OUT - 1) {
+            got = read(fd[0], r->text + len, Y_DIFF_OUT - 1 - len);
+            len += got > 0 ? got : 0;
+        } else {
+            got = read(fd[0], drop, sizeof(drop));
+        }
+        if (got <= 0) {
+            break;
+        }
+    }
+    r->text[len] = 0;
+    close(fd[0]);
+
+    e->argv[argc] = 0;
+
+    if (pid > 0) {
+        while (waitpid(pid, &status, 0) < 0) {}
+        alarm(0);
+    }
+    f_child = 0;
+
+    if (pid < 0 || f_timed_out || !WIFEXITED(status) || WEXITSTATUS(status) == 127) {
+        snprintf(
+            r->text, Y_DIFF_OUT, "(%s)\n",
+            pid < 0 || (WIFEXITED(status) && WEXITSTATUS(status) == 127) ? "not run" : f_timed_out ? "timed out" : strsignal(WTERMSIG(status))
+        );
+        return;
+    }
+
+    f_parse(r);
+}
+
+Y_diff f_compare(Y_result *ref, Y_result *r) {
+    // The first divergence, in the order of the output
+    if (!ref->ok || !r->ok) {
+        return ref->ok == r->ok && !strcmp(ref->text, r->text) ? yd_same : yd_output;
+    }
+    if (r->steps < 0 && ref->aok) {
+        return yd_skip;
+    }
+    if ((ref->error == 0) != (r->error == 0) || (ref->error && strcmp(ref->error, r->error))) {
+        return yd_error;
+    }
+    if (strcmp(ref->state, r->state)) {
+        return yd_state;
+    }
+    if (ref->steps >= 0 && r->steps >= 0 && ref->steps != r->steps) {
+        return yd_steps;
+    }
+    if (strcmp(ref->reg, r->reg)) {
+        return yd_reg;
+    }
+    if (strcmp(ref->mem, r->mem)) {
+        return yd_mem;
+    }
+    return yd_same;
+}
+
+Y_word f_write(Y_char *fname, Y_char *image, Y_word len) {
+    FILE *file = fopen(fname, "wb");
+    Y_word result;
+
+    if (!file) {
+        fprintf(stderr, "Can't open binary file '%s'\n", fname);
+        return 1;
+    }
+    result = fwrite(image, 1, len, file) != (size_t) len;
+    fclose(file);
+
+    return result;
+}
+
+Y_diff f_try(Y_engine *e, Y_char *image, Y_word len, Y_result *ref, Y_result *r) {
+    if (f_write(f_tmp, image, len)) {
+        return yd_output;
+    }
+
+    f_exec(&(f_engines[0]), f_tmp, ref);
+    f_exec(e, f_tmp, r);
+    return f_compare(ref, r);
+}
+
+void f_dump_diff(Y_result *ref, Y_result *r, Y_diff kind) {
+    Y_char *a = ref->text;
+    Y_char *b = r->text;
+
+    // The lines of the field only
+    switch (kind) {
+        case yd_error:
+            a = ref->error ? ref->error : "(none)";
+            b = r->error ? r->error : "(none)";
+            break;
+        case yd_state:
+        case yd_steps:
+            a = ref->state;
+            b = r->state;
+            break;
+        case yd_reg:
+            a = ref->reg;
+            b = r->reg;
+            break;
+        case yd_mem:
+            a = ref->mem;
+            b = r->mem;
+            break;
+        default:
+            break;
+    }
+
+    if (kind == yd_steps) {
+        printf("    %d steps\n    %d steps\n", ref->steps, r->steps);
+    } else {
+        printf("  %s:\n%s\n  %s:\n%s\n", f_engines[0].spec, a, "got", b);
+    }
+}
+
+Y_word f_minimize(Y_engine *e, Y_char *image, Y_word len, Y_diff kind, Y_result *ref, Y_result *r) {
+    Y_char *test = malloc(len);
+    Y_word *spans = malloc((len + 1) * sizeof(Y_word));
+    Y_word count = 0;
+    Y_word chunk;
+    Y_word index;
+    Y_word pos;
+    Y_word changed;
+    Y_word tries = 0;
+    Y_word live = 0;
+
+    if (!test || !spans) {
+        free(test);
+        free(spans);
+        return 0;
+    }
+
+    // Insts by a linear sweep (data is swept too, replacing it may also keep the divergence)
+    for (pos = 0; pos < len; pos += f_inst_len(image[pos])) {
+        spans[count++] = pos;
+    }
+    spans[count] = len;
+
+    // Replace chunks of insts by nop, halving the chunk if nothing is kept
+    for (chunk = count / 2 > 0 ? count / 2 : 1; chunk > 0 && tries < Y_DIFF_TRIES; chunk = changed ? chunk : chunk / 2) {
+        changed = 0;
+        for (index = 0; index < count && tries < Y_DIFF_TRIES; index += chunk) {
+            memcpy(test, image, len);
+            pos = spans[index];
+            while (pos < spans[index + chunk < count ? index + chunk : count]) {
+                test[pos++] = yi_nop;
+            }
+            if (!memcmp(test, image, len)) {
+                continue;
+            }
+
+            ++tries;
+            if (f_try(e, test, len, ref, r) == kind) {
+                memcpy(image, test, len);
+                changed = 1;
+            }
+        }
+    }
+
+    // Results of the minimized one (for the report)
+    f_try(e, image, len, ref, r);
+
+    for (index = 0; index < count; ++index) {
+        if (image[spans[index]] != yi_nop) {
+            ++live;
+        }
+    }
+
+    free(test);
+    free(spans);
+    return live;
+}
+
+void f_listing(Y_char *image, Y_word len) {
+    Y_word pos;
+    Y_word index;
+    Y_word size;
+
+    // Insts left (not nop), as bytes
+    for (pos = 0; pos < len; pos += size) {
+        size = f_inst_len(image[pos]);
+        if (image[pos] == yi_nop) {
+            continue;
+        }
+
+        printf("    0x%.4x:", pos);
+        for (index = 0; index < size && pos + index < len; ++index) {
+            printf(" %.2x", image[pos + index] & 0xFF);
+        }
+        printf("\n");
+    }
+}
+
+Y_word f_check(Y_char *name, Y_char *image, Y_word len, Y_word *id) {
+    static Y_result ref;
+    static Y_result r;
+    Y_char path[4096];
+    Y_word index;
+    Y_word live;
+    Y_word result = 0;
+    Y_diff kind;
+    Y_char *copy = malloc(len + 1);
+
+    if (!copy || f_write(f_tmp, image, len)) {
+        free(copy);
+        return 1;
+    }
+    f_exec(&(f_engines[0]), f_tmp, &ref);
+
+    for (index = 1; index < f_engine_cnt; ++index) {
+        f_exec(&(f_engines[index]), f_tmp, &r);
+        kind = f_compare(&ref, &r);
+
+        if (kind == yd_same) {
+            ++(f_engines[index].same);
+            continue;
+        }
+        if (kind == yd_skip) {
+            ++(f_engines[index].skip);
+            continue;
+        }
+        ++(f_engines[index].diff);
+        result = 1;
+
+        printf("==> %s <==\n", name);
+        printf("  %s: first divergence in %s\n", f_engines[index].spec, f_diff_names[kind]);
+        f_dump_diff(&ref, &r, kind);
+
+        // The reproducer is checked against the reference and this engine only
+        snprintf(path, sizeof(path), "%s/y86diff_%d.bin", f_out_dir, (*id)++);
+        memcpy(copy, image, len);
+        live = f_minimize(&(f_engines[index]), copy, len, kind, &ref, &r);
+        if (!f_write(path, copy, len)) {
+            printf("  Reproducer (%d insts): %s\n", live, path);
+            f_listing(copy, len);
+            f_dump_diff(&ref, &r, kind);
+        }
+
+        // The next engines with the original one
+        if (f_write(f_tmp, image, len)) {
+            break;
+        }
+        f_exec(&(f_engines[0]), f_tmp, &ref);
+    }
+
+    free(copy);
+    return result;
+}
+
+Y_word f_check_file(Y_char *fname, Y_word *id) {
+    Y_char *image = malloc(Y_DIFF_FILE);
+    FILE *file = fopen(fname, "rb");
+    Y_word len;
+    Y_word result;
+
+    if (!image || !file) {
+        fprintf(stderr, "Can't open binary file '%s'\n", fname);
+        free(image);
+        if (file) {
+            fclose(file);
+        }
+        return 1;
+    }
+
+    len = fread(image, 1, Y_DIFF_FILE, file);
+    fclose(file);
+
+    result = f_check(fname, image, len, id);
+    free(image);
+    return result;
+}
+
+Y_word f_check_dir(Y_char *dname, Y_word *id) {
+    DIR *dir = opendir(dname);
+    struct dirent *entry;
+    Y_char **names = 0;
+    Y_word count = 0;
+    Y_word limit = 0;
+    Y_word index;
+    Y_word result = 0;
+    size_t size;
+
+    if (!dir) {
+        return f_check_file(dname, id);
+    }
+
+    // *.bin, sorted (the order of the report)
+    while ((entry = readdir(dir))) {
+        size = strlen(entry->d_name);
+        if (size < 4 || strcmp(entry->d_name + size - 4, ".bin")) {
+            continue;
+        }
+        if (count == limit) {
+            limit = limit ? 2 * limit : 64;
+            names = realloc(names, limit * sizeof(Y_char *));
+        }
+        names[count] = malloc(strlen(dname) + size + 2);
+        sprintf(names[count++], "%s/%s", dname, entry->d_name);
+    }
+    closedir(dir);
+
+    for (index = 0; index < count; ++index) {
+        for (limit = index; limit > 0 && strcmp(names[limit - 1], names[limit]) > 0; --limit) {
+            Y_char *swap = names[limit];
+            names[limit] = names[limit - 1];
+            names[limit - 1] = swap;
+        }
+    }
+
+    for (index = 0; index < count; ++index) {
+        result |= f_check_file(names[index], id);
+        free(names[index]);
+    }
+    free(names);
+
+    return result;
+}
+
+unsigned f_rand(unsigned *seed) {
+    // xorshift32, the same programs on every host
+    *seed ^= *seed << 13;
+    *seed ^= *seed >> 17;
+    *seed ^= *seed << 5;
+    return *seed;
+}
+
+Y_word f_rand_val(unsigned *seed) {
+    // Small numbers, addresses in mem, or anything
+    switch (f_rand(seed) % 8) {
+        case 0:
+        case 1:
+        case 2:
+            return f_rand(seed) % 0x10;
+        case 3:
+        case 4:
+        case 5:
+            return 0x400 + (f_rand(seed) % 0x400 & ~3);
+        case 6:
+            return -(Y_word) (f_rand(seed) % 0x10);
+        default:
+            return f_rand(seed);
+    }
+}
+
+Y_word f_random(unsigned *seed, Y_char *image) {
+    Y_word at[Y_DIFF_IMAGE];
+    Y_word target[Y_DIFF_IMAGE];
+    Y_word count = 4 + f_rand(seed) % 40;
+    Y_word index;
+    Y_word len = 0;
+    Y_char op;
+    Y_char ra;
+    Y_char rb;
+    Y_word val;
+
+    // A stack in mem first, usually
+    if (f_rand(seed) % 10) {
+        image[len++] = yi_irmovl;
+        image[len++] = yr_nil << 4 | yri_esp;
+        IO_WORD(&(image[len])) = 0x1000;
+        len += 4;
+    }
+
+    for (index = 0; index < count && len + 6 < Y_DIFF_IMAGE; ++index) {
+        at[index] = len;
+        target[index] = -1;
+
+        ra = f_rand(seed) % 8;
+        rb = f_rand(seed) % 8;
+        val = f_rand_val(seed);
+
+        switch (f_rand(seed) % 16) {
+            case 0:
+                op = yi_rrmovl + f_rand(seed) % 7;
+                break;
+            case 1:
+            case 2:
+                op = yi_irmovl;
+                ra = yr_nil;
+                break;
+            case 3:
+                op = yi_rmmovl;
+                val = f_rand(seed) % 3 ? (Y_word) (f_rand(seed) % 0x10) : val;
+                break;
+            case 4:
+                op = yi_mrmovl;
+                val = f_rand(seed) % 3 ? (Y_word) (f_rand(seed) % 0x10) : val;
+                break;
+            case 5:
+            case 6:
+            case 7:
+                op = yi_addl + f_rand(seed) % 4;
+                break;
+            case 8:
+            case 9:
+                op = yi_jmp + f_rand(seed) % 7;
+                target[index] = f_rand(seed) % (count + 1);
+                break;
+            case 10:
+                op = yi_call;
+                target[index] = f_rand(seed) % (count + 1);
+                break;
+            case 11:
+                op = yi_ret;
+                break;
+            case 12:
+                op = yi_pushl;
+                rb = yr_nil;
+                break;
+            case 13:
+                op = yi_popl;
+                rb = yr_nil;
+                break;
+            case 14:
+                op = f_rand(seed) % 8 ? yi_nop : yi_halt;
+                break;
+            default:
+                // Bad insts and bad registers, rarely
+                if (f_rand(seed) % 4) {
+                    op = yi_addl + f_rand(seed) % 4;
+                    break;
+                }
+                op = f_rand(seed) % 2 ? (Y_char) f_rand(seed) : yi_rrmovl;
+                ra = f_rand(seed) % 16;
+                rb = f_rand(seed) % 16;
+                break;
+        }
+
+        image[len++] = op;
+        switch (f_inst_len(op)) {
+            case 2:
+                image[len++] = ra << 4 | rb;
+                break;
+            case 6:
+                image[len++] = ra << 4 | rb;
+                IO_WORD(&(image[len])) = val;
+                len += 4;
+                break;
+            case 5:
+                IO_WORD(&(image[len])) = val;
+                len += 4;
+                break;
+            default:
+                break;
+        }
+    }
+    count = index;
+    at[count] = len;
+    image[len++] = yi_halt;
+
+    // Jump targets are insts (or the final halt), sometimes inside one
+    for (index = 0; index < count; ++index) {
+        if (target[index] >= 0) {
+            val = at[target[index]] + (f_rand(seed) % 16 ? 0 : 1);
+            IO_WORD(&(image[at[index] + 1])) = val;
+        }
+    }
+
+    return len;
+}
+
+Y_word f_check_random(Y_word count, unsigned seed, Y_word *id) {
+    Y_char image[Y_DIFF_IMAGE + 8];
+    Y_char name[64];
+    Y_word index;
+    Y_word len;
+    Y_word result = 0;
+
+    for (index = 0; index < count; ++index) {
+        memset(image, 0, sizeof(image));
+        len = f_random(&seed, image);
+
+        snprintf(name, sizeof(name), "random #%d", index);
+        result |= f_check(name, image, len, id);
+    }
+
+    return result;
+}
+
+int main(int argc, char *argv[]) {
+    Y_word random_count = 0;
+    unsigned seed = 1;
+    Y_word index = 1;
+    Y_word id = 0;
+    Y_word result = 0;
+    struct sigaction action;
+    int fd;
+
+    // Options, the first engine is the reference
+    for (; index + 1 < argc && argv[index][0] == '-'; index += 2) {
+        switch (argv[index][1]) {
+            case 'e':
+                f_engine_add(argv[index + 1]);
+                break;
+            case 's':
+                f_step = atoi(argv[index + 1]);
+                break;
+            case 't':
+                f_timeout = atoi(argv[index + 1]);
+                break;
+            case 'r':
+                random_count = atoi(argv[index + 1]);
+                break;
+            case 'x':
+                seed = strtoul(argv[index + 1], 0, 0);
+                break;
+            case 'o':
+                f_out_dir = argv[index + 1];
+                break;
+            default:
+                f_usage(argv[0]);
+                return 2;
+        }
+    }
+
+    if (f_engine_cnt < 2 || (index >= argc && !random_count) || !seed) {
+        f_usage(argv[0]);
+        return 2;
+    }
+
+    // No restart, the read of the output returns
+    memset(&action, 0, sizeof(action));
+    action.sa_handler = f_timeout_kill;
+    sigaction(SIGALRM, &action, 0);
+
+    snprintf(f_tmp, sizeof(f_tmp), "/tmp/y86diff_XXXXXX");
+    fd = mkstemp(f_tmp);
+    if (fd < 0) {
+        fprintf(stderr, "Can't create a temp file\n");
+        return 2;
+    }
+    close(fd);
+
+    for (; index < argc; ++index) {
+        result |= f_check_dir(argv[index], &id);
+    }
+    result |= f_check_random(random_count, seed, &id);
+
+    unlink(f_tmp);
+
+    // Summary by engine
+    for (index = 1; index < f_engine_cnt; ++index) {
+        printf(
+            "%s: %d same, %d different, %d skipped (no step counting)\n",
+            f_engines[index].spec, f_engines[index].same, f_engines[index].diff, f_engines[index].skip
+        );
+    }
+
+    return result;
+}
@@ -1,63 +1,164 @@
+#define _GNU_SOURCE // REG_EIP etc.
 #include "y86sim.h"
 #include <stdlib.h>
 #include <stdio.h>
 #include <string.h>
 #include <sys/mman.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <ucontext.h>
+#include <unistd.h>
+#include <sys/syscall.h>
+#include <asm/ldt.h>
 
 Y_data *y86_new() {
-    return mmap(
-        0, sizeof(Y_data),
+    Y_data *y;
+    Y_char *pos;
+    Y_char *code;
+
+    // Fixed sizes (the masks in asm), mem and tables follow Y_data
+    size_t size = sizeof(Y_data) + Y_MEM_SIZE + sizeof(Y_word) + Y_MEM_SIZE
+        + Y_Y_INST_SIZE * sizeof(Y_addr) + (Y_X_INST_SIZE + 1) * sizeof(Y_word)
+        + Y_Y_INST_SIZE * sizeof(Y_word) + Y_Y_INST_SIZE * sizeof(Y_addr)
+        + Y_Y_INST_SIZE * sizeof(Y_addr) + Y_Y_INST_SIZE * sizeof(Y_word) + Y_Y_INST_SIZE * sizeof(Y_word)
+        + Y_Y_INST_SIZE * 4 + Y_Y_INST_SIZE * sizeof(Y_word);
+
+    pos = mmap(
+        0, size,
+        PROT_READ | PROT_WRITE,
+        MAP_PRIVATE | MAP_ANONYMOUS,
+        -1, 0
+    );
+    if (pos == MAP_FAILED) {
+        fprintf(stderr, "mmap() failed (0x%x)\n", (Y_word) size);
+        return 0;
+    }
+
+    // Compiled code is mapped apart, it has no host address in it (see y86_gen_ret_push)
+    code = mmap(
+        0, Y_X_INST_SIZE,
         PROT_READ | PROT_WRITE | PROT_EXEC,
         MAP_PRIVATE | MAP_ANONYMOUS,
         -1, 0
     );
-}
+    if (code == MAP_FAILED) {
+        fprintf(stderr, "mmap() failed (0x%x)\n", Y_X_INST_SIZE);
+        munmap(pos, size);
+        return 0;
+    }
+
+    y = (Y_data *) pos;
+    y->mem_size = Y_MEM_SIZE;
+    y->x_inst_size = Y_X_INST_SIZE;
+    y->y_inst_size = Y_Y_INST_SIZE;
+    y->size = size;
+
+    pos += sizeof(Y_data);
+    y->mem = pos; pos += Y_MEM_SIZE + sizeof(Y_word);
+    y->bak_mem = pos; pos += Y_MEM_SIZE;
+    y->x_inst = code;
+    y->x_map = (Y_addr *) pos; pos += Y_Y_INST_SIZE * sizeof(Y_addr);
+    y->x_rev = (Y_word *) pos; pos += (Y_X_INST_SIZE + 1) * sizeof(Y_word);
+    y->x_hot = (Y_word *) pos; pos += Y_Y_INST_SIZE * sizeof(Y_word);
+    y->x_link = (Y_addr *) pos; pos += Y_Y_INST_SIZE * sizeof(Y_addr);
+    y->x_fast = (Y_addr *) pos; pos += Y_Y_INST_SIZE * sizeof(Y_addr);
+    y->x_left = (Y_word *) pos; pos += Y_Y_INST_SIZE * sizeof(Y_word);
+    y->x_run = (Y_word *) pos; pos += Y_Y_INST_SIZE * sizeof(Y_word);
+    y->t_in = pos; pos += Y_Y_INST_SIZE;
+    y->d_op = pos; pos += Y_Y_INST_SIZE;
+    y->d_reg = pos; pos += Y_Y_INST_SIZE;
+    y->d_len = pos; pos += Y_Y_INST_SIZE;
+    y->d_val = (Y_word *) pos;
+    y->x_end = &(y->x_inst[0]);
+    y->x_stub = &(y->x_inst[Y_X_INST_SIZE]);
+
+    Y_word index;
+    for (index = 0; index < 16; ++index) {
+        y->x_num[index] = index;
+    }
 
-const Y_word y_static_num[16] = {0, 1, 2, 3, 4, 5, 6, 7, 8, 9, 10, 11, 12, 13, 14, 15};
+    // Nothing decoded (see y86_decode_pc)
+    memset(&(y->d_op[0]), yi_nil, Y_Y_INST_SIZE);
+
+    return y;
+}
 
 #define YX(data) {y86_push_x(y, data);}
 #define YXW(data) {y86_push_x_word(y, data);}
-#define YXA(data) {y86_push_x_addr(y, data);}
 
 void y86_push_x(Y_data *y, Y_char value) {
-    if (y->x_end < &(y->x_inst[Y_X_INST_SIZE])) {
+    if (y->x_end < y->x_stub) {
         *(y->x_end) = value;
         y->x_end++;
     } else {
-        fprintf(stderr, "Too large compiled instruction size (char: 0x%x)\n", value);
-        longjmp(y->jmp, ys_ccf);
+        longjmp(y->x_full, 1);
     }
 }
 
 void y86_push_x_word(Y_data *y, Y_word value) {
-    if (y->x_end + sizeof(Y_word) <= &(y->x_inst[Y_X_INST_SIZE])) {
+    if (y->x_end + sizeof(Y_word) <= y->x_stub) {
         IO_WORD(y->x_end) = value;
         y->x_end += sizeof(Y_word);
     } else {
-        fprintf(stderr, "Too large compiled instruction size (word: 0x%x)\n", value);
-        longjmp(y->jmp, ys_ccf);
+        longjmp(y->x_full, 1);
     }
 }
 
-void y86_push_x_addr(Y_data *y, Y_addr value) {
-    if (y->x_end + sizeof(Y_addr) <= &(y->x_inst[Y_X_INST_SIZE])) {
-        IO_ADDR(y->x_end) = value;
-        y->x_end += sizeof(Y_addr);
+void y86_link_x_rev(Y_data *y, Y_word pos, Y_word value) {
+    // Reverse map of x_map, the first inst if some insts have no code
+    Y_word *rev = &(y->x_rev[y->x_map[pos] - &(y->x_inst[0])]);
+
+    if (value) {
+        if (!*rev || y->x_map[*rev - 1] != y->x_map[pos] || *rev - 1 > pos) {
+            *rev = pos + 1;
+        }
     } else {
-        fprintf(stderr, "Too large compiled instruction size (addr: 0x%x)\n", (Y_word) value);
-        longjmp(y->jmp, ys_ccf);
+        if (*rev == pos + 1) {
+            *rev = 0;
+        }
+    }
+}
+
+void y86_link_x_entry(Y_data *y, Y_word pos) {
+    // The stub of pos (if jumped to) is patched to jump to x_map[pos], its Y PC is kept for y86_trace_pc
+    Y_addr stub = y->x_link[pos];
+
+    if (stub) {
+        stub[0] = 0xE9; // jmp code
+        IO_WORD(&(stub[1])) = y->x_map[pos] - (stub + 1 + sizeof(Y_word));
     }
 }
 
 void y86_link_x_map(Y_data *y, Y_word pos) {
     if (pos < Y_Y_INST_SIZE) {
+        if (y->x_map[pos]) {
+            y86_link_x_rev(y, pos, 0);
+        }
         y->x_map[pos] = y->x_end;
+        y86_link_x_rev(y, pos, 1);
+        y86_link_x_entry(y, pos);
     } else {
         fprintf(stderr, "Too large y86 instruction size\n");
         longjmp(y->jmp, ys_ccf);
     }
 }
 
+void y86_link_x_tail(Y_data *y, Y_word pos) {
+    // After a block: the PC reached if the last inst falls through (see y86_trace_pc)
+    y->x_rev[y->x_end - &(y->x_inst[0])] = pos + 1;
+}
+
+Y_word y86_x_loaded(Y_data *y, Y_word pos) {
+    // Compiled, not a stub
+    return y->x_map[pos] && y->x_map[pos] < y->x_stub;
+}
+
+Y_word y86_x_mid_offset(Y_data *y, Y_char *addr) {
+    // Mid ESP is &reg[yr_rex] (the callback stack), all data is addressed relative to it
+    return addr - (Y_char *) &(y->reg[yr_rex]);
+}
+
 void y86_gen_before(Y_data *y, Y_word protect_esp) {
     if (protect_esp) {
         YX(0x0F) YX(0x7E) YX(0xCC) // movd %mm1, %esp
@@ -70,28 +171,164 @@ void y86_gen_after(Y_data *y, Y_word protect_esp) {
     }
 }
 
-void y86_gen_check(Y_data *y, Y_word protect_esp) {
+void y86_gen_stat(Y_data *y, Y_stat stat) {
+    // Assert: %esp is Mid ESP
+    if (stat != ys_aok) {
+        YX(0x0F) YX(0x6E) YX(0xBC) YX(0x24) YXW(y86_x_mid_offset(y, (Y_char *) &(y->x_num[stat]))) // movd stat(%esp), %mm7
+    }
+}
+
+void y86_gen_check(Y_data *y, Y_word protect_esp, Y_stat stat) {
     if (protect_esp) {
         YX(0x0F) YX(0x7E) YX(0xD4) // movd %mm2, %esp
     }
+    y86_gen_stat(y, stat);
     YX(0xFF) YX(0x14) YX(0x24) // call (%esp)
 }
 
-void y86_gen_after_goto(Y_data *y, Y_addr value, Y_word protect_esp) {
-    // If changed, value of jmp_skip should be updated (for jump instruction etc.)
-
+void y86_gen_after_goto(Y_data *y, Y_addr value, Y_word protect_esp, Y_stat stat) {
     y86_gen_after(y, protect_esp);
     YX(0x0F) YX(0x7E) YX(0xD4) // movd %mm2, %esp
-    YX(0xFF) YX(0x35) YXA(value) // push value
+    y86_gen_stat(y, stat);
+    YX(0xFF) YX(0xB4) YX(0x24) YXW(y86_x_mid_offset(y, value)) // push value(%esp)
     YX(0xFF) YX(0x64) YX(0x24) YX(0x04) // jmp 4(%esp)
 }
 
-void y86_gen_stat(Y_data *y, Y_stat stat) {
-    YX(0x0F) YX(0x6E) YX(0x3D) YXA((Y_addr) &(y_static_num[stat])) // movd stat, %mm7
+void y86_gen_raw_jmp(Y_data *y, Y_addr value) {
+    YX(0xE9) YXW(value - (y->x_end + sizeof(Y_word))) // jmp value
 }
 
-void y86_gen_raw_jmp(Y_data *y, Y_addr value) {
-    YX(0xFF) YX(0x25) YXA(value) // jmp *value
+void y86_gen_stub_at(Y_data *y, Y_addr stub, Y_word pc) {
+    // Written at stub (also over a patched stub, see y86_unload_x)
+    Y_addr end = y->x_end;
+    Y_addr limit = y->x_stub;
+
+    y->x_end = stub;
+    y->x_stub = stub + Y_X_STUB_SIZE;
+    YX(0xC7) YX(0x84) YX(0x24) YXW(y86_x_mid_offset(y, (Y_char *) &(y->x_pend))) YXW(pc) // movl $pc, x_pend(%esp)
+    y86_gen_raw_jmp(y, &(y->x_inst[0])); // jmp dispatch
+    y->x_stub = limit;
+    y->x_end = end;
+}
+
+Y_addr y86_gen_stub(Y_data *y, Y_word pc) {
+    // Stubs grow down from the end of x_inst (the code grows up), the dispatch is at the beginning
+    if (y->x_stub - Y_X_STUB_SIZE < y->x_end) {
+        longjmp(y->x_full, 1);
+    }
+
+    y->x_stub -= Y_X_STUB_SIZE;
+    y86_gen_stub_at(y, y->x_stub, pc);
+
+    return y->x_stub;
+}
+
+void y86_link_stub(Y_data *y, Y_word pos) {
+    // Jump targets are loaded when reached, jumps go to the stub (see y86_link_x_entry)
+    if (!y->x_link[pos]) {
+        y->x_link[pos] = y86_gen_stub(y, pos);
+
+        if (y->x_map[pos]) {
+            y86_link_x_entry(y, pos);
+        } else {
+            y->x_map[pos] = y->x_link[pos];
+        }
+    }
+}
+
+void y86_gen_goto(Y_data *y, Y_word pc, Y_word protect_esp, Y_stat stat) {
+    // Checked, then a direct jump (y86_trace_pc gives pc if stopped by the check)
+    y86_link_stub(y, pc);
+    y86_gen_after(y, protect_esp);
+    y86_gen_check(y, 1, stat);
+    y86_link_x_tail(y, pc);
+    y86_gen_raw_jmp(y, y->x_link[pc]);
+}
+
+void y86_gen_short_link(Y_data *y, Y_addr from) {
+    // from is the rel8 byte of a short jump
+    *from = y->x_end - (from + 1);
+}
+
+void y86_gen_ret_push(Y_data *y, Y_word pc) {
+    // Assert: %esp is Mid ESP, CC is kept
+    // Pushed in a ring, older entries are overwritten (mismatched later)
+    YX(0x9C) // pushfl
+    YX(0x0F) YX(0x6E) YX(0xD8) // movd %eax, %mm3
+    YX(0x8B) YX(0x84) YX(0x24) YXW(y86_x_mid_offset(y, (Y_char *) &(y->s_pos)) + 4) // movl s_pos, %eax
+    YX(0x83) YX(0xC0) YX(0x08) // addl $8, %eax
+    YX(0x25) YXW(Y_S_SIZE * 8 - 1) // andl $mask, %eax
+    YX(0x89) YX(0x84) YX(0x24) YXW(y86_x_mid_offset(y, (Y_char *) &(y->s_pos)) + 4) // movl %eax, s_pos
+    YX(0xC7) YX(0x84) YX(0x04) YXW(y86_x_mid_offset(y, (Y_char *) &(y->s_stk[0])) + 4) YXW(pc) // movl $pc, s_stk(%eax)
+    YX(0xC7) YX(0x84) YX(0x04) YXW(y86_x_mid_offset(y, (Y_char *) &(y->s_stk[1])) + 4) // movl $offset, s_stk + 4(%eax)
+    y->s_link = y->x_end;
+    YXW(0) // Set by y86_link_ret
+    YX(0x0F) YX(0x7E) YX(0xD8) // movd %mm3, %eax
+    YX(0x9D) // popfl
+}
+
+void y86_gen_ret(Y_data *y) {
+    // Assert: %esp is the Y %esp, CC is kept
+    // Compiled code returned to: the top of the shadow stack if the Y PC matches, or x_map[PC]
+    // Else (bad %esp, PC not below yr_len or never referenced), stat is ys_ret and the outer loop returns
+    Y_addr slow[3];
+    Y_addr found;
+    Y_addr lookup;
+
+    YX(0x0F) YX(0x7E) YX(0xD4) // movd %mm2, %esp
+    YX(0x9C) // pushfl
+    YX(0x0F) YX(0x6E) YX(0xD8) // movd %eax, %mm3
+    YX(0x0F) YX(0x6E) YX(0xEA) // movd %edx, %mm5
+
+    // Y PC from mem[%esp]
+    YX(0x0F) YX(0x7E) YX(0xC8) // movd %mm1, %eax
+    YX(0xA9) YXW(~(Y_MEM_SIZE - 1)) // testl $not_mem, %eax
+    YX(0x75) slow[0] = y->x_end; YX(0) // jnz slow
+    YX(0x8B) YX(0x84) YX(0x04) YXW(y86_x_mid_offset(y, &(y->mem[0])) + 4) // movl mem(%eax), %eax
+    YX(0x3B) YX(0x84) YX(0x24) YXW(y86_x_mid_offset(y, (Y_char *) &(y->reg[yr_len])) + 4) // cmpl len, %eax
+    YX(0x73) slow[1] = y->x_end; YX(0) // jae slow
+
+    // Shadow stack top, popped if matched
+    YX(0x8B) YX(0x94) YX(0x24) YXW(y86_x_mid_offset(y, (Y_char *) &(y->s_pos)) + 4) // movl s_pos, %edx
+    YX(0x3B) YX(0x84) YX(0x14) YXW(y86_x_mid_offset(y, (Y_char *) &(y->s_stk[0])) + 4) // cmpl s_stk(%edx), %eax
+    YX(0x75) lookup = y->x_end; YX(0) // jne lookup
+    YX(0x8B) YX(0x84) YX(0x14) YXW(y86_x_mid_offset(y, (Y_char *) &(y->s_stk[1])) + 4) // movl s_stk + 4(%edx), %eax
+    YX(0x03) YX(0x84) YX(0x24) YXW(y86_x_mid_offset(y, (Y_char *) &(y->x_inst)) + 4) // addl x_inst, %eax
+    YX(0x83) YX(0xEA) YX(0x08) // subl $8, %edx
+    YX(0x81) YX(0xE2) YXW(Y_S_SIZE * 8 - 1) // andl $mask, %edx
+    YX(0x89) YX(0x94) YX(0x24) YXW(y86_x_mid_offset(y, (Y_char *) &(y->s_pos)) + 4) // movl %edx, s_pos
+    YX(0xEB) found = y->x_end; YX(0) // jmp found
+
+    // Mismatched (the stack is kept), x_map if referenced (code or a stub)
+    y86_gen_short_link(y, lookup);
+    YX(0x8B) YX(0x84) YX(0x84) YXW(y86_x_mid_offset(y, (Y_char *) &(y->x_map[0])) + 4) // movl x_map(, %eax, 4), %eax
+    YX(0x85) YX(0xC0) // testl %eax, %eax
+    YX(0x74) slow[2] = y->x_end; YX(0) // jz slow
+
+    // Pop the Y %esp, then goto
+    y86_gen_short_link(y, found);
+    YX(0x89) YX(0x84) YX(0x24) YXW(y86_x_mid_offset(y, (Y_char *) &(y->s_ret)) + 4) // movl %eax, s_ret
+    YX(0x0F) YX(0xFE) YX(0x8C) YX(0x24) YXW(y86_x_mid_offset(y, (Y_char *) &(y->x_num[4])) + 4) // paddd 4, %mm1
+    YX(0x0F) YX(0x7E) YX(0xEA) // movd %mm5, %edx
+    YX(0x0F) YX(0x7E) YX(0xD8) // movd %mm3, %eax
+    YX(0x9D) // popfl
+    y86_gen_after_goto(y, (Y_addr) &(y->s_ret), 0, ys_aok);
+
+    // Slow path, as before the check
+    y86_gen_short_link(y, slow[0]);
+    y86_gen_short_link(y, slow[1]);
+    y86_gen_short_link(y, slow[2]);
+    YX(0x0F) YX(0x7E) YX(0xEA) // movd %mm5, %edx
+    YX(0x0F) YX(0x7E) YX(0xD8) // movd %mm3, %eax
+    YX(0x9D) // popfl
+    y86_gen_before(y, 1);
+}
+
+void y86_gen_im_base(Y_data *y) {
+    // %esp = Mid ESP + mem pointer, then mem[mm4] is at (&mem[0] - Mid ESP)(%esp)
+    YX(0x0F) YX(0x6F) YX(0xEA) // movq %mm2, %mm5
+    YX(0x0F) YX(0xFE) YX(0xEC) // paddd %mm4, %mm5
+    YX(0x0F) YX(0x7E) YX(0xEC) // movd %mm5, %esp
 }
 
 Y_char y86_x_regbyte_C(Y_reg_id ra, Y_reg_id rb) {
@@ -103,34 +340,114 @@ Y_char y86_x_regbyte_8(Y_reg_id ra, Y_reg_id rb) {
 }
 
 void y86_gen_protect(Y_data *y) {
-    y86_gen_stat(y, ys_hlt);
-    y86_gen_check(y, 0);
+    y86_gen_check(y, 0, ys_hlt);
 }
 
-void y86_gen_interrupt_ready(Y_data *y, Y_stat stat, Y_word protect_esp) {
-    y86_gen_stat(y, stat);
+void y86_gen_interrupt_ready(Y_data *y, Y_word protect_esp) {
     y86_gen_after(y, protect_esp);
 }
 
-void y86_gen_interrupt_go(Y_data *y, Y_word protect_esp) {
+void y86_gen_interrupt_go(Y_data *y, Y_stat stat) {
+    // After this, %esp is Mid ESP, the access should be relative to it
     YX(0x0F) YX(0x6E) YX(0xE4) // movd %esp, %mm4
-    y86_gen_check(y, 1);
-    y86_gen_before(y, protect_esp);
+    y86_gen_check(y, 1, stat);
+}
+
+void y86_gen_guard_go(Y_data *y) {
+    // Guard mode: no check, the access is %fs:(%esp) and faults out of mem (see y86_guard_segv)
+    // mm4 is still set, for the message and ys_imc
+    YX(0x0F) YX(0x6E) YX(0xE4) // movd %esp, %mm4
+    YX(0x64) // %fs prefix of the access
+}
+
+void y86_gen_guard_end(Y_data *y, Y_word protect_esp) {
+    // As after y86_gen_interrupt_go
+    if (!protect_esp) {
+        YX(0x0F) YX(0x7E) YX(0xD4) // movd %mm2, %esp
+    }
+}
+
+Y_char y86_x_cc(Y_inst op) {
+    // Host condition of a jump (the low bits of jcc)
+    switch (op) {
+        case yi_jle:
+            return 0xE;
+        case yi_jl:
+            return 0xC;
+        case yi_je:
+            return 0x4;
+        case yi_jne:
+            return 0x5;
+        case yi_jge:
+            return 0xD;
+        case yi_jg:
+            return 0xF;
+        default:
+            // Impossible
+            return 0x0;
+    }
 }
 
-void y86_gen_x(Y_data *y, Y_inst op, Y_reg_id ra, Y_reg_id rb, Y_word val) {
+void y86_gen_x_reg(Y_data *y, Y_inst op, Y_reg_id ra, Y_reg_id rb, Y_word val) {
+    // Register insts, the registers are valid (also used in superblocks)
+    switch (op) {
+        case yi_rrmovl:
+            YX(0x89) YX(y86_x_regbyte_C(ra, rb)) // movl ...
+            break;
+        case yi_cmovle:
+            YX(0x0F) YX(0x4E) YX(y86_x_regbyte_C(rb, ra)) // cmovle ...
+            break;
+        case yi_cmovl:
+            YX(0x0F) YX(0x4C) YX(y86_x_regbyte_C(rb, ra)) // cmovl ...
+            break;
+        case yi_cmove:
+            YX(0x0F) YX(0x44) YX(y86_x_regbyte_C(rb, ra)) // cmove ...
+            break;
+        case yi_cmovne:
+            YX(0x0F) YX(0x45) YX(y86_x_regbyte_C(rb, ra)) // cmovne ...
+            break;
+        case yi_cmovge:
+            YX(0x0F) YX(0x4D) YX(y86_x_regbyte_C(rb, ra)) // cmovge ...
+            break;
+        case yi_cmovg:
+            YX(0x0F) YX(0x4F) YX(y86_x_regbyte_C(rb, ra)) // cmovg ...
+            break;
+        case yi_irmovl:
+            YX(0xB8 + rb) YXW(val) // movl ...
+            break;
+        case yi_addl:
+            YX(0x01) YX(y86_x_regbyte_C(ra, rb)) // addl ...
+            break;
+        case yi_subl:
+            YX(0x29) YX(y86_x_regbyte_C(ra, rb)) // subl ...
+            break;
+        case yi_andl:
+            YX(0x21) YX(y86_x_regbyte_C(ra, rb)) // andl ...
+            break;
+        case yi_xorl:
+            YX(0x31) YX(y86_x_regbyte_C(ra, rb)) // xorl ...
+            break;
+        default:
+            // Impossible
+            fprintf(stderr, "Internal bug!\n");
+            longjmp(y->jmp, ys_ccf);
+            break;
+    }
+}
+
+Y_word y86_gen_x(Y_data *y, Y_inst op, Y_reg_id ra, Y_reg_id rb, Y_word val) {
     Y_word protect_esp = (ra == yri_esp) || (rb == yri_esp) || ((Y_char) op < 0);
-    Y_word jmp_skip = protect_esp ? 16 : 13;
+    Y_stat stat = ys_aok; // Set at the end, when %esp is Mid ESP
 
     y86_gen_before(y, protect_esp);
 
     // Always: ra, rb >= 0
     switch (op) {
         case yi_halt:
-            y86_gen_stat(y, ys_hlt);
+            stat = ys_hlt;
             break;
         case yi_nop:
-            // Nothing
+            YX(0x66) YX(0x90) // xchg %ax, %ax (room for a jump, see y86_unload_x)
             break;
         case yi_rrmovl:
         case yi_cmovle:
@@ -140,75 +457,88 @@ void y86_gen_x(Y_data *y, Y_inst op, Y_reg_id ra, Y_reg_id rb, Y_word val) {
         case yi_cmovge:
         case yi_cmovg:
             if (ra < yr_cnt && rb < yr_cnt) {
-                switch (op) {
-                    case yi_rrmovl:
-                        YX(0x89) YX(y86_x_regbyte_C(ra, rb)) // movl ...
-                        break;
-                    case yi_cmovle:
-                        YX(0x0F) YX(0x4E) YX(y86_x_regbyte_C(rb, ra)) // cmovle ...
-                        break;
-                    case yi_cmovl:
-                        YX(0x0F) YX(0x4C) YX(y86_x_regbyte_C(rb, ra)) // cmovl ...
-                        break;
-                    case yi_cmove:
-                        YX(0x0F) YX(0x44) YX(y86_x_regbyte_C(rb, ra)) // cmove ...
-                        break;
-                    case yi_cmovne:
-                        YX(0x0F) YX(0x45) YX(y86_x_regbyte_C(rb, ra)) // cmovne ...
-                        break;
-                    case yi_cmovge:
-                        YX(0x0F) YX(0x4D) YX(y86_x_regbyte_C(rb, ra)) // cmovge ...
-                        break;
-                    case yi_cmovg:
-                        YX(0x0F) YX(0x4F) YX(y86_x_regbyte_C(rb, ra)) // cmovg ...
-                        break;
-                    default:
-                        // Impossible
-                        fprintf(stderr, "Internal bug!\n");
-                        longjmp(y->jmp, ys_ccf);
-                        break;
-                }
+                y86_gen_x_reg(y, op, ra, rb, val);
             } else {
-                y86_gen_stat(y, ys_ins);
+                stat = ys_ins;
             }
             break;
         case yi_irmovl:
             if (ra == yr_nil && rb < yr_cnt) {
-                YX(0xB8 + rb) YXW(val) // movl ...
+                y86_gen_x_reg(y, op, ra, rb, val);
             } else {
-                y86_gen_stat(y, ys_ins);
+                stat = ys_ins;
             }
             break;
         case yi_rmmovl:
             if (ra < yr_cnt && rb < yr_cnt) {
-                y86_gen_interrupt_ready(y, ys_ima, protect_esp);
+                y86_gen_interrupt_ready(y, protect_esp);
                 YX(0x8D) YX(0xA0 + rb) // leal offset(%rb), %esp
                 if (rb == yri_esp) YX(0x24) // Extra byte for %esp
                 YXW(val)
-                y86_gen_interrupt_go(y, protect_esp);
 
-                YX(0x89) YX(y86_x_regbyte_8(ra, rb)) // movl ...
-                if (rb == yri_esp) YX(0x24) // Extra byte for %esp
-                YXA(&(y->mem[val]))
+                if (y->guard) {
+                    y86_gen_guard_go(y);
+                    if (ra != yri_esp) {
+                        YX(0x89) YX(0x04 | (ra << 3)) YX(0x24) // movl %ra, %fs:(%esp)
+                    } else {
+                        YX(0x0F) YX(0x7E) YX(0x0C) YX(0x24) // movd %mm1, %fs:(%esp)
+                    }
+                    y86_gen_guard_end(y, protect_esp);
+                } else if (rb != yri_esp) {
+                    y86_gen_interrupt_go(y, ys_ima);
+                    if (ra != yri_esp) {
+                        YX(0x89) YX(0x84 | (ra << 3)) // movl %ra, offset(%esp, %rb)
+                    } else {
+                        YX(0x0F) YX(0x7E) YX(0x8C) // movd %mm1, offset(%esp, %rb)
+                    }
+                    YX((rb << 3) | 0x04)
+                    YXW(y86_x_mid_offset(y, &(y->mem[val])))
+                } else {
+                    y86_gen_interrupt_go(y, ys_ima);
+                    y86_gen_im_base(y);
+                    if (ra != yri_esp) {
+                        YX(0x89) YX(0x84 | (ra << 3)) // movl %ra, offset(%esp)
+                    } else {
+                        YX(0x0F) YX(0x7E) YX(0x8C) // movd %mm1, offset(%esp)
+                    }
+                    YX(0x24)
+                    YXW(y86_x_mid_offset(y, &(y->mem[0])))
+                }
+                y86_gen_before(y, protect_esp);
 
-                y86_gen_stat(y, ys_imc);
+                stat = ys_imc;
             } else {
-                y86_gen_stat(y, ys_ins);
+                stat = ys_ins;
             }
             break;
         case yi_mrmovl:
             if (ra < yr_cnt && rb < yr_cnt) {
-                y86_gen_interrupt_ready(y, ys_ima, protect_esp);
+                y86_gen_interrupt_ready(y, protect_esp);
                 YX(0x8D) YX(0xA0 + rb) // leal offset(%rb), %esp
                 if (rb == yri_esp) YX(0x24) // Extra byte for %esp
                 YXW(val)
-                y86_gen_interrupt_go(y, protect_esp);
 
-                YX(0x8B) YX(y86_x_regbyte_8(ra, rb)) // movl ...
-                if (rb == yri_esp) YX(0x24) // Extra byte for %esp
-                YXA(&(y->mem[val]))
+                if (y->guard) {
+                    y86_gen_guard_go(y);
+                    YX(0x8B) YX(0x04 | (ra << 3)) YX(0x24) // movl %fs:(%esp), %ra
+                    if (ra != yri_esp) {
+                        y86_gen_guard_end(y, protect_esp);
+                    }
+                } else if (rb != yri_esp) {
+                    y86_gen_interrupt_go(y, ys_ima);
+                    YX(0x8B) YX(0x84 | (ra << 3)) YX((rb << 3) | 0x04) // movl offset(%esp, %rb), %ra
+                    YXW(y86_x_mid_offset(y, &(y->mem[val])))
+                } else {
+                    y86_gen_interrupt_go(y, ys_ima);
+                    y86_gen_im_base(y);
+                    YX(0x8B) YX(0x84 | (ra << 3)) YX(0x24) // movl offset(%esp), %ra
+                    YXW(y86_x_mid_offset(y, &(y->mem[0])))
+                }
+                if (ra != yri_esp) {
+                    y86_gen_before(y, protect_esp);
+                }
             } else {
-                y86_gen_stat(y, ys_ins);
+                stat = ys_ins;
             }
             break;
         case yi_addl:
@@ -216,27 +546,9 @@ void y86_gen_x(Y_data *y, Y_inst op, Y_reg_id ra, Y_reg_id rb, Y_word val) {
         case yi_andl:
         case yi_xorl:
             if (ra < yr_cnt && rb < yr_cnt) {
-                switch (op) {
-                    case yi_addl:
-                        YX(0x01) YX(y86_x_regbyte_C(ra, rb)) // addl ...
-                        break;
-                    case yi_subl:
-                        YX(0x29) YX(y86_x_regbyte_C(ra, rb)) // subl ...
-                        break;
-                    case yi_andl:
-                        YX(0x21) YX(y86_x_regbyte_C(ra, rb)) // andl ...
-                        break;
-                    case yi_xorl:
-                        YX(0x31) YX(y86_x_regbyte_C(ra, rb)) // xorl ...
-                        break;
-                    default:
-                        // Impossible
-                        fprintf(stderr, "Internal bug!\n");
-                        longjmp(y->jmp, ys_ccf);
-                        break;
-                }
+                y86_gen_x_reg(y, op, ra, rb, val);
             } else {
-                y86_gen_stat(y, ys_ins);
+                stat = ys_ins;
             }
             break;
         case yi_jmp:
@@ -247,103 +559,133 @@ void y86_gen_x(Y_data *y, Y_inst op, Y_reg_id ra, Y_reg_id rb, Y_word val) {
         case yi_jge:
         case yi_jg:
             if (val >= 0 && val < Y_Y_INST_SIZE) {
-                switch (op) {
-                    case yi_jmp:
-                        break;
-                    case yi_jle:
-                        YX(0x7F) YX(jmp_skip) // jg after
-                        break;
-                    case yi_jl:
-                        YX(0x7D) YX(jmp_skip) // jge after
-                        break;
-                    case yi_je:
-                        YX(0x75) YX(jmp_skip) // jne after
-                        break;
-                    case yi_jne:
-                        YX(0x74) YX(jmp_skip) // je after
-                        break;
-                    case yi_jge:
-                        YX(0x7C) YX(jmp_skip) // jl after
-                        break;
-                    case yi_jg:
-                        YX(0x7E) YX(jmp_skip) // jle after
-                        break;
-                    default:
-                        // Impossible
-                        fprintf(stderr, "Internal bug!\n");
-                        longjmp(y->jmp, ys_ccf);
-                        break;
+                Y_addr skip = 0;
+                Y_addr hot = 0;
+
+                if (op != yi_jmp) {
+                    YX(0x70 | (y86_x_cc(op) ^ 1)) skip = y->x_end; YX(0) // j(not cc) after
+                }
+
+                if (val <= y->reg[yr_pc]) {
+                    // Backward (%esp is Mid ESP): the target is hot when counted down to 0, CC is kept
+                    YX(0x0F) YX(0x6E) YX(0xD9) // movd %ecx, %mm3
+                    YX(0x8B) YX(0x8C) YX(0x24) YXW(y86_x_mid_offset(y, (Y_char *) &(y->x_hot[val]))) // movl x_hot[val], %ecx
+                    YX(0x8D) YX(0x49) YX(0xFF) // leal -1(%ecx), %ecx
+                    YX(0x89) YX(0x8C) YX(0x24) YXW(y86_x_mid_offset(y, (Y_char *) &(y->x_hot[val]))) // movl %ecx, x_hot[val]
+                    YX(0xE3) hot = y->x_end; YX(0) // jecxz hot
+                    YX(0x0F) YX(0x7E) YX(0xD9) // movd %mm3, %ecx
                 }
+                y86_gen_goto(y, val, protect_esp, ys_aok);
 
-                if (!y->x_map[val]) {
-                    y->x_map[val] = Y_BAD_ADDR;
+                if (hot) {
+                    y86_gen_short_link(y, hot);
+                    YX(0x0F) YX(0x7E) YX(0xD9) // movd %mm3, %ecx
+                    YX(0xC7) YX(0x84) YX(0x24) YXW(y86_x_mid_offset(y, (Y_char *) &(y->x_pend))) YXW(val) // movl $val, x_pend(%esp)
+                    y86_gen_goto(y, val, protect_esp, ys_hot);
+                }
+                if (skip) {
+                    y86_gen_short_link(y, skip);
                 }
-                y86_gen_after_goto(y, (Y_addr) &(y->x_map[val]), protect_esp);
             } else {
-                y86_gen_stat(y, ys_adp);
+                stat = ys_adp;
             }
             break;
         case yi_call:
             if (val >= 0 && val < Y_Y_INST_SIZE) {
                 YX(0x8D) YX(0x64) YX(0x24) YX(0xFC) // leal -4(%esp), %esp
 
-                y86_gen_interrupt_ready(y, ys_ima, protect_esp);
-                y86_gen_interrupt_go(y, protect_esp);
+                y86_gen_interrupt_ready(y, protect_esp);
 
-                YX(0x8D) YX(0xA4) YX(0x24) YXW(4 + (Y_word) &(y->mem[0])) // leal offset+4(%esp), %esp
-                YX(0x68) YXW(y->reg[yr_pc] + 5) // push %pc+5
-                YX(0x8D) YX(0xA4) YX(0x24) YXW(0 - (Y_word) &(y->mem[0])) // leal -offset(%esp), %esp
+                if (y->guard) {
+                    y86_gen_guard_go(y);
+                    YX(0xC7) YX(0x04) YX(0x24) // movl %pc+5, %fs:(%esp)
+                } else {
+                    y86_gen_interrupt_go(y, ys_ima);
+                    y86_gen_im_base(y);
+                    YX(0xC7) YX(0x84) YX(0x24) YXW(y86_x_mid_offset(y, &(y->mem[0]))) // movl %pc+5, offset(%esp)
+                }
+                YXW(y->reg[yr_pc] + 5)
 
-                y86_gen_stat(y, ys_imc);
+                YX(0x0F) YX(0x7E) YX(0xD4) // movd %mm2, %esp
+                y86_gen_ret_push(y, y->reg[yr_pc] + 5);
+                y86_gen_before(y, protect_esp);
 
-                if (!y->x_map[val]) {
-                    y->x_map[val] = Y_BAD_ADDR;
-                }
-                y86_gen_after_goto(y, (Y_addr) &(y->x_map[val]), protect_esp);
+                y86_gen_goto(y, val, protect_esp, ys_imc);
             } else {
-                y86_gen_stat(y, ys_adp);
+                stat = ys_adp;
             }
             break;
         case yi_ret:
-            y86_gen_stat(y, ys_ret);
+            y86_gen_ret(y);
+            stat = ys_ret;
 
             break;
         case yi_pushl:
             if (ra < yr_cnt && rb == yr_nil) {
                 YX(0x8D) YX(0x64) YX(0x24) YX(0xFC) // leal -4(%esp), %esp
 
-                y86_gen_interrupt_ready(y, ys_ima, protect_esp);
-                y86_gen_interrupt_go(y, protect_esp);
-
-                YX(0x8D) YX(0x64) YX(0x24) YX(0x04) // leal 4(%esp), %esp // TODO: need optimization
-
-                YX(0x89) YX(y86_x_regbyte_8(ra, yri_esp)) // movl %ra, offset-4(%esp)
-                YX(0x24) // Extra byte for %esp
-                YXA(&(y->mem[0]) - 4)
-
-                YX(0x8D) YX(0x64) YX(0x24) YX(0xFC) // leal -4(%esp), %esp
+                y86_gen_interrupt_ready(y, protect_esp);
+
+                if (y->guard) {
+                    if (ra != yri_esp) {
+                        y86_gen_guard_go(y);
+                        YX(0x89) YX(0x04 | (ra << 3)) YX(0x24) // movl %ra, %fs:(%esp)
+                    } else {
+                        // Push the old %esp, %esp + 4
+                        YX(0x8D) YX(0x64) YX(0x24) YX(0x04) // leal 4(%esp), %esp
+                        YX(0x0F) YX(0x6E) YX(0xDC) // movd %esp, %mm3
+                        YX(0x8D) YX(0x64) YX(0x24) YX(0xFC) // leal -4(%esp), %esp
+                        y86_gen_guard_go(y);
+                        YX(0x0F) YX(0x7E) YX(0x1C) YX(0x24) // movd %mm3, %fs:(%esp)
+                    }
+                } else if (ra != yri_esp) {
+                    y86_gen_interrupt_go(y, ys_ima);
+                    y86_gen_im_base(y);
+                    YX(0x89) YX(0x84 | (ra << 3)) YX(0x24) // movl %ra, offset(%esp)
+                    YXW(y86_x_mid_offset(y, &(y->mem[0])))
+                } else {
+                    // Push the old %esp, mm4 + 4
+                    y86_gen_interrupt_go(y, ys_ima);
+                    YX(0x0F) YX(0x6F) YX(0xDC) // movq %mm4, %mm3
+                    YX(0x0F) YX(0xFE) YX(0x9C) YX(0x24) YXW(y86_x_mid_offset(y, (Y_char *) &(y->x_num[4]))) // paddd 4(%esp), %mm3
+                    y86_gen_im_base(y);
+                    YX(0x0F) YX(0x7E) YX(0x9C) YX(0x24) // movd %mm3, offset(%esp)
+                    YXW(y86_x_mid_offset(y, &(y->mem[0])))
+                }
+                y86_gen_before(y, protect_esp);
 
-                y86_gen_stat(y, ys_imc);
+                stat = ys_imc;
             } else {
-                y86_gen_stat(y, ys_ins);
+                stat = ys_ins;
             }
             break;
         case yi_popl:
             if (ra < yr_cnt && rb == yr_nil) {
-                y86_gen_interrupt_ready(y, ys_ima, protect_esp);
-                y86_gen_interrupt_go(y, protect_esp);
-
-                YX(0x8D) YX(0x64) YX(0x24) YX(0x04) // leal 4(%esp), %esp
+                y86_gen_interrupt_ready(y, protect_esp);
+
+                if (y->guard) {
+                    // %esp is still the Y %esp after
+                    y86_gen_guard_go(y);
+                    YX(0x8B) YX(0x04 | (ra << 3)) YX(0x24) // movl %fs:(%esp), %ra
+                } else {
+                    y86_gen_interrupt_go(y, ys_ima);
+                    y86_gen_im_base(y);
+                    YX(0x8B) YX(0x84 | (ra << 3)) YX(0x24) // movl offset(%esp), %ra
+                    YXW(y86_x_mid_offset(y, &(y->mem[0])))
+                }
 
-                YX(0x8B) YX(y86_x_regbyte_8(ra, yri_esp)) // movl offset-4(%esp), $ra
-                YX(0x24) // Extra byte for %esp
-                YXA(&(y->mem[0]) - 4)
+                if (ra != yri_esp) {
+                    if (!y->guard) {
+                        y86_gen_before(y, protect_esp);
+                    }
+                    YX(0x8D) YX(0x64) YX(0x24) YX(0x04) // leal 4(%esp), %esp
+                }
             } else {
-                y86_gen_stat(y, ys_ins);
+                stat = ys_ins;
             }
             break;
         case yi_bad:
-            y86_gen_stat(y, ys_ins);
+            stat = ys_ins;
             break;
         default:
             // Impossible
@@ -353,16 +695,19 @@ void y86_gen_x(Y_data *y, Y_inst op, Y_reg_id ra, Y_reg_id rb, Y_word val) {
     }
 
     y86_gen_after(y, protect_esp);
-    y86_gen_check(y, protect_esp);
+    y86_gen_check(y, protect_esp, stat);
+
+    // If the next inst is reached (after call: returned to)
+    return op != yi_jmp && op != yi_ret && (stat == ys_aok || stat == ys_imc);
 }
 
-void y86_parse(Y_data *y, Y_char **inst, Y_char *end) {
+Y_inst y86_decode(Y_char **inst, Y_char *end, Y_reg_id *ra, Y_reg_id *rb, Y_word *val) {
     Y_inst op = **inst & 0xFF;
     (*inst)++;
 
-    Y_reg_id ra = yr_nil;
-    Y_reg_id rb = yr_nil;
-    Y_word val = 0;
+    *ra = yr_nil;
+    *rb = yr_nil;
+    *val = 0;
 
     switch (op) {
         case yi_halt:
@@ -385,8 +730,8 @@ void y86_parse(Y_data *y, Y_char **inst, Y_char *end) {
         case yi_popl:
             // Read registers
             if (*inst == end) op = yi_bad;
-            ra = HIGH(**inst);
-            rb = LOW(**inst);
+            *ra = HIGH(**inst);
+            *rb = LOW(**inst);
             (*inst)++;
 
             break;
@@ -396,13 +741,13 @@ void y86_parse(Y_data *y, Y_char **inst, Y_char *end) {
         case yi_mrmovl:
             // Read registers
             if (*inst == end) op = yi_bad;
-            ra = HIGH(**inst);
-            rb = LOW(**inst);
+            *ra = HIGH(**inst);
+            *rb = LOW(**inst);
             (*inst)++;
 
             // Read value
             if (*inst + sizeof(Y_word) > end) op = yi_bad;
-            val = IO_WORD(*inst);
+            *val = IO_WORD(*inst);
             *inst += sizeof(Y_word);
 
             break;
@@ -417,7 +762,7 @@ void y86_parse(Y_data *y, Y_char **inst, Y_char *end) {
         case yi_call:
             // Read value
             if (*inst + sizeof(Y_word) > end) op = yi_bad;
-            val = IO_WORD(*inst);
+            *val = IO_WORD(*inst);
             *inst += sizeof(Y_word);
 
             break;
@@ -429,53 +774,756 @@ void y86_parse(Y_data *y, Y_char **inst, Y_char *end) {
             break;
     }
 
-    y86_gen_x(y, op, ra, rb, val);
+    return op;
+}
+
+void y86_decode_pc(Y_data *y, Y_word pc) {
+    Y_char *inst = &(y->mem[pc]);
+    Y_reg_id ra;
+    Y_reg_id rb;
+
+    // Decoded once, until the bytes are written (see y86_unload_decode)
+    if ((y->d_op[pc] & 0xFF) == yi_nil) {
+        y->d_op[pc] = y86_decode(&inst, &(y->mem[Y_MEM_SIZE]), &ra, &rb, &(y->d_val[pc]));
+        y->d_reg[pc] = ra << 4 | rb;
+        y->d_len[pc] = inst - &(y->mem[pc]);
+    }
+}
+
+void y86_unload_decode(Y_data *y, Y_word addr) {
+    Y_word pos;
+
+    // Insts covering the written word (up to 6 bytes long)
+    for (pos = addr - 5; pos < addr + 4; ++pos) {
+        if (pos >= 0 && pos < Y_Y_INST_SIZE) {
+            y->d_op[pos] = yi_nil;
+        }
+    }
+}
+
+Y_word y86_parse(Y_data *y, Y_char **inst, Y_char *end) {
+    Y_word pc = *inst - &(y->mem[0]);
+    Y_reg_id ra;
+    Y_reg_id rb;
+    Y_word val;
+    Y_inst op;
+
+    // Decoded table in the code area
+    if (pc >= 0 && pc < Y_Y_INST_SIZE) {
+        y86_decode_pc(y, pc);
+
+        op = y->d_op[pc] & 0xFF;
+        ra = HIGH(y->d_reg[pc]);
+        rb = LOW(y->d_reg[pc]);
+        val = y->d_val[pc];
+        *inst += y->d_len[pc];
+    } else {
+        op = y86_decode(inst, end, &ra, &rb, &val);
+    }
+
+    return y86_gen_x(y, op, ra, rb, val);
+}
+
+Y_reg_id y86_t_temp(Y_reg_id ra, Y_reg_id rb) {
+    // A host register not used by the inst, saved in %mm3
+    Y_word index = yri_eax;
+
+    while (index == (Y_word) ra || index == (Y_word) rb || index == yri_esp) {
+        ++index;
+    }
+
+    return index;
+}
+
+void y86_gen_t_steps(Y_data *y, Y_word steps) {
+    // Steps given back to mm6, CC is kept
+    YX(0x0F) YX(0x6E) YX(0xE8) // movd %eax, %mm5
+    YX(0x0F) YX(0x7E) YX(0xF0) // movd %mm6, %eax
+    YX(0x8D) YX(0x80) YXW(steps) // leal steps(%eax), %eax
+    YX(0x0F) YX(0x6E) YX(0xF0) // movd %eax, %mm6
+    YX(0x0F) YX(0x7E) YX(0xE8) // movd %mm5, %eax
+}
+
+Y_addr y86_gen_t_take(Y_data *y, Y_word steps) {
+    // Steps taken from mm6 if enough, CC is kept: the sign is taken by psrad, tested by jecxz
+    // Else they are given back, then a jmp rel32 (returned, linked by the caller)
+    Y_addr ok;
+    Y_addr fail;
+
+    YX(0x0F) YX(0x6E) YX(0xE9) // movd %ecx, %mm5
+    YX(0x0F) YX(0x7E) YX(0xF1) // movd %mm6, %ecx
+    YX(0x8D) YX(0x89) YXW(-steps) // leal -steps(%ecx), %ecx
+    YX(0x0F) YX(0x6E) YX(0xF1) // movd %ecx, %mm6
+    YX(0x0F) YX(0x6E) YX(0xD9) // movd %ecx, %mm3
+    YX(0x0F) YX(0x72) YX(0xE3) YX(31) // psrad $31, %mm3
+    YX(0x0F) YX(0x7E) YX(0xD9) // movd %mm3, %ecx
+    YX(0xE3) ok = y->x_end; YX(0) // jecxz ok
+    YX(0x0F) YX(0x7E) YX(0xE9) // movd %mm5, %ecx
+    y86_gen_t_steps(y, steps);
+    YX(0xE9) fail = y->x_end; YXW(0) // jmp fail
+    y86_gen_short_link(y, ok);
+    YX(0x0F) YX(0x7E) YX(0xE9) // movd %mm5, %ecx
+
+    return fail;
+}
+
+void y86_link_rel(Y_addr from, Y_addr value) {
+    // from is the rel32 word of a jump
+    IO_WORD(from) = value - (from + sizeof(Y_word));
+}
+
+void y86_gen_t_exit(Y_data *y, Y_reg_id t, Y_word steps, Y_addr code) {
+    // Side exit before an inst (CC pushed, %t in %mm3): the code of the inst runs it again
+    YX(0x9D) // popfl
+    YX(0x0F) YX(0x7E) YX(0xD8 | t) // movd %mm3, %t
+    y86_gen_t_steps(y, steps);
+    y86_gen_raw_jmp(y, code);
+}
+
+void y86_gen_t_addr(Y_data *y, Y_reg_id t, Y_reg_id rb, Y_word val) {
+    if (rb != yri_esp) {
+        YX(0x8D) YX(y86_x_regbyte_8(t, rb)) YXW(val) // leal val(%rb), %t
+    } else {
+        YX(0x0F) YX(0x7E) YX(0xC8 | t) // movd %mm1, %t
+        YX(0x8D) YX(y86_x_regbyte_8(t, t)) YXW(val) // leal val(%t), %t
+    }
+}
+
+void y86_gen_t_check(Y_data *y, Y_reg_id t, Y_word write, Y_word steps, Y_addr code) {
+    // Assert: %esp is Mid ESP, %t is the address
+    // Exits if out of mem (ys_ima), or if the code may be written (ys_imc, the inst is not run)
+    Y_addr fail;
+    Y_addr ok;
+
+    YX(0x9C) // pushfl
+    YX(0xF7) YX(0xC0 | t) YXW(~(Y_MEM_SIZE - 1)) // testl $not_mem, %t
+    if (write) {
+        YX(0x75) fail = y->x_end; YX(0) // jnz fail
+        YX(0x3B) YX(0x84 | (t << 3)) YX(0x24) YXW(y86_x_mid_offset(y, (Y_char *) &(y->reg[yr_len])) + 4) // cmpl len, %t
+        YX(0x7F) ok = y->x_end; YX(0) // jg ok
+        y86_gen_short_link(y, fail);
+    } else {
+        YX(0x74) ok = y->x_end; YX(0) // jz ok
+    }
+    y86_gen_t_exit(y, t, steps, code);
+    y86_gen_short_link(y, ok);
+    YX(0x9D) // popfl
+}
+
+void y86_gen_t_store(Y_data *y, Y_reg_id t, Y_reg_id ra) {
+    if (ra != yri_esp) {
+        YX(0x89) YX(0x84 | (ra << 3)) // movl %ra, offset(%esp, %t)
+    } else {
+        YX(0x0F) YX(0x7E) YX(0x8C) // movd %mm1, offset(%esp, %t)
+    }
+    YX((t << 3) | 0x04)
+    YXW(y86_x_mid_offset(y, &(y->mem[0])))
+}
+
+void y86_gen_t_inst(Y_data *y, Y_inst op, Y_reg_id ra, Y_reg_id rb, Y_word val, Y_word steps, Y_addr code) {
+    // An inst of a superblock, not a jump (call: val is the return PC, ret: the PC expected)
+    // Assert: %esp is Mid ESP, the registers are valid
+    Y_word protect_esp = (ra == yri_esp) || (rb == yri_esp);
+    Y_reg_id t = y86_t_temp(ra, rb);
+    Y_addr fail;
+    Y_addr ok;
+
+    switch (op) {
+        case yi_nop:
+            // Nothing
+            break;
+        case yi_rrmovl:
+        case yi_cmovle:
+        case yi_cmovl:
+        case yi_cmove:
+        case yi_cmovne:
+        case yi_cmovge:
+        case yi_cmovg:
+        case yi_irmovl:
+        case yi_addl:
+        case yi_subl:
+        case yi_andl:
+        case yi_xorl:
+            y86_gen_before(y, protect_esp);
+            y86_gen_x_reg(y, op, ra, rb, val);
+            y86_gen_after(y, protect_esp);
+            if (protect_esp) {
+                YX(0x0F) YX(0x7E) YX(0xD4) // movd %mm2, %esp
+            }
+            break;
+        case yi_rmmovl:
+            YX(0x0F) YX(0x6E) YX(0xD8 | t) // movd %t, %mm3
+            y86_gen_t_addr(y, t, rb, val);
+            y86_gen_t_check(y, t, 1, steps, code);
+            y86_gen_t_store(y, t, ra);
+            YX(0x0F) YX(0x7E) YX(0xD8 | t) // movd %mm3, %t
+            break;
+        case yi_mrmovl:
+            YX(0x0F) YX(0x6E) YX(0xD8 | t) // movd %t, %mm3
+            y86_gen_t_addr(y, t, rb, val);
+            y86_gen_t_check(y, t, 0, steps, code);
+            if (ra != yri_esp) {
+                YX(0x8B) YX(0x84 | (ra << 3)) YX((t << 3) | 0x04) // movl offset(%esp, %t), %ra
+                YXW(y86_x_mid_offset(y, &(y->mem[0])))
+            } else {
+                YX(0x8B) YX(0x84 | (t << 3)) YX((t << 3) | 0x04) // movl offset(%esp, %t), %t
+                YXW(y86_x_mid_offset(y, &(y->mem[0])))
+                YX(0x0F) YX(0x6E) YX(0xC8 | t) // movd %t, %mm1
+            }
+            YX(0x0F) YX(0x7E) YX(0xD8 | t) // movd %mm3, %t
+            break;
+        case yi_call:
+        case yi_pushl:
+            YX(0x0F) YX(0x6E) YX(0xD8 | t) // movd %t, %mm3
+            YX(0x0F) YX(0x7E) YX(0xC8 | t) // movd %mm1, %t
+            YX(0x8D) YX(0x40 | (t << 3) | t) YX(0xFC) // leal -4(%t), %t
+            y86_gen_t_check(y, t, 1, steps, code);
+            if (op == yi_call) {
+                YX(0xC7) YX(0x84) YX((t << 3) | 0x04) YXW(y86_x_mid_offset(y, &(y->mem[0]))) YXW(val) // movl $pc, offset(%esp, %t)
+            } else {
+                y86_gen_t_store(y, t, ra); // The old %esp if ra is %esp
+            }
+            YX(0x0F) YX(0x6E) YX(0xC8 | t) // movd %t, %mm1
+            YX(0x0F) YX(0x7E) YX(0xD8 | t) // movd %mm3, %t
+            break;
+        case yi_popl:
+            YX(0x0F) YX(0x6E) YX(0xD8 | t) // movd %t, %mm3
+            YX(0x0F) YX(0x7E) YX(0xC8 | t) // movd %mm1, %t
+            y86_gen_t_check(y, t, 0, steps, code);
+            if (ra != yri_esp) {
+                YX(0x8B) YX(0x84 | (ra << 3)) YX((t << 3) | 0x04) // movl offset(%esp, %t), %ra
+                YXW(y86_x_mid_offset(y, &(y->mem[0])))
+                YX(0x8D) YX(0x40 | (t << 3) | t) YX(0x04) // leal 4(%t), %t
+            } else {
+                YX(0x8B) YX(0x84 | (t << 3)) YX((t << 3) | 0x04) // movl offset(%esp, %t), %t
+                YXW(y86_x_mid_offset(y, &(y->mem[0])))
+            }
+            YX(0x0F) YX(0x6E) YX(0xC8 | t) // movd %t, %mm1
+            YX(0x0F) YX(0x7E) YX(0xD8 | t) // movd %mm3, %t
+            break;
+        case yi_ret:
+            // Returns to the call in the superblock, else exits
+            YX(0x0F) YX(0x6E) YX(0xD8 | t) // movd %t, %mm3
+            YX(0x0F) YX(0x7E) YX(0xC8 | t) // movd %mm1, %t
+            YX(0x9C) // pushfl
+            YX(0xF7) YX(0xC0 | t) YXW(~(Y_MEM_SIZE - 1)) // testl $not_mem, %t
+            YX(0x75) fail = y->x_end; YX(0) // jnz fail
+            YX(0x81) YX(0xBC) YX((t << 3) | 0x04) YXW(y86_x_mid_offset(y, &(y->mem[0])) + 4) YXW(val) // cmpl $pc, offset(%esp, %t)
+            YX(0x74) ok = y->x_end; YX(0) // je ok
+            y86_gen_short_link(y, fail);
+            y86_gen_t_exit(y, t, steps, code);
+            y86_gen_short_link(y, ok);
+            YX(0x9D) // popfl
+            YX(0x8D) YX(0x40 | (t << 3) | t) YX(0x04) // leal 4(%t), %t
+            YX(0x0F) YX(0x6E) YX(0xC8 | t) // movd %t, %mm1
+            YX(0x0F) YX(0x7E) YX(0xD8 | t) // movd %mm3, %t
+            break;
+        default:
+            // Impossible
+            fprintf(stderr, "Internal bug!\n");
+            longjmp(y->jmp, ys_ccf);
+            break;
+    }
+}
+
+Y_word y86_x_used(Y_data *y) {
+    // Code and stubs
+    return y->x_end - &(y->x_inst[0]) + (&(y->x_inst[Y_X_INST_SIZE]) - y->x_stub);
 }
 
 void y86_load_reset(Y_data *y) {
     Y_word index;
+
+    y->x_bytes += y86_x_used(y);
+    memset(&(y->x_rev[0]), 0, (y->x_end - &(y->x_inst[0]) + 1) * sizeof(Y_word));
     for (index = 0; index < Y_Y_INST_SIZE; ++index) {
         y->x_map[index] = 0;
+        y->x_hot[index] = Y_T_HOT;
+        y->x_link[index] = 0;
+        y->x_fast[index] = 0;
+        y->x_run[index] = 0;
+        y->t_in[index] = 0;
     }
     y->x_end = &(y->x_inst[0]);
+    y->x_stub = &(y->x_inst[Y_X_INST_SIZE]);
+
+    // Dispatch of the stubs, a block not loaded is reached
+    y86_gen_check(y, 0, ys_stp);
+
+    // Compiled code of the shadow stack is dropped too
+    for (index = 0; index < Y_S_SIZE; ++index) {
+        y->s_stk[index * 2] = -1;
+    }
+    y->s_pos = 0;
+    y->s_link = 0;
+}
+
+void y86_link_ret(Y_data *y, Y_addr value) {
+    // The code returned to from the last call, the next inst (or a jump to it)
+    if (y->s_link) {
+        IO_WORD(y->s_link) = value - &(y->x_inst[0]);
+        y->s_link = 0;
+    }
 }
 
-void y86_load(Y_data *y, Y_char *begin) {
-    Y_char *inst = begin;
-    Y_char *end = &(y->mem[y->reg[yr_len]]);
-    while (*end) {
+Y_char *y86_load_end(Y_data *y, Y_char *inst) {
+    // The code area covers all compiled insts, it is never cut (see ys_imc in y86_go)
+    if (y->reg[yr_len] < inst - &(y->mem[0])) {
+        y->reg[yr_len] = inst - &(y->mem[0]);
+    }
+
+    while (y->reg[yr_len] < Y_MEM_SIZE && y->mem[y->reg[yr_len]]) {
         y->reg[yr_len]++;
-        end = &(y->mem[y->reg[yr_len]]);
     }
 
-    Y_word pc = y->reg[yr_pc];
+    return &(y->mem[y->reg[yr_len]]);
+}
 
-    while (inst != end) {
-        while (inst != end) {
-            y->reg[yr_pc] = inst - begin;
+Y_word y86_x_run_inst(Y_data *y, Y_word pos) {
+    // Never stopped or interrupted: nop and register insts (valid registers), not loaded
+    Y_reg_id ra;
+    Y_reg_id rb;
 
-            if (y->x_map[y->reg[yr_pc]] && y->x_map[y->reg[yr_pc]] != Y_BAD_ADDR) {
-                y86_gen_raw_jmp(y, y->x_map[y->reg[yr_pc]]);
-            } else {
-                y86_link_x_map(y, y->reg[yr_pc]);
-                y86_parse(y, &inst, end);
-            }
+    if (pos >= Y_Y_INST_SIZE || y86_x_loaded(y, pos)) {
+        return 0;
+    }
+
+    y86_decode_pc(y, pos);
+    ra = HIGH(y->d_reg[pos]);
+    rb = LOW(y->d_reg[pos]);
+
+    switch (y->d_op[pos] & 0xFF) {
+        case yi_nop:
+            return 1;
+        case yi_rrmovl:
+        case yi_cmovle:
+        case yi_cmovl:
+        case yi_cmove:
+        case yi_cmovne:
+        case yi_cmovge:
+        case yi_cmovg:
+        case yi_addl:
+        case yi_subl:
+        case yi_andl:
+        case yi_xorl:
+            return ra < yr_cnt && rb < yr_cnt;
+        case yi_irmovl:
+            return ra == yr_nil && rb < yr_cnt;
+        default:
+            return 0;
+    }
+}
+
+void y86_gen_run_inst(Y_data *y, Y_word pos, Y_word check) {
+    Y_inst op = y->d_op[pos] & 0xFF;
+    Y_reg_id ra = HIGH(y->d_reg[pos]);
+    Y_reg_id rb = LOW(y->d_reg[pos]);
+    Y_word protect_esp = (ra == yri_esp) || (rb == yri_esp);
+
+    y86_gen_before(y, protect_esp);
+    if (op != yi_nop) {
+        y86_gen_x_reg(y, op, ra, rb, y->d_val[pos]);
+    } else if (check) {
+        YX(0x66) YX(0x90) // xchg %ax, %ax (room for a jump, see y86_unload_x)
+    }
+    y86_gen_after(y, protect_esp);
+
+    if (check) {
+        y86_gen_check(y, protect_esp, ys_aok);
+    } else if (protect_esp) {
+        YX(0x0F) YX(0x7E) YX(0xD4) // movd %mm2, %esp
+    }
+}
+
+Y_word y86_load_run(Y_data *y, Y_char **inst) {
+    // Register insts in a row: the first one is counted when entered, the rest are taken at once
+    // and run without checks, one by one (checked each) if fewer steps are left
+    Y_word pos[Y_T_SIZE];
+    Y_word size = 0;
+    Y_word pc = *inst - &(y->mem[0]);
+    Y_char *end = y86_load_end(y, *inst);
+    Y_word index;
+    Y_addr fail;
+    Y_addr join;
+
+    while (size < Y_T_SIZE && &(y->mem[pc]) < end && y86_x_run_inst(y, pc)) {
+        pos[size++] = pc;
+        pc += y->d_len[pc];
+        end = y86_load_end(y, &(y->mem[pc]));
+    }
+
+    if (size < Y_T_RUN) {
+        return 0;
+    }
+
+    y86_link_x_map(y, pos[0]);
+    fail = y86_gen_t_take(y, size - 1);
+    for (index = 0; index < size; ++index) {
+        y->x_run[pos[index]] = pos[0] + 1;
+        if (index && index + Y_T_RUN <= size) {
+            y->x_fast[pos[index]] = y->x_end;
+            y->x_left[pos[index]] = size - 1 - index;
+        }
+        y86_gen_run_inst(y, pos[index], 0);
+    }
+    YX(0xE9) join = y->x_end; YXW(0) // jmp join
+
+    // Other insts are entered here, or by an entry of their own once jumped to (see y86_link_x_fast)
+    y86_link_rel(fail, y->x_end);
+    for (index = 0; index < size; ++index) {
+        if (index) {
+            y86_link_x_map(y, pos[index]);
         }
+        y86_gen_run_inst(y, pos[index], index + 1 < size);
+    }
+
+    y86_link_rel(join, y->x_end);
+    y86_gen_check(y, 1, ys_aok);
+
+    *inst = &(y->mem[pc]);
+    return 1;
+}
 
-        for (inst = begin; inst != end; ++inst) {
-            if (y->x_map[inst - begin] == Y_BAD_ADDR) break;
+void y86_link_x_fast(Y_data *y) {
+    // After a block: jump targets inside a run get an entry to its unchecked copy, taking the insts left
+    Y_word pos;
+    Y_addr entry;
+
+    for (pos = 0; pos < Y_Y_INST_SIZE; ++pos) {
+        if (y->x_fast[pos] && y->x_link[pos]) {
+            entry = y->x_end;
+            y86_link_rel(y86_gen_t_take(y, y->x_left[pos]), y->x_map[pos]);
+            y86_gen_raw_jmp(y, y->x_fast[pos]);
+
+            // The checked copy keeps its reverse map (returned to by the checks before it)
+            y->x_fast[pos] = 0;
+            y->x_map[pos] = entry;
+            y->x_rev[entry - &(y->x_inst[0])] = pos + 1;
+            y86_link_x_entry(y, pos);
         }
+    }
+}
+
+void y86_load_block(Y_data *y, Y_word pc) {
+    // A block from pc: until an inst not falling through, an inst loaded already, or the end of code
+    Y_char *begin = &(y->mem[0]);
+    Y_char *inst = &(y->mem[pc]);
+    Y_char *end = y86_load_end(y, inst);
+    Y_word next = 1;
 
-        y86_link_x_map(y, y->reg[yr_pc] + 1);
+    while (next && inst < end && !y86_x_loaded(y, inst - begin)) {
+        y->reg[yr_pc] = inst - begin;
+
+        y86_link_ret(y, y->x_end);
+        if (!y86_load_run(y, &inst)) {
+            y86_link_x_map(y, y->reg[yr_pc]);
+            next = y86_parse(y, &inst, &(y->mem[Y_MEM_SIZE]));
+        }
+        end = y86_load_end(y, inst);
+    }
+
+    y->reg[yr_pc] = pc;
+    pc = inst - begin;
+
+    if (!next) {
+        // Stopped (checked, never falls through)
+        y86_link_x_tail(y, pc);
+        YX(0xCC) // int3
+    } else if (inst < end) {
+        y86_link_ret(y, y->x_map[pc]);
+        y86_link_x_tail(y, pc);
+        y86_gen_raw_jmp(y, y->x_map[pc]);
+    } else {
+        // Halt at the end of code
+        y86_link_ret(y, y->x_end);
+        if (pc < Y_Y_INST_SIZE) {
+            y86_link_x_map(y, pc);
+        } else {
+            y86_link_x_tail(y, pc);
+        }
         y86_gen_protect(y);
-    };
+        y86_link_x_tail(y, pc + 1);
+        YX(0xCC) // int3
+    }
+
+    y86_link_x_fast(y);
+}
+
+void y86_load(Y_data *y, Y_word pc) {
+    // If x_inst is full, all blocks are flushed (nothing runs in x_inst here) and the block is loaded again
+    volatile Y_word flushed = 0;
+
+    if (setjmp(y->x_full)) {
+        if (flushed) {
+            fprintf(stderr, "Too large compiled instruction size (block: 0x%x)\n", pc);
+            longjmp(y->jmp, ys_ccf);
+        }
+
+        flushed = 1;
+        y->x_flush++;
+        y86_load_reset(y);
+    }
+
+    y86_load_block(y, pc);
+    y->x_miss++;
+}
+
+Y_word y86_load_trace_block(Y_data *y, Y_word pc) {
+    // A superblock from a hot loop head: one iteration following jmp, call and ret, closed by a jump back to pc
+    // No check is called inside: the steps of an iteration are taken at the head, an inst which may fault
+    // (or write the code) exits to its own code before it is run, other jumps exit as jumps
+    Y_word t_pc[Y_T_SIZE];
+    Y_inst t_op[Y_T_SIZE];
+    Y_reg_id t_ra[Y_T_SIZE];
+    Y_reg_id t_rb[Y_T_SIZE];
+    Y_word t_val[Y_T_SIZE]; // Jump target, or the return PC of call and ret
+    Y_word t_ret[Y_T_SIZE]; // Calls not returned yet
+    Y_word size = 0;
+    Y_word depth = 0;
+    Y_word next = pc;
+    Y_word closed = 0;
+    Y_word index;
+    Y_char *inst;
+    Y_addr head;
+    Y_addr entry;
+    Y_addr ok;
+
+    // Not hot again (until counted down again)
+    y->x_hot[pc] = 0;
+
+    while (!closed) {
+        if (size == Y_T_SIZE || next >= y->reg[yr_len]) {
+            return 0;
+        }
+
+        inst = &(y->mem[next]);
+        t_pc[size] = next;
+        t_op[size] = y86_decode(&inst, &(y->mem[y->reg[yr_len]]), &(t_ra[size]), &(t_rb[size]), &(t_val[size]));
+        next = inst - &(y->mem[0]);
+
+        switch (t_op[size]) {
+            case yi_nop:
+                break;
+            case yi_irmovl:
+                if (t_ra[size] != yr_nil || t_rb[size] >= yr_cnt) return 0;
+                break;
+            case yi_rrmovl:
+            case yi_cmovle:
+            case yi_cmovl:
+            case yi_cmove:
+            case yi_cmovne:
+            case yi_cmovge:
+            case yi_cmovg:
+            case yi_rmmovl:
+            case yi_mrmovl:
+            case yi_addl:
+            case yi_subl:
+            case yi_andl:
+            case yi_xorl:
+                if (t_ra[size] >= yr_cnt || t_rb[size] >= yr_cnt) return 0;
+                break;
+            case yi_pushl:
+            case yi_popl:
+                if (t_ra[size] >= yr_cnt || t_rb[size] != yr_nil) return 0;
+                break;
+            case yi_jmp:
+            case yi_jle:
+            case yi_jl:
+            case yi_je:
+            case yi_jne:
+            case yi_jge:
+            case yi_jg:
+                if (t_val[size] < 0 || t_val[size] >= Y_Y_INST_SIZE || next >= Y_Y_INST_SIZE) return 0;
+                if (t_val[size] == pc) {
+                    closed = 1;
+                } else if (t_op[size] == yi_jmp) {
+                    next = t_val[size];
+                }
+                break;
+            case yi_call:
+                if (t_val[size] < 0 || t_val[size] >= Y_Y_INST_SIZE) return 0;
+                t_ret[depth++] = next;
+                next = t_val[size];
+                t_val[size] = t_ret[depth - 1];
+                break;
+            case yi_ret:
+                if (!depth) return 0;
+                next = t_ret[--depth];
+                t_val[size] = next;
+                break;
+            default:
+                // halt, bad
+                return 0;
+        }
+
+        ++size;
+    }
+
+    // Exits go to the code of the insts
+    for (index = 0; index < size; ++index) {
+        if (!y86_x_loaded(y, t_pc[index])) {
+            y86_load_block(y, t_pc[index]);
+            y->x_miss++;
+        }
+    }
+    y->reg[yr_pc] = pc;
+    head = y->x_map[pc];
+    entry = y->x_end;
+
+    // The head is counted when entered, take the rest and the next head
+    y86_link_rel(y86_gen_t_take(y, size), head);
+
+    for (index = 0; index < size; ++index) {
+        switch (t_op[index]) {
+            case yi_jmp:
+            case yi_jle:
+            case yi_jl:
+            case yi_je:
+            case yi_jne:
+            case yi_jge:
+            case yi_jg:
+                if (t_val[index] == pc) {
+                    // Closed, the next iteration or the fall through
+                    if (t_op[index] == yi_jmp) {
+                        y86_gen_raw_jmp(y, entry);
+                    } else {
+                        YX(0x0F) YX(0x80 | y86_x_cc(t_op[index])) YXW(entry - (y->x_end + sizeof(Y_word))) // jcc entry
+                        y86_gen_t_steps(y, 1);
+                        y86_gen_goto(y, t_pc[index] + 5, 0, ys_aok);
+                    }
+                } else if (t_op[index] != yi_jmp) {
+                    YX(0x70 | (y86_x_cc(t_op[index]) ^ 1)) ok = y->x_end; YX(0) // j(not cc) ok
+                    y86_gen_t_steps(y, size - index);
+                    y86_gen_goto(y, t_val[index], 0, ys_aok);
+                    y86_gen_short_link(y, ok);
+                }
+                break;
+            default:
+                y86_gen_t_inst(
+                    y, t_op[index], t_ra[index], t_rb[index], t_val[index],
+                    size - index, t_pc[index] == pc ? head : y->x_map[t_pc[index]]
+                );
+                break;
+        }
+    }
+
+    for (index = 0; index < size; ++index) {
+        y->t_in[t_pc[index]] |= 1;
+    }
+    y->t_in[pc] |= 2;
+
+    y->x_map[pc] = entry;
+    y->x_rev[entry - &(y->x_inst[0])] = pc + 1;
+    y->x_fast[pc] = 0;
+    y86_link_x_entry(y, pc);
+    y86_link_x_fast(y);
+
+    return 1;
+}
+
+void y86_load_trace(Y_data *y, Y_word pc) {
+    // If x_inst is full, all blocks are flushed and the superblock is given up (loaded again when reached)
+    if (setjmp(y->x_full)) {
+        y->x_flush++;
+        y86_load_reset(y);
+    } else if (y86_load_trace_block(y, pc)) {
+        y->x_trace++;
+    }
 
     y->reg[yr_pc] = pc;
 }
 
+void y86_unload_x(Y_data *y, Y_word addr) {
+    // Compiled insts overlapping the written word are unloaded with their run (their copies in the unchecked
+    // code), with all superblocks if copied into one: each code of them (found by x_rev) is patched to jump
+    // to the stub, they are loaded again when reached (the stale code is left until x_inst is flushed)
+    Y_char mark[Y_Y_INST_SIZE];
+    Y_word found = 0;
+    Y_word pos;
+    Y_word index;
+    Y_addr code;
+
+    memset(mark, 0, sizeof(mark));
+
+    // Insts (6 bytes at most) overlapping the word
+    for (pos = addr - 5; pos < addr + 4; ++pos) {
+        if (
+            pos >= 0 && pos < Y_Y_INST_SIZE && y86_x_loaded(y, pos)
+            && ((y->d_op[pos] & 0xFF) == yi_nil || pos + y->d_len[pos] > addr)
+        ) {
+            mark[pos] = 1;
+            found = 1;
+        }
+    }
+
+    if (!found) {
+        return;
+    }
+
+    for (pos = 0; pos < Y_Y_INST_SIZE; ++pos) {
+        if (mark[pos] == 1 && y->x_run[pos]) {
+            for (index = 0; index < Y_Y_INST_SIZE; ++index) {
+                if (y->x_run[index] == y->x_run[pos] && !mark[index]) {
+                    mark[index] = 2;
+                }
+            }
+        }
+        if (mark[pos] == 1 && y->t_in[pos]) {
+            // Heads are unloaded only (no run), their code is kept by the superblock
+            for (index = 0; index < Y_Y_INST_SIZE; ++index) {
+                if ((y->t_in[index] & 2) && !mark[index]) {
+                    mark[index] = 3;
+                }
+                y->t_in[index] = 0;
+            }
+        }
+    }
+
+    for (pos = 0; pos < Y_Y_INST_SIZE; ++pos) {
+        if (mark[pos]) {
+            if (y->x_link[pos]) {
+                y86_gen_stub_at(y, y->x_link[pos], pos);
+            } else {
+                y->x_link[pos] = y86_gen_stub(y, pos);
+            }
+        }
+    }
+
+    // Code of each inst (5 bytes at least), and jumps after blocks (not an int3)
+    for (index = 0; index < y->x_end - &(y->x_inst[0]); ++index) {
+        pos = y->x_rev[index] - 1;
+        code = &(y->x_inst[index]);
+
+        if (pos >= 0 && pos < Y_Y_INST_SIZE && mark[pos] && *code != (Y_char) 0xCC) {
+            code[0] = 0xE9; // jmp stub
+            y86_link_rel(&(code[1]), y->x_link[pos]);
+        }
+    }
+
+    for (pos = 0; pos < Y_Y_INST_SIZE; ++pos) {
+        if (mark[pos]) {
+            y->x_map[pos] = y->x_link[pos];
+            y->x_fast[pos] = 0;
+            y->x_run[pos] = 0;
+            y->x_hot[pos] = Y_T_HOT;
+            y->x_unload++;
+        }
+    }
+}
+
+void y86_unload(Y_data *y, Y_word addr) {
+    // If x_inst is full (no room for a stub), all blocks are flushed
+    if (setjmp(y->x_full)) {
+        y->x_flush++;
+        y86_load_reset(y);
+    } else {
+        y86_unload_x(y, addr);
+    }
+}
+
 void y86_load_all(Y_data *y) {
+    // Blocks are loaded when reached (see y86_trace_ip)
     y86_load_reset(y);
-    y86_load(y, &(y->mem[0]));
 }
 
 void y86_load_file_bin(Y_data *y, FILE *binfile) {
@@ -505,7 +1553,7 @@ void y86_load_file(Y_data *y, Y_char *fname) {
 }
 
 void y86_ready(Y_data *y, Y_word step) {
-    memcpy(&(y->bak_mem[0]), &(y->mem[0]), sizeof(y->bak_mem));
+    memcpy(&(y->bak_mem[0]), &(y->mem[0]), y->mem_size);
     memcpy(&(y->bak_reg[0]), &(y->reg[0]), sizeof(y->bak_reg));
 
     y->reg[yr_cc] = 0x40;
@@ -515,11 +1563,12 @@ void y86_ready(Y_data *y, Y_word step) {
 }
 
 void y86_trace_ip(Y_data *y) {
-    if (y->x_map[y->reg[yr_pc]]) {
-        y->reg[yr_rey] = (Y_word) y->x_map[y->reg[yr_pc]];
+    if (!y86_x_loaded(y, y->reg[yr_pc])) {
+        y86_load(y, y->reg[yr_pc]);
     } else {
-        y86_load(y, &(y->mem[y->reg[yr_pc]]));
+        y->x_hit++;
     }
+    y->reg[yr_rey] = (Y_word) y->x_map[y->reg[yr_pc]];
 }
 
 void __attribute__ ((noinline)) y86_exec(Y_data *y) {
@@ -544,17 +1593,42 @@ void __attribute__ ((noinline)) y86_exec(Y_data *y) {
         "subl $8, %%esp" "\n\t"
         "popf" "\n\t"
 
-    // Checking before calling
+    // Checking before calling, the flags (CC) are only saved if stopped or interrupted
     "y86_check:" "\n\t"
 
-        "pushf" "\n\t"
-        "movd %%eax, %%mm3" "\n\t"
+        "movd %%ecx, %%mm3" "\n\t"
 
         // Check state
+        "movd %%mm7, %%ecx" "\n\t"
+        "jecxz y86_check_step" "\n\t"
+
+        "movd %%mm3, %%ecx" "\n\t"
+        "pushf" "\n\t"
+        "movd %%eax, %%mm3" "\n\t"
         "movd %%mm7, %%eax" "\n\t"
-        "testl %%eax, %%eax" "\n\t"
-        "jnz y86_int" "\n\t"
+        "jmp y86_int" "\n\t"
+
+    "y86_check_step:" "\n\t"
+        // Check step, the sign is taken by psrad (no flag written)
+        "movd %%mm6, %%ecx" "\n\t"
+        "leal -1(%%ecx), %%ecx" "\n\t"
+        "movd %%ecx, %%mm6" "\n\t"
+        "movd %%ecx, %%mm5" "\n\t"
+        "psrad $31, %%mm5" "\n\t"
+        "movd %%mm5, %%ecx" "\n\t"
+        "jecxz y86_check_ok" "\n\t"
+
+        "movd %%mm3, %%ecx" "\n\t"
+        "pushf" "\n\t"
+        "movd %%eax, %%mm3" "\n\t"
+        "jmp y86_fin" "\n\t"
+
+    "y86_check_ok:" "\n\t"
+
+        "movd %%mm3, %%ecx" "\n\t"
+        "ret" "\n\t"
 
+    // Checking with the flags saved (after an interrupt)
     "y86_check_2:" "\n\t"
         // Check step
         "movd %%mm6, %%eax" "\n\t"
@@ -579,6 +1653,10 @@ void __attribute__ ((noinline)) y86_exec(Y_data *y) {
         ".long y86_int_imc" "\n\t"
         // If stat == 10 (ys_ret), handle by outer
         ".long y86_fin" "\n\t"
+        // If stat == 11 (ys_stp), load by outer
+        ".long y86_fin" "\n\t"
+        // If stat == 12 (ys_hot), form the superblock by outer
+        ".long y86_fin" "\n\t"
 
     ".align 16, 0x90" "\n\t"
 
@@ -614,6 +1692,13 @@ void __attribute__ ((noinline)) y86_exec(Y_data *y) {
 
             "jmp y86_fin" "\n\t"
 
+        "y86_int_guard:" "\n\t"
+
+            // From y86_guard_segv, as y86_int_ima failed (the flags and the return address are pushed)
+            "movd %%eax, %%mm3" "\n\t"
+            "movl %1, %%eax" "\n\t"
+            "movd %%eax, %%mm7" "\n\t"
+
         "y86_int_brk:" "\n\t"
 
             "movd %%mm6, %%eax" "\n\t"
@@ -636,33 +1721,88 @@ void __attribute__ ((noinline)) y86_exec(Y_data *y) {
         "popf" "\n\t"
         "popal"// "\n\t"
         :
-        : "r" (&y->reg[0])
+        : "r" (&y->reg[0]), "i" (ys_ima)
     );
 }
 
-void y86_trace_pc(Y_data *y) {
-    Y_word index;
-    Y_word diff;
-    Y_word index_x;
-    Y_word diff_x = Y_X_INST_SIZE;
+Y_data *y86_guard_data; // Executing, for the signal handler
+Y_char y86_guard_stack[Y_GUARD_STACK];
 
-    for (index = 0; index < Y_Y_INST_SIZE; ++index) {
-        diff = y->reg[yr_rey] - (Y_word) y->x_map[index];
+extern const Y_char y86_int_guard[];
 
-        // After step
-        if (!diff) {
-            index_x = index;
-            break;
-        }
+void y86_guard_segv(int sig, siginfo_t *info, void *context) {
+    Y_data *y = y86_guard_data;
+    greg_t *gregs = ((ucontext_t *) context)->uc_mcontext.gregs;
+    Y_char *eip = (Y_char *) gregs[REG_EIP];
+    Y_word *mid;
 
-        // After interrupt
-        if (diff > 0 && diff < diff_x) {
-            index_x = index;
-            diff_x = diff;
-        }
+    (void) info;
+
+    if (!y || !y->guard || eip < &(y->x_inst[0]) || eip >= y->x_end) {
+        // Not from the guest, fault again
+        signal(sig, SIG_DFL);
+        return;
+    }
+
+    // As the ys_ima check is failed (see y86_check): %esp is Mid ESP - 8, the faulting inst is the return address
+    mid = &(y->reg[yr_rex]);
+    mid[-1] = gregs[REG_EIP];
+    mid[-2] = gregs[REG_EFL];
+    gregs[REG_ESP] = (greg_t) &(mid[-2]);
+    gregs[REG_EIP] = (greg_t) y86_int_guard;
+}
+
+Y_word y86_guard_init(Y_data *y) {
+    // %fs is mem, limited to the last byte read by an access at mem_size - 1 (the padding, as Y_MASK_NOT_MEM)
+    // Any other 32-bit address faults, then y86_guard_segv stops as ys_ima does
+    struct user_desc desc;
+    struct sigaction action;
+    stack_t stack;
+
+    memset(&desc, 0, sizeof(desc));
+    desc.entry_number = Y_GUARD_SEL >> 3;
+    desc.base_addr = (size_t) &(y->mem[0]);
+    desc.limit = Y_MEM_SIZE - 1 + 3;
+    desc.seg_32bit = 1;
+    desc.useable = 1;
+
+    if (syscall(SYS_modify_ldt, 1, &desc, sizeof(desc))) {
+        return 0;
+    }
+
+    // The handler runs on its own stack, %esp is the address accessed
+    stack.ss_sp = y86_guard_stack;
+    stack.ss_flags = 0;
+    stack.ss_size = Y_GUARD_STACK;
+    sigaltstack(&stack, 0);
+
+    memset(&action, 0, sizeof(action));
+    action.sa_flags = SA_SIGINFO | SA_ONSTACK;
+    action.sa_sigaction = y86_guard_segv;
+    sigaction(SIGSEGV, &action, 0);
+
+    __asm__ __volatile__("movw %w0, %%fs": : "r" (Y_GUARD_SEL));
+
+    y86_guard_data = y;
+    return 1;
+}
+
+void y86_trace_pc(Y_data *y) {
+    Y_word index = y->reg[yr_rey] - (Y_word) &(y->x_inst[0]);
+
+    // Before a jump to a stub: the target
+    if ((Y_addr) y->reg[yr_rey] >= y->x_stub) {
+        y->reg[yr_pc] = IO_WORD((Y_addr) y->reg[yr_rey] + Y_X_STUB_PC);
+        return;
     }
 
-    y->reg[yr_pc] = index_x;
+    // After step: exactly at an inst
+    // After interrupt: the nearest inst before
+    while (index > 0 && !y->x_rev[index]) {
+        --index;
+    }
+
+    y->reg[yr_pc] = y->x_rev[index] - 1;
 }
 
 Y_word y86_get_im_ptr() {
@@ -671,6 +1811,11 @@ Y_word y86_get_im_ptr() {
     return result;
 }
 
+void y86_set_im_ptr(Y_word value) {
+    // The address reported by y86_output_error
+    __asm__ __volatile__("movd %0, %%mm4": : "r" (value));
+}
+
 void y86_go(Y_data *y, Y_word step) {
     Y_word goon = 0;
 
@@ -692,29 +1837,64 @@ void y86_go(Y_data *y, Y_word step) {
                 break;
 
             case ys_imc:
-                // y86_trace_pc(y);
+                y86_trace_pc(y);
+
+                if (y->reg[yr_sc] < 0) {
+                    // Checked already (still in mm7), stopped by the step count
+                    y->reg[yr_st] = ys_aok;
 
-                if (y86_get_im_ptr() + 4 < y->reg[yr_len]) {
-                    y->reg[yr_len] = y86_get_im_ptr() + 4;
+                    goon = 0;
+                    break;
                 }
-                y86_load_all(y);
+
+                y86_unload(y, y86_get_im_ptr());
+                y86_unload_decode(y, y86_get_im_ptr());
+
+                y->reg[yr_st] = ys_aok;
+
+                goon = 1;
+                y86_trace_ip(y);
+                break;
+
+            case ys_stp:
+                // From a stub, the step is counted again when entering
+                y->reg[yr_pc] = y->x_pend;
+                y->reg[yr_sc] += 1;
 
                 y->reg[yr_st] = ys_aok;
 
                 goon = 1;
-                // y86_trace_ip(y);
+                y86_trace_ip(y);
+                break;
+
+            case ys_hot:
+                // From a backward jump, the target is entered by its superblock (if formed)
+                y->reg[yr_pc] = y->x_pend;
+                y86_load_trace(y, y->reg[yr_pc]);
+
+                y->reg[yr_st] = ys_aok;
+
+                goon = 1;
+                y86_trace_ip(y);
                 break;
 
             case ys_ret:
-                // y86_trace_pc(y);
+                if ((unsigned) y->reg[yrl_esp] >= Y_MEM_SIZE) {
+                    // Bad %esp, stopped after the ret (its block ends there), mem and x_map are not read
+                    y86_trace_pc(y);
+                    y86_set_im_ptr(y->reg[yrl_esp]);
+                    y->reg[yr_sc] -= 1;
 
-                // TODO: checking
+                    y->reg[yr_st] = ys_adr;
+                    goon = 0;
+                    break;
+                }
 
                 // Do return
                 y->reg[yr_pc] = IO_WORD(&(y->mem[y->reg[yrl_esp]]));
                 y->reg[yrl_esp] += 4;
 
-                if (y->reg[yr_pc] >= y->reg[yr_len]) { // TODO: change this hack
+                if ((unsigned) y->reg[yr_pc] >= (unsigned) y->reg[yr_len]) { // TODO: change this hack
                     y->reg[yr_sc] -= 2;
                     y->reg[yr_pc] += 1;
 
@@ -833,17 +2013,240 @@ void y86_output(Y_data *y) {
     y86_output_mem(y);
 }
 
+void y86_output_cache(Y_data *y) {
+    fprintf(
+        stderr,
+        "Translation cache: %d hits, %d misses, %d flushes, %d superblocks, %d unloaded, %llu bytes compiled, 0x%x of 0x%x bytes used\n",
+        y->x_hit, y->x_miss, y->x_flush, y->x_trace, y->x_unload, y->x_bytes + y86_x_used(y), y86_x_used(y), Y_X_INST_SIZE
+    );
+}
+
+// Translation cache file: Y_cache_head, x_map, x_link, x_fast (offsets + 1 in x_inst, or 0), x_left, x_run, x_hot, d_val, x_rev
+// then t_in, d_op, d_reg, d_len, the image, x_inst and the stubs at its end, the code needs no relocation (see y86_gen_ret_push)
+// The key is the image, the guard mode, the layout of Y_data (offsets from Mid ESP) and the format version
+
+#define Y_CACHE_MAGIC 0x43583859 // "Y8XC"
+#define Y_CACHE_VERSION 1 // Changed with the generated code or the layout of the file
+
+typedef struct {
+    Y_word magic;
+    Y_word version;
+    Y_word data_size;
+    Y_word guard;
+    Y_word len; // The image
+    Y_word len_loaded; // reg[yr_len] after the run
+    Y_word x_len;
+    Y_word x_stub; // Offset of the lowest stub
+    unsigned long long hash;
+} Y_cache_head;
+
+unsigned long long y86_cache_hash(const void *data, size_t size, unsigned long long hash) {
+    const Y_char *pos = data;
+    size_t index;
+
+    // FNV-1a
+    for (index = 0; index < size; ++index) {
+        hash = (hash ^ (pos[index] & 0xFF)) * 0x100000001B3ULL;
+    }
+
+    return hash;
+}
+
+void y86_cache_head(Y_data *y, Y_cache_head *head, Y_char *image, Y_word len) {
+    memset(head, 0, sizeof(*head));
+    head->magic = Y_CACHE_MAGIC;
+    head->version = Y_CACHE_VERSION;
+    head->data_size = sizeof(Y_data);
+    head->guard = y->guard;
+    head->len = len;
+
+    head->hash = y86_cache_hash(head, offsetof(Y_cache_head, len_loaded), 0xCBF29CE484222325ULL);
+    head->hash = y86_cache_hash(image, len, head->hash);
+}
+
+size_t y86_cache_image(Y_cache_head *head) {
+    // Offset of the image in the file
+    return sizeof(Y_cache_head) + (7 * Y_Y_INST_SIZE + head->x_len + 1) * sizeof(Y_word) + 4 * Y_Y_INST_SIZE;
+}
+
+size_t y86_cache_size(Y_cache_head *head) {
+    return y86_cache_image(head) + head->len + head->x_len + (Y_X_INST_SIZE - head->x_stub);
+}
+
+Y_char *y86_cache_move(void *data, Y_char *file, size_t size, Y_word save) {
+    // Returns the next part of the file
+    if (save) {
+        memcpy(file, data, size);
+    } else {
+        memcpy(data, file, size);
+    }
+
+    return file + size;
+}
+
+Y_char *y86_cache_addr(Y_data *y, Y_addr *table, Y_char *file, Y_word save) {
+    Y_word *pos = (Y_word *) file;
+    Y_word index;
+
+    for (index = 0; index < Y_Y_INST_SIZE; ++index) {
+        if (save) {
+            pos[index] = table[index] ? table[index] - &(y->x_inst[0]) + 1 : 0;
+        } else {
+            table[index] = pos[index] ? &(y->x_inst[pos[index] - 1]) : 0;
+        }
+    }
+
+    return (Y_char *) &(pos[Y_Y_INST_SIZE]);
+}
+
+void y86_cache_copy(Y_data *y, Y_cache_head *head, Y_char *pos, Y_word save) {
+    // Between the compiled state and the file (the image is not copied)
+    Y_word *words[4] = {y->x_left, y->x_run, y->x_hot, y->d_val};
+    Y_char *bytes[4] = {y->t_in, y->d_op, y->d_reg, y->d_len};
+    Y_word index;
+
+    pos += sizeof(Y_cache_head);
+    pos = y86_cache_addr(y, y->x_map, pos, save);
+    pos = y86_cache_addr(y, y->x_link, pos, save);
+    pos = y86_cache_addr(y, y->x_fast, pos, save);
+    for (index = 0; index < 4; ++index) {
+        pos = y86_cache_move(words[index], pos, Y_Y_INST_SIZE * sizeof(Y_word), save);
+    }
+    pos = y86_cache_move(&(y->x_rev[0]), pos, (head->x_len + 1) * sizeof(Y_word), save);
+    for (index = 0; index < 4; ++index) {
+        pos = y86_cache_move(bytes[index], pos, Y_Y_INST_SIZE, save);
+    }
+
+    pos += head->len;
+    pos = y86_cache_move(&(y->x_inst[0]), pos, head->x_len, save);
+    y86_cache_move(&(y->x_inst[head->x_stub]), pos, Y_X_INST_SIZE - head->x_stub, save);
+}
+
+void y86_cache_path(Y_char *path, size_t size, Y_char *dir, Y_cache_head *head) {
+    snprintf(path, size, "%s/%.16llx.yxc", dir, head->hash);
+}
+
+Y_word y86_cache_load(Y_data *y, Y_char *dir) {
+    Y_cache_head head;
+    Y_cache_head *file;
+    Y_char path[4096];
+    struct stat st;
+    Y_char *pos;
+    Y_word miss;
+    int fd;
+
+    y86_cache_head(y, &head, &(y->mem[0]), y->reg[yr_len]);
+    y86_cache_path(path, sizeof(path), dir, &head);
+
+    fd = open(path, O_RDONLY);
+    if (fd < 0) {
+        return 1;
+    }
+    if (fstat(fd, &st) || (size_t) st.st_size < sizeof(Y_cache_head)) {
+        close(fd);
+        return 1;
+    }
+
+    pos = mmap(0, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (pos == MAP_FAILED) {
+        return 1;
+    }
+
+    // Same key (with the image itself), and complete
+    file = (Y_cache_head *) pos;
+    head.len_loaded = file->len_loaded;
+    head.x_len = file->x_len;
+    head.x_stub = file->x_stub;
+    miss = memcmp(file, &head, sizeof(head))
+        || head.x_len <= 0 || head.x_len > head.x_stub || head.x_stub > Y_X_INST_SIZE
+        || head.len_loaded < head.len || head.len_loaded > Y_Y_INST_SIZE
+        || (size_t) st.st_size != y86_cache_size(&head)
+        || memcmp(pos + y86_cache_image(&head), &(y->mem[0]), head.len);
+
+    if (!miss) {
+        y86_load_reset(y);
+        y86_cache_copy(y, &head, pos, 0);
+        y->x_end = &(y->x_inst[head.x_len]);
+        y->x_stub = &(y->x_inst[head.x_stub]);
+        y->reg[yr_len] = head.len_loaded;
+    }
+
+    munmap(pos, st.st_size);
+    return miss;
+}
+
+void y86_cache_save(Y_data *y, Y_char *dir, Y_word len) {
+    // After a run which compiled something, but neither flushed nor unloaded:
+    // each inst was compiled from its bytes as written before, a run of the same image writes them again before reaching it
+    Y_cache_head head;
+    Y_char path[4096];
+    Y_char temp[sizeof(path) + 8];
+    Y_char *pos;
+    size_t size;
+    Y_word done;
+    FILE *file;
+    int fd;
+
+    if (y->x_flush || y->x_unload || (!y->x_miss && !y->x_trace)) {
+        return;
+    }
+
+    y86_cache_head(y, &head, &(y->bak_mem[0]), len);
+    head.len_loaded = y->reg[yr_len];
+    head.x_len = y->x_end - &(y->x_inst[0]);
+    head.x_stub = y->x_stub - &(y->x_inst[0]);
+    y86_cache_path(path, sizeof(path), dir, &head);
+
+    size = y86_cache_size(&head);
+    pos = calloc(1, size);
+    if (!pos) {
+        return;
+    }
+
+    memcpy(pos, &head, sizeof(head));
+    y86_cache_copy(y, &head, pos, 1);
+    memcpy(pos + y86_cache_image(&head), &(y->bak_mem[0]), len);
+
+    // Written aside, then renamed (other processes may read it)
+    snprintf(temp, sizeof(temp), "%s.XXXXXX", path);
+    fd = mkstemp(temp);
+    if (fd >= 0) {
+        file = fdopen(fd, "wb");
+        if (file) {
+            done = fwrite(pos, 1, size, file) == size;
+            if (fclose(file) || !done || rename(temp, path)) {
+                unlink(temp);
+            }
+        } else {
+            close(fd);
+            unlink(temp);
+        }
+    }
+
+    free(pos);
+}
+
 void y86_free(Y_data *y) {
-    munmap(y, sizeof(Y_data));
+    munmap(y->x_inst, Y_X_INST_SIZE);
+    munmap(y, y->size);
 }
 
 void f_usage(Y_char *pname) {
-    fprintf(stderr, "Usage: %s file.bin [max_steps]\n", pname);
+    fprintf(stderr, "Usage: %s [-v] [-g] [-d cache_dir] file.bin [max_steps]\n", pname);
 }
 
-Y_stat f_main(Y_char *fname, Y_word step) {
+Y_stat f_main(Y_char *fname, Y_word step, Y_word verbose, Y_word guard, Y_char *cache) {
     Y_data *y = y86_new();
     Y_stat result;
+    Y_word len;
+
+    if (!y) {
+        return 1;
+    }
+    if (guard && !(y->guard = y86_guard_init(y))) {
+        fprintf(stderr, "modify_ldt() failed, addresses are checked\n");
+    }
     y->reg[yr_st] = setjmp(y->jmp);
 
     if (!(y->reg[yr_st])) {
@@ -855,16 +2258,27 @@ Y_stat f_main(Y_char *fname, Y_word step) {
             y->mem[0] = yi_halt;
         }
 
-        y86_load_all(y);
+        // Compiled code of the same image from the cache dir, saved there after the run
+        len = y->reg[yr_len];
+        if (!cache || y86_cache_load(y, cache)) {
+            y86_load_all(y);
+        }
 
         // Exec
         y86_go(y, step);
+
+        if (cache) {
+            y86_cache_save(y, cache, len);
+        }
     } else {
         // Jumped out
     }
 
     // Output
     y86_output(y);
+    if (verbose) {
+        y86_output_cache(y);
+    }
 
     // Return
     result = y->reg[yr_st];
@@ -873,12 +2287,32 @@ Y_stat f_main(Y_char *fname, Y_word step) {
 }
 
 int main(int argc, char *argv[]) {
-    switch (argc) {
+    // -v: translation cache counters to stderr
+    // -g: guard mode, out of range accesses fault instead of being checked (see y86_guard_init)
+    // -d: translation cache dir (see y86_cache_load)
+    Y_word verbose = 0;
+    Y_word guard = 0;
+    Y_char *cache = 0;
+    Y_word arg = 1;
+
+    for (; arg < argc; ++arg) {
+        if (!strcmp(argv[arg], "-v")) {
+            verbose = 1;
+        } else if (!strcmp(argv[arg], "-g")) {
+            guard = 1;
+        } else if (!strcmp(argv[arg], "-d") && arg + 1 < argc) {
+            cache = argv[++arg];
+        } else {
+            break;
+        }
+    }
+
+    switch (argc - arg) {
         // Correct arg
+        case 1:
+            return f_main(argv[arg], 10000, verbose, guard, cache);
         case 2:
-            return f_main(argv[1], 10000);
-        case 3:
-            return f_main(argv[1], atoi(argv[2]));
+            return f_main(argv[arg], atoi(argv[arg + 1]), verbose, guard, cache);
 
         // Bad arg or no arg
         default:
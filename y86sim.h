@@ -2,6 +2,8 @@
 #define _Y86_SIM_
 
 #include <setjmp.h>
+#include <stddef.h>
+#include <stdio.h>
 
 #define HIGH(pack) ((pack) >> 4 & 0xF)
 #define LOW(pack) ((pack) & 0xF)
@@ -9,13 +11,33 @@
 #define IO_ADDR(data) (*(Y_addr *) (data))
 #define DEBUG(data) fprintf(stderr, "TEST: %x\n", data)
 
-#define Y_MEM_SIZE 0x2000
+#define Y_MEM_SIZE 0x2000 // Default sizes, see y86_new
 #define Y_X_INST_SIZE 0x2000
 #define Y_Y_INST_SIZE 0x0200
+#define Y_MEM_SIZE_MAX 0x10000000 // Max sizes (x86-64 version)
+#define Y_X_INST_SIZE_MAX 0x10000000
+#define Y_Y_INST_SIZE_MAX 0x01000000
+#define Y_X_CODE_EXTRA 0x8 // x_code covers insts beginning before y_inst_size
+#define Y_X_CODE_INST 0x3F // x_code bits of loaded insts
+#define Y_X_CODE_DEC 0x40 // x_code bit of decoded insts (d_op), written bytes are decoded again
+#define Y_DIRTY_SHIFT 12 // Chunks of mem marked when written, reset between programs
+#define Y_X_ENT_SIZE 0x28
 #define Y_MASK_NOT_MEM "0xFFFFE000" // "0x1FFF"
 #define Y_MASK_NOT_INST "0xFFFFFE00" // "0x01FF"
 #define Y_PROTECT_MEM // Protect mem[>= mem_size]
 #define Y_BAD_ADDR ((Y_addr) 0xFFFFFFFF)
+#define Y_X_STUB_SIZE 0x10 // Stub of a jump target not loaded yet: movl $pc, x_pend(%esp); jmp dispatch (i386 version)
+#define Y_X_STUB_PC 0x7 // Offset of the Y PC in a stub
+#define Y_S_SIZE 0x40 // Entries of the shadow return stack (i386 version, a power of 2)
+#define Y_T_SIZE 0x40 // Insts of a superblock (i386 version, see y86_load_trace)
+#define Y_T_HOT 0x10 // Backward jumps taken to a target before its superblock is formed
+#define Y_T_RUN 0x3 // Register insts in a row compiled as a run (i386 version, see y86_load_run, up to Y_T_SIZE)
+#define Y_GUARD_SEL 0x7 // %fs in guard mode: LDT entry 0, RPL 3 (i386 version, see y86_guard_init)
+#define Y_GUARD_STACK 0x4000 // Signal stack, %esp may be a guest address when faulting
+#define Y_REC_SIZE 12 // Words of a raw trace record: PC, host flags, 8 regs, written address and value
+#define Y_REC_RAW 0x4000 // Raw records drained at once
+#define Y_REC_OUT 0x100000 // Encoded bytes written at once
+#define Y_REC_WRITE 0x80000000 // Flags of a raw record (and PC passed to y86_rec_store): the inst wrote mem
 // #define Y_STEP_MAX_DEFAULT 10000
 
 typedef char Y_char;
@@ -36,7 +58,8 @@ typedef enum {
     yi_ret    = 0x90,
     yi_pushl  = 0xA0,
     yi_popl   = 0xB0,
-    yi_bad    = 0xF0  // Non-standard: Compile error
+    yi_bad    = 0xF0, // Non-standard: Compile error
+    yi_nil    = 0xFF  // Non-standard: Not decoded (d_op)
 } Y_inst;
 
 typedef enum {
@@ -50,7 +73,9 @@ typedef enum {
     ys_inp = 0x7, // Non-standard: INS error caused by mem protection
     ys_ima = 0x8, // Non-standard: Memory access interrupt, range checking
     ys_imc = 0x9, // Non-standard: Memory changed interrupt, check if instruction changed, load if necessary
-    ys_ret = 0xA  // Non-standard: Ret interrupt, check and pop, map to x_inst, jump (and load if necessary)
+    ys_ret = 0xA, // Non-standard: Ret interrupt, check and pop, map to x_inst, jump (and load if necessary)
+    ys_stp = 0xB, // Non-standard: Step interrupt, remaining steps are fewer than the block, or the block is not loaded
+    ys_hot = 0xC  // Non-standard: Hot loop interrupt, the superblock is formed by outer (i386 version)
 } Y_stat;
 
 const Y_stat ys_cnt = 0x8; // Normal stat if below
@@ -72,7 +97,9 @@ typedef enum {
     yr_sx  = 0xD, // Non-standard: Step max
     yr_sc  = 0xE, // Non-standard: MM6: Step counter (decrease)
     yr_st  = 0xF, // Non-standard: MM7: Stat
-    yr_cn2 = 0x10 // Register buffer length
+    yr_im  = 0x10, // Non-standard: Mem pointer (MM4 in i386, R12 in x86-64)
+    yr_sm  = 0x11, // Non-standard: Step mode (0: count per block, 1: count per instruction)
+    yr_cn2 = 0x12 // Register buffer length
 } Y_reg_lyt;
 
 typedef enum {
@@ -93,18 +120,100 @@ typedef enum {
 // MM2: Mid ESP
 // MM3: Temp
 // MM4: Mem pointer, for ys_ima and ys_imc
-// MM5: ???
+// MM5: Temp, for addresses relative to Mid ESP
 
 typedef struct {
-    Y_char bak_mem[Y_MEM_SIZE];
-    Y_char mem[Y_MEM_SIZE];
-    Y_word wasted; // For rmmovl
+    Y_word mem_size; // Guest memory size (4 * n)
+    Y_word x_inst_size; // Compiled code size
+    Y_word y_inst_size; // Y86 code area size, jump targets should be below
+    Y_word x_code_size; // Bytes covered by x_code (y_inst_size + Y_X_CODE_EXTRA)
+    size_t size; // Size of the mapping, mem and tables follow Y_data
+    Y_char *map; // Start of the mapping
+    Y_word guard; // Faulting accesses instead of ys_ima checks (guard pages after mem, or a segment limit in the i386 version)
+    Y_addr guard_page; // Guard page opened for an access crossing the end of mem
+    FILE *out; // Output of y86_output (x86-64 version)
+    Y_char *mem; // mem_size + sizeof(Y_word), for rmmovl
+    Y_char *bak_mem;
     Y_word bak_reg[yr_cn2];
     Y_word reg[yr_cn2];
-    Y_char x_inst[Y_X_INST_SIZE];
+    Y_char *x_inst;
     Y_addr x_end;
-    Y_addr x_map[Y_Y_INST_SIZE];
+    Y_addr *x_map;
+    Y_word *x_rev; // Y PC + 1 of the first inst compiled at the address
+    Y_word *x_cnt; // Steps from the inst to the end of its block
+    Y_word *x_blk; // First inst of the block
+    Y_word *x_seq; // Insts of the block being loaded
+    Y_char *x_code; // Loaded insts covering the byte (bit n: the inst begins n bytes before), Y_X_CODE_DEC
+    Y_char *x_tgt; // Possible jump targets, %esp is mem based there (max version)
+    Y_word x_esp; // %esp is mem based (host address) at the end of the compiled code (max version)
+    Y_addr x_stub; // Lowest stub, stubs are at the end of x_inst (i386 version, see y86_gen_stub)
+    Y_word x_pend; // Y PC of the stub taken
+    jmp_buf x_full; // x_inst is full, flushed and loaded again (i386 version, see y86_load)
+    Y_word x_hit; // Blocks found compiled when entered from y86_go
+    Y_word x_miss; // Blocks compiled
+    Y_word x_flush; // Flushes of a full x_inst
+    Y_word x_trace; // Superblocks formed
+    Y_word x_unload; // Insts unloaded when written (i386 version, see y86_unload_x)
+    unsigned long long x_bytes; // Bytes compiled before the last reset (flushed or changed code)
+    Y_word x_num[16]; // 0 to 15, stat values read relative to Mid ESP (i386 version)
+    Y_word s_pos; // Shadow return stack: byte offset of the top entry in s_stk (i386 version, see y86_gen_ret)
+    Y_word s_stk[Y_S_SIZE * 2]; // Y return PC (-1 if none) and the offset of its compiled code in x_inst, pushed by call
+    Y_addr s_ret; // Compiled code returned to, read relative to Mid ESP
+    Y_addr s_link; // Host address in the call being loaded, set to the offset of the code of the next inst
+    Y_word *x_hot; // Backward jumps left before the target is hot, by Y PC (i386 version, see y86_load_trace)
+    Y_addr *x_link; // Stub of a jump target by Y PC, jumped to directly, then to its code once loaded (i386 version)
+    Y_addr *x_fast; // Code of an inst in the unchecked copy of its run, by Y PC, until jumped to (i386 version, see y86_load_run)
+    Y_word *x_left; // Insts left after it in its run
+    Y_word *x_run; // First inst of its run + 1 (0 if none), the insts of a run are unloaded together
+    Y_char *t_in; // 1: copied into a superblock, 2: head of a superblock (i386 version)
+    Y_char (*x_ent)[Y_X_ENT_SIZE]; // Entry of the inst for direct jumps
+    Y_word x_gen; // Version of the compiled code, changed when loading or unloading
+    Y_word x_gen_max;
+    Y_char *d_op; // Decoded insts by Y PC (below y_inst_size), yi_nil if not decoded
+    Y_char *d_reg; // ra << 4 | rb
+    Y_char *d_len; // Bytes read by the decoder
+    Y_word *d_val;
+    Y_word p_mode; // Profiling: 1 counts blocks, 2 also cycles (x86-64 version, see y86_gen_prof)
+    Y_word p_cur; // Y PC of the block being timed
+    unsigned long long p_last; // TSC when p_cur was entered
+    unsigned long long *p_cnt; // Entries by Y PC, not yet flushed to p_inst (near x_inst, rip relative)
+    unsigned long long *p_inst; // Insts executed by Y PC
+    unsigned long long *p_tsc; // Cycles of the blocks entered at Y PC
+    const Y_char *p_func; // Routine taking the TSC (y86_prof_tsc)
+    Y_word *r_buf; // Tracing: raw records of executed insts, or 0 (x86-64 version, see y86_gen_rec)
+    Y_word *r_pos; // Next raw record
+    Y_word *r_end;
+    const Y_char *r_func; // Routine storing a raw record (y86_rec_store)
+    Y_word r_fd; // Trace file, or -1 if writing failed
+    Y_word r_last[Y_REC_SIZE]; // Last record encoded, the next one is a delta
+    Y_char *r_out; // Encoded records, written by writev() in batches
+    Y_word r_len;
+    Y_word r_cnt;
+    Y_char mem_dirty[Y_MEM_SIZE_MAX >> Y_DIRTY_SHIFT]; // Written chunks of mem
     jmp_buf jmp;
 } Y_data;
 
+typedef struct {
+    Y_data *y; // Taken from
+    Y_word mem_size;
+    Y_word x_inst_size;
+    Y_word y_inst_size;
+    Y_word guard;
+    Y_word bak_reg[yr_cn2];
+    Y_word reg[yr_cn2];
+    Y_char *mem; // mem_size + sizeof(Y_word)
+    Y_char *bak_mem; // Loaded code only (reg[yr_len])
+    Y_char *mem_dirty; // Chunks written before the snapshot
+    Y_word x_gen;
+    Y_word code; // If compiled code is saved (below)
+    Y_word x_len; // x_end - x_inst
+    Y_char *x_inst;
+    Y_word *x_map; // Offset + 1 in x_inst, or 0
+    Y_word *x_rev;
+    Y_word *x_cnt;
+    Y_word *x_blk;
+    Y_char *x_code;
+    Y_char (*x_ent)[Y_X_ENT_SIZE];
+} Y_snap;
+
 #endif
@@ -0,0 +1,645 @@
+#include "y86sim.h"
+#include <stddef.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+
+// Reference interpreter: no generated code, no RWX memory
+// Insts are decoded once (d_op, d_reg, d_len, d_val, indexed by Y PC), and run by direct threading:
+// x_inst holds the handler of each inst (GCC / Clang computed goto)
+// The output is the same as the JIT versions
+
+#define Y_ALIGN(size) (((size_t) (size) + 0xF) & ~(size_t) 0xF)
+#define Y_DATA_SIZE Y_ALIGN(sizeof(Y_data))
+
+Y_data *y86_new(Y_word mem_size, Y_word y_inst_size) {
+    Y_data *y;
+    Y_char *pos;
+
+    // The decoded tables have one more entry, for insts beyond the code area (decoded each time)
+    size_t size_mem = Y_ALIGN(mem_size + 2 * sizeof(Y_word)); // Decoding reads up to 5 bytes after an inst
+    size_t size_bak_mem = Y_ALIGN(mem_size);
+    size_t size_x_inst = Y_ALIGN((y_inst_size + 1) * sizeof(void *));
+    size_t size_d_char = Y_ALIGN(y_inst_size + 1);
+    size_t size_d_val = Y_ALIGN((y_inst_size + 1) * sizeof(Y_word));
+    size_t size = Y_DATA_SIZE + size_mem + size_bak_mem + size_x_inst + 3 * size_d_char + size_d_val;
+
+    if (
+        mem_size <= 0 || mem_size > Y_MEM_SIZE_MAX || mem_size % sizeof(Y_word)
+        || y_inst_size <= 0 || y_inst_size > Y_Y_INST_SIZE_MAX || y_inst_size > mem_size
+    ) {
+        fprintf(stderr, "Bad memory size (mem: 0x%x, code: 0x%x)\n", mem_size, y_inst_size);
+        return 0;
+    }
+
+    pos = calloc(1, size);
+    if (!pos) {
+        fprintf(stderr, "calloc() failed (0x%lx)\n", (unsigned long) size);
+        return 0;
+    }
+
+    y = (Y_data *) pos;
+
+    y->mem_size = mem_size;
+    y->x_inst_size = size_x_inst;
+    y->y_inst_size = y_inst_size;
+    y->x_code_size = y_inst_size;
+    y->size = size;
+    y->map = pos;
+    y->out = stdout;
+
+    pos += Y_DATA_SIZE;
+    y->mem = pos; pos += size_mem;
+    y->bak_mem = pos; pos += size_bak_mem;
+    y->x_inst = pos; pos += size_x_inst;
+    y->x_end = pos;
+    y->d_op = pos; pos += size_d_char;
+    y->d_reg = pos; pos += size_d_char;
+    y->d_len = pos; pos += size_d_char;
+    y->d_val = (Y_word *) pos;
+
+    return y;
+}
+
+void y86_decode(Y_char **inst, Y_char *end, Y_inst *op_out, Y_reg_id *ra_out, Y_reg_id *rb_out, Y_word *val_out) {
+    Y_inst op = **inst & 0xFF;
+    (*inst)++;
+
+    Y_reg_id ra = yr_nil;
+    Y_reg_id rb = yr_nil;
+    Y_word val = 0;
+
+    switch (op) {
+        case yi_halt:
+        case yi_nop:
+        case yi_ret:
+            break;
+
+        case yi_rrmovl:
+        case yi_cmovle:
+        case yi_cmovl:
+        case yi_cmove:
+        case yi_cmovne:
+        case yi_cmovge:
+        case yi_cmovg:
+        case yi_addl:
+        case yi_subl:
+        case yi_andl:
+        case yi_xorl:
+        case yi_pushl:
+        case yi_popl:
+            // Read registers
+            if (*inst == end) op = yi_bad;
+            ra = HIGH(**inst);
+            rb = LOW(**inst);
+            (*inst)++;
+
+            break;
+
+        case yi_irmovl:
+        case yi_rmmovl:
+        case yi_mrmovl:
+            // Read registers
+            if (*inst == end) op = yi_bad;
+            ra = HIGH(**inst);
+            rb = LOW(**inst);
+            (*inst)++;
+
+            // Read value
+            if (*inst + sizeof(Y_word) > end) op = yi_bad;
+            val = IO_WORD(*inst);
+            *inst += sizeof(Y_word);
+
+            break;
+
+        case yi_jmp:
+        case yi_jle:
+        case yi_jl:
+        case yi_je:
+        case yi_jne:
+        case yi_jge:
+        case yi_jg:
+        case yi_call:
+            // Read value
+            if (*inst + sizeof(Y_word) > end) op = yi_bad;
+            val = IO_WORD(*inst);
+            *inst += sizeof(Y_word);
+
+            break;
+
+        case yi_bad:
+        default:
+            op = yi_bad;
+
+            break;
+    }
+
+    *op_out = op;
+    *ra_out = ra;
+    *rb_out = rb;
+    *val_out = val;
+}
+
+void y86_decode_pc(Y_data *y, Y_word pc, Y_word index) {
+    Y_char *inst = &(y->mem[pc]);
+    Y_inst op;
+    Y_reg_id ra;
+    Y_reg_id rb;
+
+    y86_decode(&inst, &(y->mem[y->mem_size]), &op, &ra, &rb, &(y->d_val[index]));
+    y->d_op[index] = op;
+    y->d_reg[index] = ra << 4 | rb;
+    y->d_len[index] = inst - &(y->mem[pc]);
+}
+
+void y86_unload_mem(Y_data *y, Y_word addr) {
+    const void **x_op = (const void **) y->x_inst;
+    Y_word index;
+
+    // Insts covering the written word (up to 6 bytes long)
+    for (index = addr - 5; index < addr + (Y_word) sizeof(Y_word); ++index) {
+        if (index >= 0 && index < y->y_inst_size) {
+            x_op[index] = 0;
+            y->d_op[index] = yi_nil;
+        }
+    }
+}
+
+void y86_load_all(Y_data *y) {
+    memset(&(y->x_inst[0]), 0, y->x_end - &(y->x_inst[0]));
+    memset(&(y->d_op[0]), yi_nil, y->y_inst_size);
+}
+
+void y86_load_file_bin(Y_data *y, FILE *binfile) {
+    clearerr(binfile);
+
+    y->reg[yr_len] = fread(&(y->mem[0]), sizeof(Y_char), y->y_inst_size, binfile);
+    if (ferror(binfile)) {
+        fprintf(stderr, "fread() failed (0x%x)\n", y->reg[yr_len]);
+        longjmp(y->jmp, ys_clf);
+    }
+    if (!feof(binfile)) {
+        fprintf(stderr, "Too large memory footprint (0x%x)\n", y->reg[yr_len]);
+        longjmp(y->jmp, ys_clf);
+    }
+}
+
+void y86_load_file(Y_data *y, Y_char *fname) {
+    FILE *binfile = fopen(fname, "rb");
+
+    if (binfile) {
+        y86_load_file_bin(y, binfile);
+        fclose(binfile);
+    } else {
+        fprintf(stderr, "Can't open binary file '%s'\n", fname);
+        longjmp(y->jmp, ys_clf);
+    }
+}
+
+void y86_ready(Y_data *y, Y_word step) {
+    memcpy(&(y->bak_mem[0]), &(y->mem[0]), y->reg[yr_len]);
+    memcpy(&(y->bak_reg[0]), &(y->reg[0]), sizeof(y->bak_reg));
+
+    y->reg[yr_cc] = 0x40;
+    y->reg[yr_sx] = step;
+    y->reg[yr_sc] = step;
+    y->reg[yr_st] = ys_aok;
+    y->reg[yr_sm] = 1;
+}
+
+// Registers are kept in locals by Y86 id, and written back to the y->reg layout when stopped
+#define Y_REG(id) reg[yr_cnt - 1 - (id)]
+
+// Each handler dispatches the next inst itself (one indirect jump per handler), decode is only for new insts
+#define Y_DISPATCH() { \
+    if (sc <= 0) {goto stop;} \
+    --sc; \
+    index = (unsigned) pc < (unsigned) y_inst_size ? pc : y_inst_size; \
+    if (x_op[index]) {goto *(x_op[index]);} \
+    goto decode; \
+}
+#define Y_NEXT(len) {pc += (len); Y_DISPATCH();}
+#define Y_FAIL(stat) {y->reg[yr_st] = (stat); goto fail;}
+#define Y_CHECK(addr, stat) {if ((unsigned) (addr) >= (unsigned) mem_size) {y->reg[yr_im] = (addr); Y_FAIL(stat);}}
+#define Y_WRITE(addr, value) { \
+    IO_WORD(&(mem[addr])) = (value); \
+    if ((unsigned) (addr) < (unsigned) y->y_inst_size + 5) {y86_unload_mem(y, addr);} \
+}
+#define Y_SET_CC(value) {zf = !(value); sf = (value) < 0;}
+
+void y86_exec(Y_data *y) {
+    Y_char *mem = y->mem;
+    Y_word mem_size = y->mem_size;
+    const void **x_op = (const void **) y->x_inst;
+    Y_char *d_op = y->d_op;
+    Y_char *d_reg = y->d_reg;
+    Y_word *d_val = y->d_val;
+    Y_word y_inst_size = y->y_inst_size;
+    Y_word index;
+
+    Y_word reg[yr_cnt];
+    Y_word pc = y->reg[yr_pc];
+    Y_word sc = y->reg[yr_sc];
+    Y_word zf = (y->reg[yr_cc] >> 6) & 1;
+    Y_word sf = (y->reg[yr_cc] >> 7) & 1;
+    Y_word of = (y->reg[yr_cc] >> 11) & 1;
+    Y_word a;
+    Y_word b;
+    Y_word r;
+    Y_word cond = 0;
+
+    memcpy(&(reg[0]), &(y->reg[0]), sizeof(reg));
+
+    Y_DISPATCH();
+
+    decode:
+        // Beyond the code area, only a halt runs (as in the JIT versions)
+        if (index == y->y_inst_size && ((unsigned) pc >= (unsigned) mem_size || mem[pc])) {
+            goto op_adp;
+        }
+
+        // Not decoded, or beyond the code area
+        if (index == y->y_inst_size || (d_op[index] & 0xFF) == yi_nil) {
+            y86_decode_pc(y, pc, index);
+        }
+
+        {
+            Y_inst op = d_op[index] & 0xFF;
+            Y_char ra = HIGH(d_reg[index]);
+            Y_char rb = LOW(d_reg[index]);
+            const void *handler = &&op_ins;
+
+            switch (op) {
+                case yi_halt:
+                    handler = &&op_halt;
+                    break;
+                case yi_nop:
+                    handler = &&op_nop;
+                    break;
+                case yi_rrmovl:
+                case yi_cmovle:
+                case yi_cmovl:
+                case yi_cmove:
+                case yi_cmovne:
+                case yi_cmovge:
+                case yi_cmovg:
+                    if (ra < yr_cnt && rb < yr_cnt) {
+                        handler = op == yi_rrmovl ? &&op_rrmovl : &&op_cmovxx;
+                    }
+                    break;
+                case yi_irmovl:
+                    if (ra == yr_nil && rb < yr_cnt) {
+                        handler = &&op_irmovl;
+                    }
+                    break;
+                case yi_rmmovl:
+                case yi_mrmovl:
+                    if (ra < yr_cnt && rb < yr_cnt) {
+                        handler = op == yi_rmmovl ? &&op_rmmovl : &&op_mrmovl;
+                    }
+                    break;
+                case yi_addl:
+                case yi_subl:
+                case yi_andl:
+                case yi_xorl:
+                    if (ra < yr_cnt && rb < yr_cnt) {
+                        handler = op == yi_addl ? &&op_addl : op == yi_subl ? &&op_subl : op == yi_andl ? &&op_andl : &&op_xorl;
+                    }
+                    break;
+                case yi_jmp:
+                case yi_jle:
+                case yi_jl:
+                case yi_je:
+                case yi_jne:
+                case yi_jge:
+                case yi_jg:
+                case yi_call:
+                    if (d_val[index] < 0 || d_val[index] >= y->y_inst_size) {
+                        handler = &&op_adp;
+                    } else {
+                        handler = op == yi_jmp ? &&op_jmp : op == yi_call ? &&op_call : &&op_jxx;
+                    }
+                    break;
+                case yi_ret:
+                    handler = &&op_ret;
+                    break;
+                case yi_pushl:
+                case yi_popl:
+                    if (ra < yr_cnt && rb == yr_nil) {
+                        handler = op == yi_pushl ? &&op_pushl : &&op_popl;
+                    }
+                    break;
+                default:
+                    break;
+            }
+
+            if (index < y->y_inst_size) {
+                x_op[index] = handler;
+            }
+            goto *handler;
+        }
+
+    op_halt:
+        Y_FAIL(ys_hlt);
+    op_nop:
+        Y_NEXT(1);
+    op_cmovxx:
+        goto test;
+    op_cmovxx_do:
+        if (!cond) {
+            Y_NEXT(2);
+        }
+    op_rrmovl:
+        Y_REG(LOW(d_reg[index])) = Y_REG(HIGH(d_reg[index]));
+        Y_NEXT(2);
+    op_irmovl:
+        Y_REG(LOW(d_reg[index])) = d_val[index];
+        Y_NEXT(6);
+    op_rmmovl:
+        a = Y_REG(LOW(d_reg[index])) + d_val[index];
+        Y_CHECK(a, ys_adr);
+        Y_WRITE(a, Y_REG(HIGH(d_reg[index])));
+        Y_NEXT(6);
+    op_mrmovl:
+        a = Y_REG(LOW(d_reg[index])) + d_val[index];
+        Y_CHECK(a, ys_adr);
+        Y_REG(HIGH(d_reg[index])) = IO_WORD(&(mem[a]));
+        Y_NEXT(6);
+    op_addl:
+        a = Y_REG(HIGH(d_reg[index]));
+        b = Y_REG(LOW(d_reg[index]));
+        r = (unsigned) b + (unsigned) a;
+        of = (a < 0) == (b < 0) && (r < 0) != (b < 0);
+        Y_SET_CC(r);
+        Y_REG(LOW(d_reg[index])) = r;
+        Y_NEXT(2);
+    op_subl:
+        a = Y_REG(HIGH(d_reg[index]));
+        b = Y_REG(LOW(d_reg[index]));
+        r = (unsigned) b - (unsigned) a;
+        of = (a < 0) != (b < 0) && (r < 0) != (b < 0);
+        Y_SET_CC(r);
+        Y_REG(LOW(d_reg[index])) = r;
+        Y_NEXT(2);
+    op_andl:
+        r = Y_REG(LOW(d_reg[index])) & Y_REG(HIGH(d_reg[index]));
+        of = 0;
+        Y_SET_CC(r);
+        Y_REG(LOW(d_reg[index])) = r;
+        Y_NEXT(2);
+    op_xorl:
+        r = Y_REG(LOW(d_reg[index])) ^ Y_REG(HIGH(d_reg[index]));
+        of = 0;
+        Y_SET_CC(r);
+        Y_REG(LOW(d_reg[index])) = r;
+        Y_NEXT(2);
+    op_jmp:
+        pc = d_val[index];
+        Y_DISPATCH();
+    op_jxx:
+        goto test;
+    op_jxx_do:
+        pc = cond ? d_val[index] : pc + 5;
+        Y_DISPATCH();
+    op_call:
+        a = Y_REG(yri_esp) -= 4;
+        Y_CHECK(a, ys_adr);
+        Y_WRITE(a, pc + 5);
+        pc = d_val[index];
+        Y_DISPATCH();
+    op_ret:
+        a = Y_REG(yri_esp);
+        Y_CHECK(a, ys_adr);
+        Y_REG(yri_esp) += 4;
+        pc = IO_WORD(&(mem[a]));
+        if ((unsigned) pc >= (unsigned) y->y_inst_size) { // The same hack as the JIT versions
+            --sc;
+            Y_FAIL(ys_hlt);
+        }
+        Y_DISPATCH();
+    op_pushl:
+        b = Y_REG(HIGH(d_reg[index]));
+        a = Y_REG(yri_esp) -= 4;
+        Y_CHECK(a, ys_adr);
+        Y_WRITE(a, b);
+        Y_NEXT(2);
+    op_popl:
+        a = Y_REG(yri_esp);
+        Y_CHECK(a, ys_adr);
+        Y_REG(yri_esp) += 4;
+        Y_REG(HIGH(d_reg[index])) = IO_WORD(&(mem[a]));
+        Y_NEXT(2);
+    op_ins:
+        Y_FAIL(ys_ins);
+    op_adp:
+        Y_FAIL(ys_adp);
+
+    test:
+        switch (LOW(d_op[index])) {
+            case 0x0: cond = 1; break;
+            case 0x1: cond = (sf ^ of) | zf; break;
+            case 0x2: cond = sf ^ of; break;
+            case 0x3: cond = zf; break;
+            case 0x4: cond = !zf; break;
+            case 0x5: cond = !(sf ^ of); break;
+            default: cond = !(sf ^ of) && !zf; break;
+        }
+        if (HIGH(d_op[index]) == HIGH(yi_rrmovl)) {
+            goto op_cmovxx_do;
+        }
+        goto op_jxx_do;
+
+    fail:
+        // Stopped at the instruction (see y86_output_state)
+        pc += 1;
+    stop:
+        memcpy(&(y->reg[0]), &(reg[0]), sizeof(reg));
+        y->reg[yr_pc] = pc;
+        y->reg[yr_sc] = sc - 1;
+        y->reg[yr_cc] = (zf << 6) | (sf << 7) | (of << 11);
+}
+
+void y86_continue(Y_data *y) {
+    y86_exec(y);
+}
+
+void y86_go(Y_data *y, Y_word step) {
+    y86_ready(y, step);
+    y86_continue(y);
+}
+
+Y_word y86_get_im_ptr(Y_data *y) {
+    return y->reg[yr_im];
+}
+
+void y86_output_error(Y_data *y) {
+    switch (y->reg[yr_st]) {
+        case ys_adr:
+            if (y->mem[y->reg[yr_pc] - 1] >= 0 /*< yi_call*/) { // Evil hack !? TODO
+                fprintf(y->out, "PC = 0x%x, Invalid data address 0x%x\n", y->reg[yr_pc] - 1, y86_get_im_ptr(y));
+            } else {
+                fprintf(y->out, "PC = 0x%x, Invalid stack address 0x%x\n", y->reg[yr_pc] - 1, y86_get_im_ptr(y));
+            }
+            break;
+        case ys_ins:
+            fprintf(y->out, "PC = 0x%x, Invalid instruction %.2x\n", y->reg[yr_pc] - 1, y->mem[y->reg[yr_pc] - 1]);
+            break;
+        case ys_clf:
+            fprintf(y->out, "PC = 0x%x, File loading failed\n", /*y->reg[yr_pc] - 1*/ 0);
+            break;
+        case ys_ccf:
+            fprintf(y->out, "PC = 0x%x, Parsing or compiling failed\n", y->reg[yr_pc] - 1);
+            break;
+        case ys_adp:
+            fprintf(y->out, "PC = 0x%x, Invalid instruction address\n", y->reg[yr_pc] - 1);
+            break;
+        case ys_inp:
+            fprintf(y->out, "PC = 0x%x, Invalid instruction address\n", y->reg[yr_pc] - 1);
+            break;
+        default:
+            break;
+    }
+}
+
+Y_word y86_cc_transform(Y_word cc_x) {
+    return ((cc_x >> 11) & 1) | ((cc_x >> 6) & 2) | ((cc_x >> 4) & 4);
+}
+
+void y86_output_state(Y_data *y) {
+    const Y_char *stat_names[8] = {
+        "AOK", "HLT", "ADR", "INS", "", "", "ADR", "INS"
+    };
+
+    const Y_char *cc_names[8] = {
+        "Z=0 S=0 O=0",
+        "Z=0 S=0 O=1",
+        "Z=0 S=1 O=0",
+        "Z=0 S=1 O=1",
+        "Z=1 S=0 O=0",
+        "Z=1 S=0 O=1",
+        "Z=1 S=1 O=0",
+        "Z=1 S=1 O=1"
+    };
+
+    fprintf(
+        y->out,
+        "Stopped in %d steps at PC = 0x%x.  Status '%s', CC %s\n",
+        y->reg[yr_sx] - y->reg[yr_sc] - 1, y->reg[yr_pc] - !!y->reg[yr_st], stat_names[7 & y->reg[yr_st]], cc_names[y86_cc_transform(y->reg[yr_cc])]
+    );
+}
+
+void y86_output_reg(Y_data *y) {
+    Y_reg_lyt index;
+
+    const Y_char *reg_names[yr_cnt] = {
+        "%edi", "%esi", "%ebp", "%esp", "%ebx", "%edx", "%ecx", "%eax"
+    };
+
+    fprintf(y->out, "Changes to registers:\n");
+    for (index = yr_cnt - 1; (Y_word) index >= 0; --index) {
+        if (y->reg[index] != y->bak_reg[index]) {
+            fprintf(y->out, "%s:\t0x%.8x\t0x%.8x\n", reg_names[index], y->bak_reg[index], y->reg[index]);
+        }
+    }
+}
+
+void y86_output_mem(Y_data *y) {
+    Y_word index;
+
+    fprintf(y->out, "Changes to memory:\n");
+    for (index = 0; index < y->mem_size; index += 4) { // mem_size = 4 * n
+        if (IO_WORD(&(y->bak_mem[index])) != IO_WORD(&(y->mem[index]))) {
+            fprintf(y->out, "0x%.4x:\t0x%.8x\t0x%.8x\n", index, IO_WORD(&(y->bak_mem[index])), IO_WORD(&(y->mem[index])));
+        }
+    }
+}
+
+void y86_output(Y_data *y) {
+    y86_output_error(y);
+    y86_output_state(y);
+    y86_output_reg(y);
+    fprintf(y->out, "\n");
+    y86_output_mem(y);
+}
+
+void y86_free(Y_data *y) {
+    free(y->map);
+}
+
+void f_usage(Y_char *pname) {
+    fprintf(stderr, "Usage: %s [-m mem_size] [-c code_size] file.bin [max_steps]\n", pname);
+}
+
+Y_stat f_run(Y_data *y, Y_char *fname, Y_word step) {
+    y->reg[yr_st] = setjmp(y->jmp);
+
+    if (!(y->reg[yr_st])) {
+        // Load
+        if (strcmp(fname, "nil")) {
+            y86_load_file(y, fname);
+        } else {
+            y->reg[yr_len] = 1;
+            y->mem[0] = yi_halt;
+        }
+
+        y86_load_all(y);
+
+        // Exec
+        y86_go(y, step);
+    } else {
+        // Jumped out
+    }
+
+    // Output
+    y86_output(y);
+
+    // Return
+    return y->reg[yr_st] == ys_clf || y->reg[yr_st] == ys_ccf;
+}
+
+Y_stat f_main(Y_char *fname, Y_word step, Y_word mem_size, Y_word y_inst_size) {
+    Y_data *y = y86_new(mem_size, y_inst_size);
+    Y_stat result;
+
+    if (!y) {
+        return 1;
+    }
+
+    result = f_run(y, fname, step);
+    y86_free(y);
+    return result;
+}
+
+int main(int argc, char *argv[]) {
+    Y_word mem_size = Y_MEM_SIZE;
+    Y_word y_inst_size = Y_Y_INST_SIZE;
+    Y_word index = 1;
+
+    // Options, sizes are decimal or hex (0x...)
+    for (; index + 1 < argc && argv[index][0] == '-'; index += 2) {
+        switch (argv[index][1]) {
+            case 'm':
+                mem_size = strtol(argv[index + 1], 0, 0);
+                break;
+            case 'c':
+                y_inst_size = strtol(argv[index + 1], 0, 0);
+                break;
+            default:
+                f_usage(argv[0]);
+                return 0;
+        }
+    }
+
+    switch (argc - index) {
+        // Correct arg
+        case 1:
+            return f_main(argv[index], 10000, mem_size, y_inst_size);
+        case 2:
+            return f_main(argv[index], atoi(argv[index + 1]), mem_size, y_inst_size);
+
+        // Bad arg or no arg
+        default:
+            f_usage(argv[0]);
+            return 0;
+    }
+}
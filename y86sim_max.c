@@ -5,12 +5,47 @@
 #include <sys/mman.h>
 
 Y_data *y86_new() {
-    return mmap(
-        0, sizeof(Y_data),
+    Y_data *y;
+    Y_char *pos;
+
+    // Fixed sizes (the masks in asm), mem and tables follow Y_data
+    size_t size = sizeof(Y_data) + Y_MEM_SIZE + sizeof(Y_word) + Y_MEM_SIZE
+        + Y_X_INST_SIZE + Y_Y_INST_SIZE * sizeof(Y_addr) + (Y_X_INST_SIZE + 1) * sizeof(Y_word)
+        + Y_Y_INST_SIZE + Y_Y_INST_SIZE * 3 + Y_Y_INST_SIZE * sizeof(Y_word);
+
+    pos = mmap(
+        0, size,
         PROT_READ | PROT_WRITE | PROT_EXEC,
         MAP_PRIVATE | MAP_ANONYMOUS,
         -1, 0
     );
+    if (pos == MAP_FAILED) {
+        fprintf(stderr, "mmap() failed (0x%x)\n", (Y_word) size);
+        return 0;
+    }
+
+    y = (Y_data *) pos;
+    y->mem_size = Y_MEM_SIZE;
+    y->x_inst_size = Y_X_INST_SIZE;
+    y->y_inst_size = Y_Y_INST_SIZE;
+    y->size = size;
+
+    pos += sizeof(Y_data);
+    y->mem = pos; pos += Y_MEM_SIZE + sizeof(Y_word);
+    y->bak_mem = pos; pos += Y_MEM_SIZE;
+    y->x_inst = pos; pos += Y_X_INST_SIZE;
+    y->x_map = (Y_addr *) pos; pos += Y_Y_INST_SIZE * sizeof(Y_addr);
+    y->x_rev = (Y_word *) pos; pos += (Y_X_INST_SIZE + 1) * sizeof(Y_word);
+    y->x_tgt = pos; pos += Y_Y_INST_SIZE;
+    y->d_op = pos; pos += Y_Y_INST_SIZE;
+    y->d_reg = pos; pos += Y_Y_INST_SIZE;
+    y->d_len = pos; pos += Y_Y_INST_SIZE;
+    y->d_val = (Y_word *) pos;
+
+    // Nothing decoded (see y86_decode_pc)
+    memset(&(y->d_op[0]), yi_nil, Y_Y_INST_SIZE);
+
+    return y;
 }
 
 const Y_word y_static_num[16] = {0, 1, 2, 3, 4, 5, 6, 7, 8, 9, 10, 11, 12, 13, 14, 15};
@@ -49,9 +84,28 @@ void y86_push_x_addr(Y_data *y, Y_addr value) {
     }
 }
 
+void y86_link_x_rev(Y_data *y, Y_word pos, Y_word value) {
+    // Reverse map of x_map, the first inst if some insts have no code
+    Y_word *rev = &(y->x_rev[y->x_map[pos] - &(y->x_inst[0])]);
+
+    if (value) {
+        if (!*rev || y->x_map[*rev - 1] != y->x_map[pos] || *rev - 1 > pos) {
+            *rev = pos + 1;
+        }
+    } else {
+        if (*rev == pos + 1) {
+            *rev = 0;
+        }
+    }
+}
+
 void y86_link_x_map(Y_data *y, Y_word pos) {
     if (pos < Y_Y_INST_SIZE) {
+        if (y->x_map[pos] && y->x_map[pos] != Y_BAD_ADDR) {
+            y86_link_x_rev(y, pos, 0);
+        }
         y->x_map[pos] = y->x_end;
+        y86_link_x_rev(y, pos, 1);
     } else {
         fprintf(stderr, "Too large y86 instruction size\n");
         longjmp(y->jmp, ys_ccf);
@@ -70,13 +124,26 @@ void y86_gen_deesp(Y_data *y) {
     YX(0x8D) YX(0xA4) YX(0x24) YXW(- (Y_word) &y->mem[0]) // leal -y->mem(%esp), %esp
 }
 
+void y86_gen_esp(Y_data *y, Y_word host) {
+    // %esp is converted only if the other form is needed (push, pop etc. need the host one)
+    if (y->x_esp != host) {
+        if (host) {
+            y86_gen_enesp(y);
+        } else {
+            y86_gen_deesp(y);
+        }
+        y->x_esp = host;
+    }
+}
+
 void y86_gen_enter(Y_data *y) {
     YX(0x0F) YX(0x7E) YX(0xCC) // movd %mm1, %esp
     y86_gen_enesp(y);
+    y->x_esp = 1;
 }
 
 void y86_gen_leave(Y_data *y) {
-    y86_gen_deesp(y);
+    y86_gen_esp(y, 0);
     YX(0x0F) YX(0x6E) YX(0xCC) // movd %esp, %mm1
     YX(0x0F) YX(0x7E) YX(0xD4) // movd %mm2, %esp
     YX(0xFF) YX(0x14) YX(0x24) // call (%esp)
@@ -89,13 +156,18 @@ void y86_gen_stat(Y_data *y, Y_stat stat) {
 void y86_gen_return(Y_data *y, Y_stat stat) {
     y86_gen_stat(y, stat);
     y86_gen_leave(y);
+
+    // Nothing falls through, no conversion before the next inst (its return address)
+    y->x_esp = 1;
 }
 
 void y86_gen_raw_jmp(Y_data *y, Y_addr value) {
+    y86_gen_esp(y, 1);
     YX(0xFF) YX(0x25) YXA(value) // jmp *value
 }
 
 void y86_gen_raw_call(Y_data *y, Y_addr value) {
+    y86_gen_esp(y, 1);
     YX(0xFF) YX(0x15) YXA(value) // call *value
 }
 
@@ -126,8 +198,14 @@ void y86_gen_x(Y_data *y, Y_inst op, Y_reg_id ra, Y_reg_id rb, Y_word val) {
         case yi_cmovge:
         case yi_cmovg:
             if (ra < yr_cnt && rb < yr_cnt) {
-                if ((ra == yri_esp) != (rb == yri_esp)) {
-                    y86_gen_deesp(y);
+                if (ra == yri_esp && rb == yri_esp) {
+                    // Nothing
+                    break;
+                }
+
+                // Y ESP is read, or written (cmov may keep the old one)
+                if (ra == yri_esp || (rb == yri_esp && op != yi_rrmovl)) {
+                    y86_gen_esp(y, 0);
                 }
 
                 switch (op) {
@@ -159,8 +237,8 @@ void y86_gen_x(Y_data *y, Y_inst op, Y_reg_id ra, Y_reg_id rb, Y_word val) {
                         break;
                 }
 
-                if ((ra == yri_esp) != (rb == yri_esp)) {
-                    y86_gen_enesp(y);
+                if (rb == yri_esp) {
+                    y->x_esp = 0;
                 }
             } else {
                 y86_gen_return(y, ys_ins);
@@ -170,10 +248,9 @@ void y86_gen_x(Y_data *y, Y_inst op, Y_reg_id ra, Y_reg_id rb, Y_word val) {
             if (ra == yr_nil && rb < yr_cnt) {
                 YX(0xB8 + rb) YXW(rb == yri_esp ? val + (Y_word) &y->mem[0] : val) // movl ...
 
-                // No longer necessary
-                // if (rb == yri_esp) {
-                //     y86_gen_enesp(y);
-                // }
+                if (rb == yri_esp) {
+                    y->x_esp = 1;
+                }
             } else {
                 y86_gen_return(y, ys_ins);
             }
@@ -181,16 +258,12 @@ void y86_gen_x(Y_data *y, Y_inst op, Y_reg_id ra, Y_reg_id rb, Y_word val) {
         case yi_rmmovl:
             if (ra < yr_cnt && rb < yr_cnt) {
                 if (ra == yri_esp) {
-                    y86_gen_deesp(y);
+                    y86_gen_esp(y, 0);
                 }
 
                 YX(0x89) YX(y86_x_regbyte_8(ra, rb)) // movl ...
                 if (rb == yri_esp) YX(0x24) // Extra byte for %esp
-                YXA(&(y->mem[val]))
-
-                if (ra == yri_esp) {
-                    y86_gen_enesp(y);
-                }
+                YXA(rb == yri_esp && y->x_esp ? (Y_addr) val : &(y->mem[val]))
             } else {
                 y86_gen_return(y, ys_ins);
             }
@@ -199,10 +272,10 @@ void y86_gen_x(Y_data *y, Y_inst op, Y_reg_id ra, Y_reg_id rb, Y_word val) {
             if (ra < yr_cnt && rb < yr_cnt) {
                 YX(0x8B) YX(y86_x_regbyte_8(ra, rb)) // movl ...
                 if (rb == yri_esp) YX(0x24) // Extra byte for %esp
-                YXA(&(y->mem[val]))
+                YXA(rb == yri_esp && y->x_esp ? (Y_addr) val : &(y->mem[val]))
 
                 if (ra == yri_esp) {
-                    y86_gen_enesp(y);
+                    y->x_esp = 0;
                 }
             } else {
                 y86_gen_return(y, ys_ins);
@@ -213,50 +286,23 @@ void y86_gen_x(Y_data *y, Y_inst op, Y_reg_id ra, Y_reg_id rb, Y_word val) {
         case yi_andl:
         case yi_xorl:
             if (ra < yr_cnt && rb < yr_cnt) {
+                // CC of Y ESP
+                if (ra == yri_esp || rb == yri_esp) {
+                    y86_gen_esp(y, 0);
+                }
+
                 switch (op) {
                     case yi_addl:
-                        if (ra == yri_esp || rb == yri_esp) {
-                            y86_gen_deesp(y);
-                        }
-
                         YX(0x01) YX(y86_x_regbyte_C(ra, rb)) // addl ...
-
-                        if (ra == yri_esp || rb == yri_esp) {
-                            y86_gen_enesp(y);
-                        }
                         break;
                     case yi_subl:
-                        if ((ra == yri_esp) != (rb == yri_esp)) {
-                            y86_gen_deesp(y);
-                        }
-
                         YX(0x29) YX(y86_x_regbyte_C(ra, rb)) // subl ...
-
-                        if ((ra == yri_esp) != (rb == yri_esp)) {
-                            y86_gen_enesp(y);
-                        }
                         break;
                     case yi_andl:
-                        if (ra == yri_esp || rb == yri_esp) {
-                            y86_gen_deesp(y);
-                        }
-
                         YX(0x21) YX(y86_x_regbyte_C(ra, rb)) // andl ...
-
-                        if (ra == yri_esp || rb == yri_esp) {
-                            y86_gen_enesp(y);
-                        }
                         break;
                     case yi_xorl:
-                        if ((ra == yri_esp) != (rb == yri_esp)) {
-                            y86_gen_deesp(y);
-                        }
-
                         YX(0x31) YX(y86_x_regbyte_C(ra, rb)) // xorl ...
-
-                        if ((ra == yri_esp) != (rb == yri_esp)) {
-                            y86_gen_enesp(y);
-                        }
                         break;
                     default:
                         // Impossible
@@ -276,6 +322,9 @@ void y86_gen_x(Y_data *y, Y_inst op, Y_reg_id ra, Y_reg_id rb, Y_word val) {
         case yi_jge:
         case yi_jg:
             if (val >= 0 && val < Y_Y_INST_SIZE) {
+                // Before jcc, lea keeps CC
+                y86_gen_esp(y, 1);
+
                 switch (op) {
                     case yi_jmp:
                         break;
@@ -323,13 +372,14 @@ void y86_gen_x(Y_data *y, Y_inst op, Y_reg_id ra, Y_reg_id rb, Y_word val) {
             }
             break;
         case yi_ret:
+            y86_gen_esp(y, 1);
             YX(0xC3) // ret
 
             break;
         case yi_pushl:
             if (ra < yr_cnt && rb == yr_nil) {
                 if (ra == yri_esp) {
-                    y86_gen_deesp(y);
+                    y86_gen_esp(y, 0);
 
                     YX(0x89) YX(y86_x_regbyte_8(ra, yri_esp)) // movl %ra, offset-4(%esp)
                     YX(0x24) // Extra byte for %esp
@@ -337,7 +387,9 @@ void y86_gen_x(Y_data *y, Y_inst op, Y_reg_id ra, Y_reg_id rb, Y_word val) {
 
                     y86_gen_enesp_d4(y);
                     // YX(0x8D) YX(0x64) YX(0x24) YX(0xFC) // leal -4(%esp), %esp
+                    y->x_esp = 1;
                 } else {
+                    y86_gen_esp(y, 1);
                     YX(0x50 + ra) // pushl %ra
                 }
             } else {
@@ -346,10 +398,11 @@ void y86_gen_x(Y_data *y, Y_inst op, Y_reg_id ra, Y_reg_id rb, Y_word val) {
             break;
         case yi_popl:
             if (ra < yr_cnt && rb == yr_nil) {
+                y86_gen_esp(y, 1);
                 YX(0x58 + ra) // popl %ra
 
                 if (ra == yri_esp) {
-                    y86_gen_enesp(y);
+                    y->x_esp = 0;
                 }
                 /*if (ra == yri_esp) {
                     YX(0x8D) YX(0x64) YX(0x24) YX(0x04) // leal 4(%esp), %esp
@@ -374,13 +427,13 @@ void y86_gen_x(Y_data *y, Y_inst op, Y_reg_id ra, Y_reg_id rb, Y_word val) {
     }
 }
 
-void y86_parse(Y_data *y, Y_char **inst, Y_char *end) {
+Y_inst y86_decode(Y_char **inst, Y_char *end, Y_reg_id *ra, Y_reg_id *rb, Y_word *val) {
     Y_inst op = **inst & 0xFF;
     (*inst)++;
 
-    Y_reg_id ra = yr_nil;
-    Y_reg_id rb = yr_nil;
-    Y_word val = 0;
+    *ra = yr_nil;
+    *rb = yr_nil;
+    *val = 0;
 
     switch (op) {
         case yi_halt:
@@ -403,8 +456,8 @@ void y86_parse(Y_data *y, Y_char **inst, Y_char *end) {
         case yi_popl:
             // Read registers
             if (*inst == end) op = yi_bad;
-            ra = HIGH(**inst);
-            rb = LOW(**inst);
+            *ra = HIGH(**inst);
+            *rb = LOW(**inst);
             (*inst)++;
 
             break;
@@ -414,13 +467,13 @@ void y86_parse(Y_data *y, Y_char **inst, Y_char *end) {
         case yi_mrmovl:
             // Read registers
             if (*inst == end) op = yi_bad;
-            ra = HIGH(**inst);
-            rb = LOW(**inst);
+            *ra = HIGH(**inst);
+            *rb = LOW(**inst);
             (*inst)++;
 
             // Read value
             if (*inst + sizeof(Y_word) > end) op = yi_bad;
-            val = IO_WORD(*inst);
+            *val = IO_WORD(*inst);
             *inst += sizeof(Y_word);
 
             break;
@@ -435,7 +488,7 @@ void y86_parse(Y_data *y, Y_char **inst, Y_char *end) {
         case yi_call:
             // Read value
             if (*inst + sizeof(Y_word) > end) op = yi_bad;
-            val = IO_WORD(*inst);
+            *val = IO_WORD(*inst);
             *inst += sizeof(Y_word);
 
             break;
@@ -447,17 +500,72 @@ void y86_parse(Y_data *y, Y_char **inst, Y_char *end) {
             break;
     }
 
+    return op;
+}
+
+void y86_decode_pc(Y_data *y, Y_word pc, Y_char *end) {
+    Y_char *inst = &(y->mem[pc]);
+    Y_reg_id ra;
+    Y_reg_id rb;
+
+    // Decoded once (the code is compiled once, never written)
+    if ((y->d_op[pc] & 0xFF) == yi_nil) {
+        y->d_op[pc] = y86_decode(&inst, end, &ra, &rb, &(y->d_val[pc]));
+        y->d_reg[pc] = ra << 4 | rb;
+        y->d_len[pc] = inst - &(y->mem[pc]);
+    }
+}
+
+void y86_parse(Y_data *y, Y_char **inst, Y_char *end) {
+    Y_word pc = *inst - &(y->mem[0]);
+    Y_reg_id ra;
+    Y_reg_id rb;
+    Y_word val;
+    Y_inst op;
+
+    // Decoded table in the code area
+    if (pc >= 0 && pc < Y_Y_INST_SIZE) {
+        y86_decode_pc(y, pc, end);
+
+        op = y->d_op[pc] & 0xFF;
+        ra = HIGH(y->d_reg[pc]);
+        rb = LOW(y->d_reg[pc]);
+        val = y->d_val[pc];
+        *inst += y->d_len[pc];
+    } else {
+        op = y86_decode(inst, end, &ra, &rb, &val);
+    }
+
     y86_gen_x(y, op, ra, rb, val);
 }
 
 void y86_load_reset(Y_data *y) {
     Y_word index;
     for (index = 0; index < Y_Y_INST_SIZE; ++index) {
+        if (y->x_map[index] && y->x_map[index] != Y_BAD_ADDR) {
+            y86_link_x_rev(y, index, 0);
+        }
         y->x_map[index] = 0;
     }
     y->x_end = &(y->x_inst[0]);
 }
 
+void y86_load_tgt(Y_data *y, Y_char *begin, Y_char *end) {
+    Y_char *inst;
+    Y_word val;
+
+    // Any bytes decoded as a jump or a call, even inside other insts
+    memset(&(y->x_tgt[0]), 0, Y_Y_INST_SIZE);
+    for (inst = begin; inst + 1 + sizeof(Y_word) <= end; ++inst) {
+        if ((HIGH(*inst) == HIGH(yi_jmp) && LOW(*inst) <= LOW(yi_jg)) || (*inst & 0xFF) == yi_call) {
+            val = IO_WORD(inst + 1);
+            if (val >= 0 && val < Y_Y_INST_SIZE) {
+                y->x_tgt[val] = 1;
+            }
+        }
+    }
+}
+
 void y86_load(Y_data *y, Y_char *begin) {
     Y_char *inst = begin;
     Y_char *end = &(y->mem[y->reg[yr_len]]);
@@ -468,6 +576,7 @@ void y86_load(Y_data *y, Y_char *begin) {
 
     Y_word pc = y->reg[yr_pc];
 
+    y86_load_tgt(y, begin, end);
     y86_gen_enter(y);
 
     while (inst != end) {
@@ -477,6 +586,10 @@ void y86_load(Y_data *y, Y_char *begin) {
             if (y->x_map[y->reg[yr_pc]] && y->x_map[y->reg[yr_pc]] != Y_BAD_ADDR) {
                 y86_gen_raw_jmp(y, y->x_map[y->reg[yr_pc]]);
             } else {
+                if (y->x_tgt[y->reg[yr_pc]]) {
+                    y86_gen_esp(y, 1);
+                }
+
                 y86_link_x_map(y, y->reg[yr_pc]);
                 y86_parse(y, &inst, end);
             }
@@ -486,6 +599,7 @@ void y86_load(Y_data *y, Y_char *begin) {
             if (y->x_map[inst - begin] == Y_BAD_ADDR) break;
         }
 
+        y86_gen_esp(y, 1);
         y86_link_x_map(y, y->reg[yr_pc] + 1);
         y86_gen_return(y, ys_hlt);
     };
@@ -525,7 +639,7 @@ void y86_load_file(Y_data *y, Y_char *fname) {
 }
 
 void y86_ready(Y_data *y) {
-    memcpy(&(y->bak_mem[0]), &(y->mem[0]), sizeof(y->bak_mem));
+    memcpy(&(y->bak_mem[0]), &(y->mem[0]), y->mem_size);
     memcpy(&(y->bak_reg[0]), &(y->reg[0]), sizeof(y->bak_reg));
 
     y->reg[yr_cc] = 0x40;
@@ -576,31 +690,28 @@ void __attribute__ ((noinline)) y86_exec(Y_data *y) {
     );
 }
 
-void y86_trace_pc(Y_data *y) {
-    Y_word index;
-
-    for (index = 0; index < Y_Y_INST_SIZE; ++index) {
-        if (y->reg[yr_rey] == (Y_word) y->x_map[index]) {
-            y->reg[yr_pc] = index;
-            return;
-        }
-    }
-}
-
 Y_word y86_trace_pc_2(Y_data *y, Y_word value) {
     Y_word index;
 
     if (value >= (Y_word) &y->x_inst[0] && value < (Y_word) &y->x_inst[Y_X_INST_SIZE]) {
-        for (index = 0; index < Y_Y_INST_SIZE; ++index) {
-            if (value == (Y_word) y->x_map[index]) {
-                return index;
-            }
+        index = y->x_rev[value - (Y_word) &y->x_inst[0]];
+
+        if (index) {
+            return index - 1;
         }
     }
 
     return value;
 }
 
+void y86_trace_pc(Y_data *y) {
+    Y_word index = y86_trace_pc_2(y, y->reg[yr_rey]);
+
+    if (index != y->reg[yr_rey]) {
+        y->reg[yr_pc] = index;
+    }
+}
+
 Y_word y86_get_im_ptr() {
     Y_word result;
     __asm__ __volatile__("movd %%mm4, %0": "=r" (result));
@@ -705,7 +816,7 @@ void y86_output(Y_data *y) {
 }
 
 void y86_free(Y_data *y) {
-    munmap(y, sizeof(Y_data));
+    munmap(y, y->size);
 }
 
 void f_usage(Y_char *pname) {
@@ -715,6 +826,10 @@ void f_usage(Y_char *pname) {
 Y_stat f_main(Y_char *fname) {
     Y_data *y = y86_new();
     Y_stat result;
+
+    if (!y) {
+        return 1;
+    }
     y->reg[yr_st] = setjmp(y->jmp);
 
     if (!(y->reg[yr_st])) {
@@ -0,0 +1,3405 @@
+#define _GNU_SOURCE // REG_RIP etc.
+#include "y86sim.h"
+#include <stddef.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <signal.h>
+#include <ucontext.h>
+#include <time.h>
+#include <dirent.h>
+#include <pthread.h>
+#include <unistd.h>
+#include <cpuid.h>
+#include <x86intrin.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/uio.h>
+
+// Host registers (x86-64):
+// EAX ECX EDX EBX EBP ESI EDI: Y86 registers with the same id
+// R8D: Y ESP
+// R9: Temp, Y target address of goto
+// R10: Goto routine (y86_goto), counts steps per block
+// R11: Check routine (y86_check, or y86_check_adx)
+// R12D: Mem pointer, for ys_ima and ys_imc
+// R13D: Stat
+// R14D: Step counter (decrease)
+// R15: Mem base (&y->mem[0]), fields of Y_data are at fixed negative offsets
+
+#define YX_R8 0x8
+#define YX_R9 0x9
+#define YX_R12 0xC
+#define YX_R15 0xF
+
+const Y_char y_x_reg[yr_cnt] = {0x0, 0x1, 0x2, 0x3, YX_R8, 0x5, 0x6, 0x7};
+
+// Entry of an inst (x_ent), jumped from goto
+// If not linked, the first bytes are replaced by a jump to the goto part
+
+#define YX_ENT_CNT_1 0x04
+#define YX_ENT_JMP 0x0C
+#define YX_ENT_CNT_2 0x13
+#define YX_ENT_GOTO 0x18
+#define YX_ENT_PC 0x1A
+
+#define YX_ENT_ADX_CNT_1 0x22
+#define YX_ENT_ADX_JMP 0x0E
+#define YX_ENT_ADX_CNT_2 0x15
+#define YX_ENT_ADX_GOTO 0x19
+#define YX_ENT_ADX_PC 0x1B
+
+#define YX_ENT(field) (y86_adx ? YX_ENT_ADX_##field : YX_ENT_##field)
+
+// Y86 CC is ZF, SF and OF only, so with ADX (adcx) and BMI2 (shrx), which
+// touch CF or nothing, the hot paths keep CC in the host flags without pushfq
+// CC is still stored at every exit of y86_exec (see y86_fin)
+Y_word y86_adx;
+
+const unsigned char y_x_ent[Y_X_ENT_SIZE] = {
+    0x9C, // pushfq
+    0x41, 0x81, 0xEE, 0x00, 0x00, 0x00, 0x00, // subl cnt, %r14d
+    0x78, 0x06, // js slow
+    0x9D, // popfq
+    0xE9, 0x00, 0x00, 0x00, 0x00, // jmp inst
+
+    // Slow: steps are not enough
+    0x41, 0x81, 0xC6, 0x00, 0x00, 0x00, 0x00, // addl cnt, %r14d
+    0x9D, // popfq
+
+    // Goto
+    0x41, 0xB9, 0x00, 0x00, 0x00, 0x00, // movl pc, %r9d
+    0x41, 0xFF, 0xE2 // jmp *%r10
+};
+
+const unsigned char y_x_ent_adx[Y_X_ENT_SIZE] = {
+    0xF8, // clc
+    0x66, 0x44, 0x0F, 0x38, 0xF6, 0x35, 0x17, 0x00, 0x00, 0x00, // adcx -cnt(%rip), %r14d
+    0x73, 0x05, // jnc slow
+    0xE9, 0x00, 0x00, 0x00, 0x00, // jmp inst
+
+    // Slow: steps are not enough
+    0x45, 0x8D, 0xB6, 0x00, 0x00, 0x00, 0x00, // leal cnt(%r14), %r14d
+
+    // Goto
+    0x41, 0xB9, 0x00, 0x00, 0x00, 0x00, // movl pc, %r9d
+    0x41, 0xFF, 0xE2, // jmp *%r10
+
+    0x00, 0x00, 0x00, 0x00 // -cnt
+};
+
+const unsigned char y_x_ent_unlinked[2] = {
+    0xEB, YX_ENT_GOTO - 2 // jmp goto
+};
+
+const unsigned char y_x_ent_adx_unlinked[2] = {
+    0xEB, YX_ENT_ADX_GOTO - 2 // jmp goto
+};
+
+#define Y_ALIGN(size) (((size_t) (size) + 0xF) & ~(size_t) 0xF)
+#define Y_DATA_SIZE Y_ALIGN(sizeof(Y_data))
+
+// Guard mode: mem ends at a page boundary, followed by PROT_NONE pages
+// covering every mem + (32-bit address) + 3, so bad accesses fault
+#define Y_PAGE_SIZE 0x1000
+#define Y_PAGE_ALIGN(size) (((size_t) (size) + Y_PAGE_SIZE - 1) & ~(size_t) (Y_PAGE_SIZE - 1))
+#define Y_GUARD_SIZE (((size_t) 1 << 32) + Y_PAGE_SIZE)
+
+void y86_adx_init(void) {
+    unsigned int eax, ebx, ecx, edx;
+
+    // CPUID.(EAX=7, ECX=0):EBX, bit 8 is BMI2, bit 19 is ADX
+    if (__get_cpuid_count(7, 0, &eax, &ebx, &ecx, &edx)) {
+        y86_adx = (ebx >> 8 & 1) && (ebx >> 19 & 1);
+    }
+}
+
+void y86_guard_init(void);
+void y86_decode_reset(Y_data *y);
+
+Y_data *y86_new(Y_word mem_size, Y_word y_inst_size, Y_word x_inst_size, Y_word guard) {
+    Y_data *y;
+    Y_char *pos;
+
+    // mem is right after Y_data (see y86_exec), x_ent and p_cnt are near x_inst (rel32)
+    size_t size_mem = guard ? 0 : Y_ALIGN(mem_size + sizeof(Y_word));
+    size_t size_head = guard ? Y_PAGE_ALIGN(Y_DATA_SIZE + mem_size) + Y_GUARD_SIZE : Y_DATA_SIZE + size_mem;
+    size_t size_bak_mem = Y_ALIGN(mem_size);
+    size_t size_x_map = Y_ALIGN(y_inst_size * sizeof(Y_addr));
+    size_t size_x_rev = Y_ALIGN((x_inst_size + 1) * sizeof(Y_word));
+    size_t size_x_word = Y_ALIGN((y_inst_size + 1) * sizeof(Y_word));
+    size_t size_x_code = Y_ALIGN(y_inst_size + Y_X_CODE_EXTRA + sizeof(Y_word));
+    size_t size_x_inst = Y_ALIGN(x_inst_size);
+    size_t size_x_ent = Y_ALIGN((size_t) y_inst_size * Y_X_ENT_SIZE);
+    size_t size_p_long = Y_ALIGN((y_inst_size + 1) * sizeof(unsigned long long));
+    size_t size_d_char = Y_ALIGN(y_inst_size);
+    size_t size_d_val = Y_ALIGN(y_inst_size * sizeof(Y_word));
+    size_t size = size_head + size_bak_mem + size_x_map + size_x_rev
+        + 3 * size_x_word + size_x_code + size_x_inst + size_x_ent
+        + 3 * size_p_long + 3 * size_d_char + size_d_val;
+
+    if (
+        mem_size <= 0 || mem_size > Y_MEM_SIZE_MAX || mem_size % (guard ? 0x10 : sizeof(Y_word))
+        || y_inst_size <= 0 || y_inst_size > Y_Y_INST_SIZE_MAX || y_inst_size > mem_size
+        || x_inst_size <= 0 || x_inst_size > Y_X_INST_SIZE_MAX
+    ) {
+        fprintf(stderr, "Bad memory size (mem: 0x%x, code: 0x%x, cache: 0x%x)\n", mem_size, y_inst_size, x_inst_size);
+        return 0;
+    }
+
+    pos = mmap(
+        0, size,
+        PROT_READ | PROT_WRITE | PROT_EXEC,
+        MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE,
+        -1, 0
+    );
+    if (pos == MAP_FAILED) {
+        fprintf(stderr, "mmap() failed (0x%lx)\n", (unsigned long) size);
+        return 0;
+    }
+
+    if (guard) {
+        // Y_data, mem (at the end of the page), guard
+        y = (Y_data *) (pos + size_head - Y_GUARD_SIZE - mem_size - Y_DATA_SIZE);
+
+        if (mprotect(pos + size_head - Y_GUARD_SIZE, Y_GUARD_SIZE, PROT_NONE)) {
+            fprintf(stderr, "mprotect() failed\n");
+            munmap(pos, size);
+            return 0;
+        }
+
+        y86_guard_init();
+    } else {
+        // Y_data, mem
+        y = (Y_data *) pos;
+    }
+
+    y->mem_size = mem_size;
+    y->x_inst_size = x_inst_size;
+    y->y_inst_size = y_inst_size;
+    y->x_code_size = y_inst_size + Y_X_CODE_EXTRA;
+    y->size = size;
+    y->map = pos;
+    y->guard = guard;
+    y->out = stdout;
+
+    y->mem = (Y_char *) y + Y_DATA_SIZE;
+    pos += size_head;
+    y->bak_mem = pos; pos += size_bak_mem;
+    y->x_map = (Y_addr *) pos; pos += size_x_map;
+    y->x_rev = (Y_word *) pos; pos += size_x_rev;
+    y->x_cnt = (Y_word *) pos; pos += size_x_word;
+    y->x_blk = (Y_word *) pos; pos += size_x_word;
+    y->x_seq = (Y_word *) pos; pos += size_x_word;
+    y->x_code = pos; pos += size_x_code;
+    y->x_inst = pos; pos += size_x_inst;
+    y->x_ent = (Y_char (*)[Y_X_ENT_SIZE]) pos; pos += size_x_ent;
+    y->p_cnt = (unsigned long long *) pos; pos += size_p_long;
+    y->p_inst = (unsigned long long *) pos; pos += size_p_long;
+    y->p_tsc = (unsigned long long *) pos; pos += size_p_long;
+    y->d_op = pos; pos += size_d_char;
+    y->d_reg = pos; pos += size_d_char;
+    y->d_len = pos; pos += size_d_char;
+    y->d_val = (Y_word *) pos;
+
+    y86_decode_reset(y);
+
+    // Nothing compiled yet (see y86_reset, if loading fails)
+    y->x_end = &(y->x_inst[0]);
+
+    return y;
+}
+
+#define YX(data) {y86_push_x(y, data);}
+#define YXW(data) {y86_push_x_word(y, data);}
+
+void y86_push_x(Y_data *y, Y_char value) {
+    if (y->x_end < &(y->x_inst[y->x_inst_size])) {
+        *(y->x_end) = value;
+        y->x_end++;
+    } else {
+        fprintf(stderr, "Too large compiled instruction size (char: 0x%x)\n", value);
+        longjmp(y->jmp, ys_ccf);
+    }
+}
+
+void y86_push_x_word(Y_data *y, Y_word value) {
+    if (y->x_end + sizeof(Y_word) <= &(y->x_inst[y->x_inst_size])) {
+        IO_WORD(y->x_end) = value;
+        y->x_end += sizeof(Y_word);
+    } else {
+        fprintf(stderr, "Too large compiled instruction size (word: 0x%x)\n", value);
+        longjmp(y->jmp, ys_ccf);
+    }
+}
+
+void y86_link_x_rev(Y_data *y, Y_word pos, Y_word value) {
+    // Reverse map of x_map, the first inst if some insts have no code
+    Y_word *rev = &(y->x_rev[y->x_map[pos] - &(y->x_inst[0])]);
+
+    if (value) {
+        if (!*rev || y->x_map[*rev - 1] != y->x_map[pos] || *rev - 1 > pos) {
+            *rev = pos + 1;
+        }
+    } else {
+        if (*rev == pos + 1) {
+            *rev = 0;
+        }
+    }
+}
+
+void y86_link_x_map(Y_data *y, Y_word pos) {
+    if (pos < y->y_inst_size) {
+        if (y->x_map[pos] && y->x_map[pos] != Y_BAD_ADDR) {
+            y86_link_x_rev(y, pos, 0);
+        }
+        y->x_map[pos] = y->x_end;
+        y86_link_x_rev(y, pos, 1);
+    } else {
+        fprintf(stderr, "Too large y86 instruction size\n");
+        longjmp(y->jmp, ys_ccf);
+    }
+}
+
+Y_word y86_x_mem_offset(Y_data *y, void *value) {
+    return (Y_char *) value - &(y->mem[0]);
+}
+
+void y86_gen_rex(Y_data *y, Y_char r, Y_char x, Y_char b) {
+    if ((r | x | b) & 0x8) {
+        YX(0x40 | (r & 0x8) >> 1 | (x & 0x8) >> 2 | (b & 0x8) >> 3) // REX.RXB
+    }
+}
+
+void y86_gen_opcode(Y_data *y, Y_word opcode) {
+    if (opcode > 0xFF) {
+        YX(opcode >> 8)
+    }
+    YX(opcode)
+}
+
+void y86_gen_op_rr(Y_data *y, Y_word opcode, Y_char reg, Y_char rm) {
+    y86_gen_rex(y, reg, 0, rm);
+    y86_gen_opcode(y, opcode);
+    YX(0xC0 | (reg & 0x7) << 3 | (rm & 0x7)) // op %reg, %rm
+}
+
+void y86_gen_op_rm(Y_data *y, Y_word opcode, Y_char reg, Y_char base, Y_word offset) {
+    y86_gen_rex(y, reg, 0, base);
+    y86_gen_opcode(y, opcode);
+    YX(0x80 | (reg & 0x7) << 3 | (base & 0x7)) // op %reg, offset(%base)
+    if ((base & 0x7) == 0x4) YX(0x24) // Extra byte for %esp and %r12
+    YXW(offset)
+}
+
+void y86_gen_op_ri(Y_data *y, Y_char ext, Y_char rm, Y_word value) {
+    y86_gen_rex(y, 0, 0, rm);
+    if (value >= -0x80 && value < 0x80) {
+        YX(0x83) YX(0xC0 | ext << 3 | (rm & 0x7)) YX(value) // op $imm8, %rm
+    } else {
+        YX(0x81) YX(0xC0 | ext << 3 | (rm & 0x7)) YXW(value) // op $imm32, %rm
+    }
+}
+
+void y86_gen_mov_ri(Y_data *y, Y_char rm, Y_word value) {
+    y86_gen_rex(y, 0, 0, rm);
+    YX(0xB8 + (rm & 0x7)) YXW(value) // movl $imm32, %rm
+}
+
+void y86_gen_op_mem(Y_data *y, Y_word opcode, Y_char reg, Y_char index) {
+    y86_gen_rex(y, reg, index, YX_R15);
+    y86_gen_opcode(y, opcode);
+    YX(0x04 | (reg & 0x7) << 3) // op %reg, (%r15, %index)
+    YX((index & 0x7) << 3 | (YX_R15 & 0x7))
+}
+
+void y86_gen_check(Y_data *y) {
+    YX(0x41) YX(0xFF) YX(0xD3) // call *%r11
+}
+
+Y_word y86_gen_prof_size(Y_data *y) {
+    return y->p_mode ? (y->p_mode > 1 ? 31 : 18) : 0;
+}
+
+void y86_gen_prof(Y_data *y, Y_word pc) {
+    // Profiling: the block of pc is entered, counted without touching CC (see y86_prof_flush)
+    if (y->p_mode > 1) {
+        y86_gen_mov_ri(y, YX_R9, pc); // movl pc, %r9d
+        YX(0x41) YX(0xFF) YX(0x97) YXW((Y_word) offsetof(Y_data, p_func) - (Y_word) Y_DATA_SIZE) // call *p_func(%r15)
+    }
+    if (y->p_mode) {
+        YX(0x4C) YX(0x8B) YX(0x0D) YXW((Y_char *) &(y->p_cnt[pc]) - (y->x_end + sizeof(Y_word))) // movq cnt(%rip), %r9
+        YX(0x4D) YX(0x8D) YX(0x49) YX(0x01) // leaq 1(%r9), %r9
+        YX(0x4C) YX(0x89) YX(0x0D) YXW((Y_char *) &(y->p_cnt[pc]) - (y->x_end + sizeof(Y_word))) // movq %r9, cnt(%rip)
+    }
+}
+
+Y_word y86_gen_goto_size(Y_data *y) {
+    return 5 + y86_gen_prof_size(y);
+}
+
+void y86_gen_goto(Y_data *y, Y_word pc) {
+    // If changed, y86_gen_goto_size should be updated (jmp_skip of jump instruction etc.)
+    // And y86_trace_pc should be updated
+
+    y86_gen_prof(y, pc);
+    YX(0xE9) YXW(&(y->x_ent[pc][0]) - (y->x_end + sizeof(Y_word))) // jmp entry
+}
+
+void y86_gen_rec(Y_data *y, Y_word write) {
+    // Tracing: a raw record after the inst, before the ys_imc check (see y86_rec_store)
+    if (y->r_buf) {
+        y86_gen_mov_ri(y, YX_R9, y->reg[yr_pc] | (write ? Y_REC_WRITE : 0)); // movl pc, %r9d
+        YX(0x41) YX(0xFF) YX(0x97) YXW((Y_word) offsetof(Y_data, r_func) - (Y_word) Y_DATA_SIZE) // call *r_func(%r15)
+    }
+}
+
+void y86_gen_stat(Y_data *y, Y_stat stat) {
+    YX(0x41) YX(0xBD) YXW(stat) // movl stat, %r13d
+}
+
+void y86_gen_stop(Y_data *y, Y_stat stat) {
+    y86_gen_stat(y, stat);
+    y86_gen_check(y);
+
+    // Never return here, and the return address never hits x_map
+    YX(0xCC) // int3
+}
+
+void y86_gen_ima_stat(Y_data *y) {
+    // With guard pages, bad accesses fault instead (see y86_guard_segv)
+    if (!y->guard && !y86_adx) {
+        y86_gen_stat(y, ys_ima);
+    }
+}
+
+void y86_gen_ima_check(Y_data *y) {
+    if (!y->guard) {
+        if (y86_adx) {
+            // Call only if r12 >= mem_size, CC is not changed
+            YX(0x41) YX(0xB9) YXW(-y->mem_size) // movl -mem_size, %r9d
+            YX(0xF8) // clc
+            YX(0x66) YX(0x45) YX(0x0F) YX(0x38) YX(0xF6) YX(0xCC) // adcx %r12d, %r9d
+            YX(0x73) YX(0x09) // jnc ok
+            y86_gen_stat(y, ys_ima);
+        }
+        y86_gen_check(y);
+    }
+}
+
+void y86_gen_protect(Y_data *y) {
+    y86_gen_stop(y, ys_hlt);
+}
+
+Y_word y86_gen_x(Y_data *y, Y_inst op, Y_reg_id ra, Y_reg_id rb, Y_word val) {
+    Y_word jmp_skip = y86_gen_goto_size(y);
+    Y_word next = y->reg[yr_pc] + 5; // For jump instruction
+    Y_word goto_next = next < y->y_inst_size;
+    Y_word end = 0;
+    Y_word recorded = 0;
+    Y_stat stop = ys_aok;
+
+    Y_char xa = ra < yr_cnt ? y_x_reg[ra] : 0;
+    Y_char xb = rb < yr_cnt ? y_x_reg[rb] : 0;
+
+    // Always: ra, rb >= 0
+    switch (op) {
+        case yi_halt:
+            stop = ys_hlt;
+            break;
+        case yi_nop:
+            // Nothing
+            break;
+        case yi_rrmovl:
+        case yi_cmovle:
+        case yi_cmovl:
+        case yi_cmove:
+        case yi_cmovne:
+        case yi_cmovge:
+        case yi_cmovg:
+            if (ra < yr_cnt && rb < yr_cnt) {
+                switch (op) {
+                    case yi_rrmovl:
+                        y86_gen_op_rr(y, 0x89, xa, xb); // movl ...
+                        break;
+                    case yi_cmovle:
+                        y86_gen_op_rr(y, 0x0F4E, xb, xa); // cmovle ...
+                        break;
+                    case yi_cmovl:
+                        y86_gen_op_rr(y, 0x0F4C, xb, xa); // cmovl ...
+                        break;
+                    case yi_cmove:
+                        y86_gen_op_rr(y, 0x0F44, xb, xa); // cmove ...
+                        break;
+                    case yi_cmovne:
+                        y86_gen_op_rr(y, 0x0F45, xb, xa); // cmovne ...
+                        break;
+                    case yi_cmovge:
+                        y86_gen_op_rr(y, 0x0F4D, xb, xa); // cmovge ...
+                        break;
+                    case yi_cmovg:
+                        y86_gen_op_rr(y, 0x0F4F, xb, xa); // cmovg ...
+                        break;
+                    default:
+                        // Impossible
+                        fprintf(stderr, "Internal bug!\n");
+                        longjmp(y->jmp, ys_ccf);
+                        break;
+                }
+            } else {
+                stop = ys_ins;
+            }
+            break;
+        case yi_irmovl:
+            if (ra == yr_nil && rb < yr_cnt) {
+                y86_gen_mov_ri(y, xb, val); // movl ...
+            } else {
+                stop = ys_ins;
+            }
+            break;
+        case yi_rmmovl:
+            if (ra < yr_cnt && rb < yr_cnt) {
+                y86_gen_ima_stat(y);
+                y86_gen_op_rm(y, 0x8D, YX_R12, xb, val); // leal offset(%rb), %r12d
+                y86_gen_ima_check(y);
+
+                y86_gen_op_mem(y, 0x89, xa, YX_R12); // movl %ra, (%r15, %r12)
+                y86_gen_rec(y, 1);
+                recorded = 1;
+
+                y86_gen_stat(y, ys_imc);
+                y86_gen_check(y);
+            } else {
+                stop = ys_ins;
+            }
+            break;
+        case yi_mrmovl:
+            if (ra < yr_cnt && rb < yr_cnt) {
+                y86_gen_ima_stat(y);
+                y86_gen_op_rm(y, 0x8D, YX_R12, xb, val); // leal offset(%rb), %r12d
+                y86_gen_ima_check(y);
+
+                y86_gen_op_mem(y, 0x8B, xa, YX_R12); // movl (%r15, %r12), %ra
+            } else {
+                stop = ys_ins;
+            }
+            break;
+        case yi_addl:
+        case yi_subl:
+        case yi_andl:
+        case yi_xorl:
+            if (ra < yr_cnt && rb < yr_cnt) {
+                switch (op) {
+                    case yi_addl:
+                        y86_gen_op_rr(y, 0x01, xa, xb); // addl ...
+                        break;
+                    case yi_subl:
+                        y86_gen_op_rr(y, 0x29, xa, xb); // subl ...
+                        break;
+                    case yi_andl:
+                        y86_gen_op_rr(y, 0x21, xa, xb); // andl ...
+                        break;
+                    case yi_xorl:
+                        y86_gen_op_rr(y, 0x31, xa, xb); // xorl ...
+                        break;
+                    default:
+                        // Impossible
+                        fprintf(stderr, "Internal bug!\n");
+                        longjmp(y->jmp, ys_ccf);
+                        break;
+                }
+            } else {
+                stop = ys_ins;
+            }
+            break;
+        case yi_jmp:
+        case yi_jle:
+        case yi_jl:
+        case yi_je:
+        case yi_jne:
+        case yi_jge:
+        case yi_jg:
+            if (val >= 0 && val < y->y_inst_size) {
+                y86_gen_rec(y, 0);
+                recorded = 1;
+
+                switch (op) {
+                    case yi_jmp:
+                        goto_next = 0;
+                        break;
+                    case yi_jle:
+                        YX(0x7F) YX(jmp_skip) // jg after
+                        break;
+                    case yi_jl:
+                        YX(0x7D) YX(jmp_skip) // jge after
+                        break;
+                    case yi_je:
+                        YX(0x75) YX(jmp_skip) // jne after
+                        break;
+                    case yi_jne:
+                        YX(0x74) YX(jmp_skip) // je after
+                        break;
+                    case yi_jge:
+                        YX(0x7C) YX(jmp_skip) // jl after
+                        break;
+                    case yi_jg:
+                        YX(0x7E) YX(jmp_skip) // jle after
+                        break;
+                    default:
+                        // Impossible
+                        fprintf(stderr, "Internal bug!\n");
+                        longjmp(y->jmp, ys_ccf);
+                        break;
+                }
+
+                if (!y->x_map[val]) {
+                    y->x_map[val] = Y_BAD_ADDR;
+                }
+                y86_gen_goto(y, val);
+
+                if (goto_next) {
+                    // Fall through
+                    y86_gen_goto(y, next);
+                    end = 1;
+                } else {
+                    // If next >= y_inst_size, continue the block
+                    end = op == yi_jmp;
+                }
+            } else {
+                stop = ys_adp;
+            }
+            break;
+        case yi_call:
+            if (val >= 0 && val < y->y_inst_size) {
+                y86_gen_op_rm(y, 0x8D, YX_R8, YX_R8, -4); // leal -4(%r8), %r8d
+
+                y86_gen_ima_stat(y);
+                y86_gen_op_rr(y, 0x89, YX_R8, YX_R12); // movl %r8d, %r12d
+                y86_gen_ima_check(y);
+
+                YX(0x43) YX(0xC7) YX(0x04) YX(0x07) YXW(y->reg[yr_pc] + 5) // movl %pc+5, (%r15, %r8)
+                y86_gen_rec(y, 1);
+                recorded = 1;
+
+                y86_gen_stat(y, ys_imc);
+                y86_gen_check(y);
+
+                if (!y->x_map[val]) {
+                    y->x_map[val] = Y_BAD_ADDR;
+                }
+                y86_gen_goto(y, val);
+                end = 1;
+            } else {
+                stop = ys_adp;
+            }
+            break;
+        case yi_ret:
+            stop = ys_ret;
+
+            break;
+        case yi_pushl:
+            if (ra < yr_cnt && rb == yr_nil) {
+                y86_gen_op_rm(y, 0x8D, YX_R8, YX_R8, -4); // leal -4(%r8), %r8d
+
+                y86_gen_ima_stat(y);
+                y86_gen_op_rr(y, 0x89, YX_R8, YX_R12); // movl %r8d, %r12d
+                y86_gen_ima_check(y);
+
+                if (ra == yri_esp) {
+                    // Push the old value
+                    y86_gen_op_rm(y, 0x8D, YX_R9, YX_R8, 4); // leal 4(%r8), %r9d
+                    y86_gen_op_mem(y, 0x89, YX_R9, YX_R12); // movl %r9d, (%r15, %r12)
+                } else {
+                    y86_gen_op_mem(y, 0x89, xa, YX_R12); // movl %ra, (%r15, %r12)
+                }
+                y86_gen_rec(y, 1);
+                recorded = 1;
+
+                y86_gen_stat(y, ys_imc);
+                y86_gen_check(y);
+            } else {
+                stop = ys_ins;
+            }
+            break;
+        case yi_popl:
+            if (ra < yr_cnt && rb == yr_nil) {
+                y86_gen_ima_stat(y);
+                y86_gen_op_rr(y, 0x89, YX_R8, YX_R12); // movl %r8d, %r12d
+                y86_gen_ima_check(y);
+
+                // Load first, the access may fault
+                y86_gen_op_mem(y, 0x8B, xa, YX_R12); // movl (%r15, %r12), %ra
+                if (ra != yri_esp) {
+                    y86_gen_op_rm(y, 0x8D, YX_R8, YX_R8, 4); // leal 4(%r8), %r8d
+                }
+            } else {
+                stop = ys_ins;
+            }
+            break;
+        case yi_bad:
+            stop = ys_ins;
+            break;
+        default:
+            // Impossible
+            fprintf(stderr, "Internal bug!\n");
+            longjmp(y->jmp, ys_ccf);
+            break;
+    }
+
+    if (stop) {
+        y86_gen_stop(y, stop);
+        end = 1;
+    } else if (!recorded) {
+        y86_gen_rec(y, 0);
+    }
+
+    return end;
+}
+
+void y86_decode(Y_char **inst, Y_char *end, Y_inst *op_out, Y_reg_id *ra_out, Y_reg_id *rb_out, Y_word *val_out) {
+    Y_inst op = **inst & 0xFF;
+    (*inst)++;
+
+    Y_reg_id ra = yr_nil;
+    Y_reg_id rb = yr_nil;
+    Y_word val = 0;
+
+    switch (op) {
+        case yi_halt:
+        case yi_nop:
+        case yi_ret:
+            break;
+
+        case yi_rrmovl:
+        case yi_cmovle:
+        case yi_cmovl:
+        case yi_cmove:
+        case yi_cmovne:
+        case yi_cmovge:
+        case yi_cmovg:
+        case yi_addl:
+        case yi_subl:
+        case yi_andl:
+        case yi_xorl:
+        case yi_pushl:
+        case yi_popl:
+            // Read registers
+            if (*inst == end) op = yi_bad;
+            ra = HIGH(**inst);
+            rb = LOW(**inst);
+            (*inst)++;
+
+            break;
+
+        case yi_irmovl:
+        case yi_rmmovl:
+        case yi_mrmovl:
+            // Read registers
+            if (*inst == end) op = yi_bad;
+            ra = HIGH(**inst);
+            rb = LOW(**inst);
+            (*inst)++;
+
+            // Read value
+            if (*inst + sizeof(Y_word) > end) op = yi_bad;
+            val = IO_WORD(*inst);
+            *inst += sizeof(Y_word);
+
+            break;
+
+        case yi_jmp:
+        case yi_jle:
+        case yi_jl:
+        case yi_je:
+        case yi_jne:
+        case yi_jge:
+        case yi_jg:
+        case yi_call:
+            // Read value
+            if (*inst + sizeof(Y_word) > end) op = yi_bad;
+            val = IO_WORD(*inst);
+            *inst += sizeof(Y_word);
+
+            break;
+
+        case yi_bad:
+        default:
+            op = yi_bad;
+
+            break;
+    }
+
+    *op_out = op;
+    *ra_out = ra;
+    *rb_out = rb;
+    *val_out = val;
+}
+
+void y86_decode_reset(Y_data *y) {
+    Y_word index;
+
+    memset(&(y->d_op[0]), yi_nil, y->y_inst_size);
+    for (index = 0; index < y->x_code_size + (Y_word) sizeof(Y_word); ++index) {
+        y->x_code[index] &= ~Y_X_CODE_DEC;
+    }
+}
+
+void y86_decode_pc(Y_data *y, Y_word pc) {
+    Y_char *inst = &(y->mem[pc]);
+    Y_inst op;
+    Y_reg_id ra;
+    Y_reg_id rb;
+    Y_word index;
+
+    // Decoded once, until the bytes are written (see y86_unload_mem)
+    if ((y->d_op[pc] & 0xFF) == yi_nil) {
+        y86_decode(&inst, &(y->mem[y->mem_size]), &op, &ra, &rb, &(y->d_val[pc]));
+        y->d_op[pc] = op;
+        y->d_reg[pc] = ra << 4 | rb;
+        y->d_len[pc] = inst - &(y->mem[pc]);
+
+        for (index = 0; index < y->d_len[pc]; ++index) {
+            y->x_code[pc + index] |= Y_X_CODE_DEC;
+        }
+    }
+}
+
+void y86_unload_decode(Y_data *y, Y_word addr) {
+    Y_word index;
+
+    // Insts covering the written word (up to 6 bytes long)
+    for (index = addr - 5; index < addr + (Y_word) sizeof(Y_word); ++index) {
+        if (index >= 0 && index < y->y_inst_size) {
+            y->d_op[index] = yi_nil;
+        }
+    }
+    for (index = addr; index < addr + (Y_word) sizeof(Y_word); ++index) {
+        y->x_code[index] &= ~Y_X_CODE_DEC;
+    }
+}
+
+void y86_decode_inst(Y_data *y, Y_char **inst, Y_char *end, Y_inst *op_out, Y_reg_id *ra_out, Y_reg_id *rb_out, Y_word *val_out) {
+    Y_word pc = *inst - &(y->mem[0]);
+
+    // Decoded table in the code area
+    if (pc < y->y_inst_size) {
+        y86_decode_pc(y, pc);
+
+        *op_out = y->d_op[pc] & 0xFF;
+        *ra_out = HIGH(y->d_reg[pc]);
+        *rb_out = LOW(y->d_reg[pc]);
+        *val_out = y->d_val[pc];
+        *inst += y->d_len[pc];
+    } else {
+        y86_decode(inst, end, op_out, ra_out, rb_out, val_out);
+    }
+}
+
+Y_word y86_parse(Y_data *y, Y_char **inst, Y_char *end) {
+    Y_inst op;
+    Y_reg_id ra;
+    Y_reg_id rb;
+    Y_word val;
+
+    y86_decode_inst(y, inst, end, &op, &ra, &rb, &val);
+
+    if (y86_gen_x(y, op, ra, rb, val)) {
+        return 1;
+    }
+
+    // Count per instruction: every instruction is a block
+    if (y->reg[yr_sm] && *inst - &(y->mem[0]) < y->y_inst_size) {
+        y86_gen_goto(y, *inst - &(y->mem[0]));
+        return 1;
+    }
+
+    return 0;
+}
+
+void y86_fuse_sink(Y_data *y, Y_char *known, Y_word *value, Y_reg_id reg) {
+    // Write a sunk irmovl, the value is observed
+    if (known[reg] > 1) {
+        y86_gen_mov_ri(y, y_x_reg[reg], value[reg]); // movl ...
+        known[reg] = 1;
+    }
+}
+
+void y86_fuse_sink_all(Y_data *y, Y_char *known, Y_word *value) {
+    Y_reg_id reg;
+
+    for (reg = 0; reg < yr_cnt; ++reg) {
+        y86_fuse_sink(y, known, value, reg);
+    }
+}
+
+Y_word y86_fuse(Y_data *y, Y_word pc) {
+    Y_word next = pc;
+    Y_word addr;
+    Y_word count = 0;
+    Y_inst op;
+    Y_reg_id ra;
+    Y_reg_id rb;
+
+    // Registers of known value (1), and not written yet (2, the irmovl is sunk)
+    Y_char known[yr_cnt] = {0};
+    Y_word value[yr_cnt] = {0};
+
+    // From irmovl $k, %rb, until an inst not below or an entry
+    // Insts after the first one have no entry (see y86_load), nothing faults or stops among them
+    // So sunk values are written only before an exit (the end, or rmmovl)
+    y86_decode_pc(y, pc);
+    if (
+        y->reg[yr_sm] || y->r_buf || (y->d_op[pc] & 0xFF) != yi_irmovl
+        || HIGH(y->d_reg[pc]) != yr_nil || LOW(y->d_reg[pc]) >= yr_cnt
+    ) {
+        return 0;
+    }
+
+    while (next < y->y_inst_size && (next == pc || !y->x_map[next])) {
+        y86_decode_pc(y, next);
+        op = y->d_op[next] & 0xFF;
+        ra = HIGH(y->d_reg[next]);
+        rb = LOW(y->d_reg[next]);
+        addr = rb < yr_cnt ? value[rb] + y->d_val[next] : 0;
+
+        if (op == yi_nop) {
+            // Nothing
+        } else if (op == yi_irmovl && ra == yr_nil && rb < yr_cnt) {
+            // The last value is dead if sunk
+            known[rb] = 2;
+            value[rb] = y->d_val[next];
+        } else if (ra >= yr_cnt || rb >= yr_cnt) {
+            break;
+        } else if (op == yi_rrmovl && known[ra]) {
+            if (ra != rb) {
+                known[rb] = 2;
+                value[rb] = value[ra];
+            }
+        } else if (
+            (op == yi_addl || op == yi_subl || op == yi_andl || op == yi_xorl)
+            && known[ra] && !known[rb]
+        ) {
+            switch (op) {
+                case yi_addl:
+                    y86_gen_op_ri(y, 0, y_x_reg[rb], value[ra]); // addl $k, ...
+                    break;
+                case yi_subl:
+                    y86_gen_op_ri(y, 5, y_x_reg[rb], value[ra]); // subl $k, ...
+                    break;
+                case yi_andl:
+                    y86_gen_op_ri(y, 4, y_x_reg[rb], value[ra]); // andl $k, ...
+                    break;
+                default:
+                    y86_gen_op_ri(y, 6, y_x_reg[rb], value[ra]); // xorl $k, ...
+                    break;
+            }
+        } else if (
+            op == yi_rrmovl || op == yi_cmovle || op == yi_cmovl || op == yi_cmove
+            || op == yi_cmovne || op == yi_cmovge || op == yi_cmovg
+            || op == yi_addl || op == yi_subl || op == yi_andl || op == yi_xorl
+        ) {
+            // rb is overwritten by rrmovl only
+            if (op == yi_rrmovl) {
+                known[rb] = 0;
+            }
+            y86_fuse_sink(y, known, value, ra);
+            y86_fuse_sink(y, known, value, rb);
+            y86_gen_x(y, op, ra, rb, 0);
+            known[rb] = 0;
+        } else if (op == yi_mrmovl && known[rb] && (unsigned) addr < (unsigned) y->mem_size) {
+            // Address known, not checked
+            y86_gen_op_rm(y, 0x8B, y_x_reg[ra], YX_R15, addr); // movl addr(%r15), %ra
+            known[ra] = 0;
+        } else if (op == yi_rmmovl && known[rb] && (unsigned) addr < (unsigned) y->mem_size) {
+            // Address known, not checked, the last one (an exit if the code is written)
+            y86_fuse_sink_all(y, known, value);
+            y86_gen_mov_ri(y, YX_R12, addr); // movl addr, %r12d
+            y86_gen_op_mem(y, 0x89, y_x_reg[ra], YX_R12); // movl %ra, (%r15, %r12)
+
+            y86_gen_stat(y, ys_imc);
+            y86_gen_check(y);
+
+            next += y->d_len[next];
+            ++count;
+            break;
+        } else {
+            break;
+        }
+
+        next += y->d_len[next];
+        ++count;
+    }
+
+    if (count < 2) {
+        // irmovl only, nothing generated
+        return 0;
+    }
+
+    y86_fuse_sink_all(y, known, value);
+
+    return next - pc;
+}
+
+Y_word y86_fused(Y_data *y, Y_word pc) {
+    // Loaded, but not an entry
+    return pc < y->y_inst_size && (y->x_code[pc] & 1)
+        && (!y->x_map[pc] || y->x_map[pc] == Y_BAD_ADDR);
+}
+
+void y86_link_ent(Y_data *y, Y_word pc) {
+    Y_char *ent = &(y->x_ent[pc][0]);
+
+    // Added with adcx, a carry means enough steps
+    IO_WORD(&ent[YX_ENT(CNT_1)]) = y86_adx ? -y->x_cnt[pc] : y->x_cnt[pc];
+    IO_WORD(&ent[YX_ENT(JMP)]) = y->x_map[pc] - &ent[YX_ENT(JMP) + sizeof(Y_word)];
+    IO_WORD(&ent[YX_ENT(CNT_2)]) = y->x_cnt[pc];
+
+    // Replace the jump to goto
+    memcpy(ent, y86_adx ? y_x_ent_adx : y_x_ent, sizeof(y_x_ent_unlinked));
+}
+
+void y86_unlink_ent(Y_data *y, Y_word pc) {
+    memcpy(
+        &(y->x_ent[pc][0]), y86_adx ? y_x_ent_adx_unlinked : y_x_ent_unlinked,
+        sizeof(y_x_ent_unlinked)
+    );
+}
+
+Y_word y86_prof_next(Y_data *y, Y_word pc, Y_word begin) {
+    Y_word index = 0;
+
+    // The next inst in the block, falling through without goto (see y86_load_block)
+    // The length is taken from x_code, the memory may be written already (see y86_unload)
+    while ((y->x_code[pc + index] & Y_X_CODE_INST) >> index & 1) {
+        ++index;
+    }
+    pc += index;
+
+    return pc < y->y_inst_size && (y->x_code[pc] & 1) && y->x_blk[pc] == begin ? pc : -1;
+}
+
+void y86_prof_flush(Y_data *y) {
+    Y_word begin;
+    Y_word pc;
+    unsigned long long run;
+
+    // Entries counted in the code, to the insts until the end of the block
+    // Entries of insts not loaded are kept, they are counted when loaded
+    for (begin = 0; begin < y->y_inst_size; ++begin) {
+        if ((y->x_code[begin] & 1) && y->x_blk[begin] == begin) {
+            run = 0;
+            for (pc = begin; pc >= 0; pc = y86_prof_next(y, pc, begin)) {
+                run += y->p_cnt[pc];
+                y->p_cnt[pc] = 0;
+                y->p_inst[pc] += run;
+            }
+        }
+    }
+}
+
+void y86_x_changed(Y_data *y) {
+    // Blocks are changed, count with the old ones
+    if (y->p_mode) {
+        y86_prof_flush(y);
+    }
+
+    // New version, never the same as a snapshot of other code
+    y->x_gen = ++(y->x_gen_max);
+}
+
+void y86_load_reset(Y_data *y) {
+    Y_word index;
+
+    y86_x_changed(y);
+
+    // Also the halts beyond the code area, not in x_map (see y86_load)
+    memset(&(y->x_rev[0]), 0, (y->x_end - &(y->x_inst[0]) + 1) * sizeof(Y_word));
+    for (index = 0; index < y->y_inst_size; ++index) {
+        y->x_map[index] = 0;
+
+        memcpy(&(y->x_ent[index][0]), y86_adx ? y_x_ent_adx : y_x_ent, sizeof(y_x_ent));
+        IO_WORD(&(y->x_ent[index][YX_ENT(PC)])) = index;
+        y86_unlink_ent(y, index);
+    }
+    for (index = 0; index < y->x_code_size + (Y_word) sizeof(Y_word); ++index) {
+        y->x_code[index] &= Y_X_CODE_DEC;
+    }
+    y->x_end = &(y->x_inst[0]);
+}
+
+void y86_unload(Y_data *y, Y_word pc) {
+    Y_word index;
+
+    y86_x_changed(y);
+
+    if (!y86_fused(y, pc)) {
+        y86_link_x_rev(y, pc, 0);
+        y->x_map[pc] = 0;
+        y86_unlink_ent(y, pc);
+    }
+
+    for (index = 0; (y->x_code[pc + index] & Y_X_CODE_INST) >> index & 1; ++index) {
+        y->x_code[pc + index] &= ~(1 << index);
+    }
+}
+
+void y86_unload_block(Y_data *y, Y_word pc) {
+    Y_word begin = y->x_blk[pc];
+    Y_word index;
+
+    // The block is entered from x_ent only, nothing falls into it
+    for (index = begin; index < y->y_inst_size; ++index) {
+        if (
+            (y86_fused(y, index) || (y->x_map[index] && y->x_map[index] != Y_BAD_ADDR))
+            && y->x_blk[index] == begin
+        ) {
+            y86_unload(y, index);
+        }
+    }
+}
+
+void y86_unload_mem(Y_data *y, Y_word addr) {
+    Y_word index;
+    Y_word offset;
+
+    // Blocks overlapping the written word, loaded again when executed
+    for (index = addr; index < addr + (Y_word) sizeof(Y_word); ++index) {
+        for (offset = 0; (y->x_code[index] & Y_X_CODE_INST) >> offset; ++offset) {
+            if (y->x_code[index] >> offset & 1) {
+                y86_unload_block(y, index - offset);
+            }
+        }
+    }
+
+    y86_unload_decode(y, addr);
+}
+
+Y_char *y86_load_end(Y_data *y, Y_char *inst) {
+    // Code area should cover all compiled instructions
+    if (y->reg[yr_len] < inst - &(y->mem[0])) {
+        y->reg[yr_len] = inst - &(y->mem[0]);
+    }
+
+    // Not beyond the code area: only a halt runs there (see y86_tail_stat)
+    while (y->reg[yr_len] < y->y_inst_size && y->mem[y->reg[yr_len]]) {
+        y->reg[yr_len]++;
+    }
+
+    return &(y->mem[y->reg[yr_len]]);
+}
+
+Y_stat y86_tail_stat(Y_data *y, Y_word pc) {
+    // Stopped at the halt beyond the code area (see y86_load), nothing else is decoded there
+    return (unsigned) pc < (unsigned) y->mem_size && !y->mem[pc] ? ys_hlt : ys_adp;
+}
+
+void y86_load_code(Y_data *y, Y_word pc, Y_word size) {
+    Y_word index;
+
+    for (index = 0; index < size; ++index) {
+        y->x_code[pc + index] |= 1 << index;
+    }
+}
+
+void y86_load_block(Y_data *y, Y_word *block, Y_word *count) {
+    Y_word index;
+
+    // Steps are counted when entering the block (see y86_goto)
+    for (index = 0; index < *count; ++index) {
+        if (block[index] < y->y_inst_size) {
+            y->x_cnt[block[index]] = *count - index;
+            y->x_blk[block[index]] = block[0];
+        }
+    }
+
+    *count = 0;
+}
+
+void y86_load(Y_data *y, Y_char *begin) {
+    Y_char *inst = begin;
+    Y_char *end;
+
+    Y_word pc = y->reg[yr_pc];
+    Y_word index;
+    Y_word size;
+
+    Y_word *block = y->x_seq;
+    Y_word count = 0;
+
+    y86_x_changed(y);
+
+    while (inst) {
+        end = 0;
+
+        do {
+            y->reg[yr_pc] = inst - &(y->mem[0]);
+
+            if (y86_fused(y, y->reg[yr_pc])) {
+                // Entered, compile the block again without fusing
+                y86_unload_block(y, y->reg[yr_pc]);
+            }
+
+            if (y->x_map[y->reg[yr_pc]] && y->x_map[y->reg[yr_pc]] != Y_BAD_ADDR) {
+                // Already compiled
+                y86_load_block(y, block, &count);
+                y86_gen_goto(y, y->reg[yr_pc]);
+                break;
+            } else {
+                y86_link_x_map(y, y->reg[yr_pc]);
+                block[count++] = y->reg[yr_pc];
+
+                size = y86_fuse(y, y->reg[yr_pc]);
+                if (size) {
+                    // All insts counted
+                    y86_load_code(y, y->reg[yr_pc], y->d_len[y->reg[yr_pc]]);
+                    for (
+                        index = y->reg[yr_pc] + y->d_len[y->reg[yr_pc]];
+                        index < y->reg[yr_pc] + size; index += y->d_len[index]
+                    ) {
+                        block[count++] = index;
+                        y86_load_code(y, index, y->d_len[index]);
+                    }
+                    inst += size;
+                } else {
+                    if (y86_parse(y, &inst, &(y->mem[y->mem_size]))) {
+                        y86_load_block(y, block, &count);
+                    }
+                    y86_load_code(y, y->reg[yr_pc], inst - &(y->mem[y->reg[yr_pc]]));
+                }
+            }
+
+            end = y86_load_end(y, inst);
+        } while (inst != end);
+
+        if (inst == end) {
+            // Memory after the code is zero (halt)
+            index = end - &(y->mem[0]);
+            if (index < y->y_inst_size && y->x_map[index] && y->x_map[index] != Y_BAD_ADDR) {
+                y86_load_block(y, block, &count);
+                y86_gen_goto(y, index);
+            } else {
+                if (index < y->y_inst_size) {
+                    y86_link_x_map(y, index);
+                    y86_load_code(y, index, 1);
+                } else {
+                    // Never entered, the PC is only traced (the last inst of the block)
+                    y->x_rev[y->x_end - &(y->x_inst[0])] = index + 1;
+                }
+                if (index < y->y_inst_size || !y->reg[yr_sm]) {
+                    block[count++] = index;
+                } else {
+                    // Count per instruction, not with the block (see y86_continue)
+                    y86_load_block(y, block, &count);
+                }
+
+                y86_gen_protect(y);
+                y86_load_block(y, block, &count);
+            }
+        }
+
+        // Targets out of the code area are also loaded
+        inst = 0;
+        for (index = 0; index < y->y_inst_size; ++index) {
+            if (y->x_map[index] == Y_BAD_ADDR) {
+                inst = &(y->mem[index]);
+                break;
+            }
+        }
+    };
+
+    // All blocks are finished, jump directly
+    for (index = 0; index < y->y_inst_size; ++index) {
+        if (y->x_map[index]) {
+            y86_link_ent(y, index);
+        }
+    }
+
+    y->reg[yr_pc] = pc;
+}
+
+void y86_load_all(Y_data *y) {
+    y86_load_reset(y);
+    y86_load(y, &(y->mem[0]));
+}
+
+void y86_load_file_bin(Y_data *y, FILE *binfile) {
+    clearerr(binfile);
+
+    y->reg[yr_len] = fread(&(y->mem[0]), sizeof(Y_char), y->y_inst_size, binfile);
+    if (ferror(binfile)) {
+        fprintf(stderr, "fread() failed (0x%x)\n", y->reg[yr_len]);
+        longjmp(y->jmp, ys_clf);
+    }
+    if (!feof(binfile)) {
+        fprintf(stderr, "Too large memory footprint (0x%x)\n", y->reg[yr_len]);
+        longjmp(y->jmp, ys_clf);
+    }
+}
+
+void y86_load_file(Y_data *y, Y_char *fname) {
+    FILE *binfile = fopen(fname, "rb");
+
+    if (binfile) {
+        y86_load_file_bin(y, binfile);
+        fclose(binfile);
+    } else {
+        fprintf(stderr, "Can't open binary file '%s'\n", fname);
+        longjmp(y->jmp, ys_clf);
+    }
+}
+
+void y86_ready(Y_data *y, Y_word step) {
+    // mem after the loaded code is zero (see y86_reset)
+    memcpy(&(y->bak_mem[0]), &(y->mem[0]), y->reg[yr_len]);
+    memcpy(&(y->bak_reg[0]), &(y->reg[0]), sizeof(y->bak_reg));
+
+    y->reg[yr_cc] = 0x40;
+    y->reg[yr_sx] = step;
+    y->reg[yr_sc] = step;
+    y->reg[yr_st] = ys_aok;
+    y->reg[yr_sm] = 0;
+}
+
+void y86_trace_ip(Y_data *y) {
+    // Execution starts from y86_goto (PC)
+    if (!y->x_map[y->reg[yr_pc]]) {
+        y86_load(y, &(y->mem[y->reg[yr_pc]]));
+    }
+}
+
+#define Y_X_REG(index) "%c[reg]+" #index "*4(%%r15)"
+
+extern const Y_char y86_check[];
+extern const Y_char y86_check_adx[];
+extern const Y_char y86_prof_tsc[];
+extern const Y_char y86_rec_store[];
+
+void y86_rec_drain(Y_data *y);
+
+void __attribute__ ((noinline)) y86_exec(Y_data *y) {
+    __asm__ __volatile__(
+        "movq %[check], %%r11" "\n\t"
+
+        // Skip the red zone
+        "leaq -128(%%rsp), %%rsp" "\n\t"
+
+        "pushq %%rbx" "\n\t"
+        "pushq %%rbp" "\n\t"
+        "pushq %%r12" "\n\t"
+        "pushq %%r13" "\n\t"
+        "pushq %%r14" "\n\t"
+        "pushq %%r15" "\n\t"
+
+        "movq %c[mem](%[y]), %%r15" "\n\t"
+
+        // Load data
+        "movl " Y_X_REG(0x0) ", %%edi" "\n\t"
+        "movl " Y_X_REG(0x1) ", %%esi" "\n\t"
+        "movl " Y_X_REG(0x2) ", %%ebp" "\n\t"
+        "movl " Y_X_REG(0x3) ", %%r8d" "\n\t"
+        "movl " Y_X_REG(0x4) ", %%ebx" "\n\t"
+        "movl " Y_X_REG(0x5) ", %%edx" "\n\t"
+        "movl " Y_X_REG(0x6) ", %%ecx" "\n\t"
+        "movl " Y_X_REG(0x7) ", %%eax" "\n\t"
+        "movl " Y_X_REG(0xE) ", %%r14d" "\n\t"
+        "movl " Y_X_REG(0xF) ", %%r13d" "\n\t"
+        "movl " Y_X_REG(0x10) ", %%r12d" "\n\t"
+        "leaq y86_goto(%%rip), %%r10" "\n\t"
+
+        "movl " Y_X_REG(0x8) ", %%r9d" "\n\t"
+        "pushq %%r9" "\n\t"
+        "popfq" "\n\t"
+
+        "movl " Y_X_REG(0xB) ", %%r9d" "\n\t"
+
+    // Entering a block
+    "y86_goto:" "\n\t"
+
+        "pushfq" "\n\t"
+
+        // Check if loaded
+        "movq %c[x_map](%%r15), %%r10" "\n\t"
+        "cmpq $0, (%%r10, %%r9, 8)" "\n\t"
+        "je y86_int_lod" "\n\t"
+
+        // Count steps of the block
+        "movq %c[x_cnt](%%r15), %%r10" "\n\t"
+        "subl (%%r10, %%r9, 4), %%r14d" "\n\t"
+        "js y86_int_stp" "\n\t"
+
+        "movq %c[x_map](%%r15), %%r10" "\n\t"
+        "movq (%%r10, %%r9, 8), %%r9" "\n\t"
+        "leaq y86_goto(%%rip), %%r10" "\n\t"
+
+        "popfq" "\n\t"
+
+        "jmp *%%r9" "\n\t"
+
+    // Checking inside the block
+    "y86_check:" "\n\t"
+
+        "pushfq" "\n\t"
+
+        // Check state
+        "testl %%r13d, %%r13d" "\n\t"
+        "jnz y86_int" "\n\t"
+
+    // Call the function
+    "y86_call:" "\n\t"
+
+        "popfq" "\n\t"
+
+        "ret" "\n\t"
+
+    // Checking inside the block, without touching CC (see y86_adx)
+    "y86_check_adx:" "\n\t"
+
+        // Jump by stat
+        "movslq (y86_check_adx_tab - y86_check_adx)(%%r11, %%r13, 4), %%r9" "\n\t"
+        "leaq (%%r11, %%r9), %%r9" "\n\t"
+        "jmp *%%r9" "\n\t"
+
+        "y86_check_adx_tab:" "\n\t"
+
+            ".long y86_check_adx_aok - y86_check_adx" "\n\t"
+            ".rept 8" "\n\t"
+            ".long y86_check_adx_int - y86_check_adx" "\n\t"
+            ".endr" "\n\t"
+            ".long y86_check_adx_imc - y86_check_adx" "\n\t"
+            ".rept 2" "\n\t"
+            ".long y86_check_adx_int - y86_check_adx" "\n\t"
+            ".endr" "\n\t"
+
+        "y86_check_adx_aok:" "\n\t"
+
+            "ret" "\n\t"
+
+        "y86_check_adx_int:" "\n\t"
+
+            "pushfq" "\n\t"
+            "jmp y86_int" "\n\t"
+
+        "y86_check_adx_imc:" "\n\t"
+
+            // Mark the written chunk (see y86_reset)
+            "movl $%c[dirty_shift], %%r13d" "\n\t"
+            "shrxl %%r13d, %%r12d, %%r9d" "\n\t"
+            "movb $1, %c[mem_dirty](%%r15, %%r9)" "\n\t"
+
+            // If r12 >= x_code_size (a carry), no inst is changed
+            "movl %c[x_code_size](%%r15), %%r9d" "\n\t"
+            "notl %%r9d" "\n\t"
+            "stc" "\n\t"
+            "adcxl %%r12d, %%r9d" "\n\t"
+            "jc y86_check_adx_imc_ok" "\n\t"
+
+            // If loaded insts are changed (a carry), handle by outer
+            "movq %c[x_code](%%r15), %%r9" "\n\t"
+            "movl $-1, %%r13d" "\n\t"
+            "clc" "\n\t"
+            "adcxl (%%r9, %%r12), %%r13d" "\n\t"
+            "jc y86_check_adx_imc_fin" "\n\t"
+
+        "y86_check_adx_imc_ok:" "\n\t"
+
+            "movl $0, %%r13d" "\n\t"
+            "ret" "\n\t"
+
+        "y86_check_adx_imc_fin:" "\n\t"
+
+            "movl $9, %%r13d" "\n\t"
+            "pushfq" "\n\t"
+            "jmp y86_fin" "\n\t"
+
+    // Profiling: cycles to the last block, r9d is the next one (see y86_gen_prof)
+    "y86_prof_tsc:" "\n\t"
+
+        "pushfq" "\n\t"
+        "pushq %%rax" "\n\t"
+        "pushq %%rdx" "\n\t"
+
+        "rdtsc" "\n\t"
+        "shlq $32, %%rdx" "\n\t"
+        "orq %%rdx, %%rax" "\n\t"
+        "movq %%rax, %%rdx" "\n\t"
+        "subq %c[p_last](%%r15), %%rdx" "\n\t"
+        "movq %%rax, %c[p_last](%%r15)" "\n\t"
+
+        "movl %c[p_cur](%%r15), %%eax" "\n\t"
+        "movl %%r9d, %c[p_cur](%%r15)" "\n\t"
+        "movq %c[p_tsc](%%r15), %%r9" "\n\t"
+        "addq %%rdx, (%%r9, %%rax, 8)" "\n\t"
+
+        "popq %%rdx" "\n\t"
+        "popq %%rax" "\n\t"
+        "popfq" "\n\t"
+
+        "ret" "\n\t"
+
+    // Tracing: a raw record of the inst, r9d is its PC, with Y_REC_WRITE if it wrote mem (see y86_gen_rec)
+    "y86_rec_store:" "\n\t"
+
+        "pushfq" "\n\t"
+        "pushq %%r10" "\n\t"
+
+        "movq %c[r_pos](%%r15), %%r10" "\n\t"
+        "movl %%r9d, 0x0(%%r10)" "\n\t"
+        "andl $~%c[r_write], 0x0(%%r10)" "\n\t"
+        "andl $%c[r_write], %%r9d" "\n\t"
+        "orl 8(%%rsp), %%r9d" "\n\t"
+        "movl %%r9d, 0x4(%%r10)" "\n\t"
+        "movl %%edi, 0x8(%%r10)" "\n\t"
+        "movl %%esi, 0xC(%%r10)" "\n\t"
+        "movl %%ebp, 0x10(%%r10)" "\n\t"
+        "movl %%r8d, 0x14(%%r10)" "\n\t"
+        "movl %%ebx, 0x18(%%r10)" "\n\t"
+        "movl %%edx, 0x1C(%%r10)" "\n\t"
+        "movl %%ecx, 0x20(%%r10)" "\n\t"
+        "movl %%eax, 0x24(%%r10)" "\n\t"
+
+        // Written word, r12 is checked already
+        "testl $%c[r_write], 0x4(%%r10)" "\n\t"
+        "jz y86_rec_store_next" "\n\t"
+
+        "movl %%r12d, 0x28(%%r10)" "\n\t"
+        "movl (%%r15, %%r12), %%r9d" "\n\t"
+        "movl %%r9d, 0x2C(%%r10)" "\n\t"
+
+        "y86_rec_store_next:" "\n\t"
+
+            "leaq %c[r_size](%%r10), %%r10" "\n\t"
+            "movq %%r10, %c[r_pos](%%r15)" "\n\t"
+            "cmpq %c[r_end](%%r15), %%r10" "\n\t"
+            "jb y86_rec_store_ok" "\n\t"
+
+            // Full, encode and write in C (callee-saved registers are kept)
+            "pushq %%rax" "\n\t"
+            "pushq %%rcx" "\n\t"
+            "pushq %%rdx" "\n\t"
+            "pushq %%rsi" "\n\t"
+            "pushq %%rdi" "\n\t"
+            "pushq %%r8" "\n\t"
+            "pushq %%r11" "\n\t"
+            "pushq %%rbx" "\n\t"
+
+            "movq %%rsp, %%rbx" "\n\t"
+            "andq $-16, %%rsp" "\n\t"
+            "leaq -%c[data_size](%%r15), %%rdi" "\n\t"
+            "call y86_rec_drain" "\n\t"
+            "movq %%rbx, %%rsp" "\n\t"
+
+            "popq %%rbx" "\n\t"
+            "popq %%r11" "\n\t"
+            "popq %%r8" "\n\t"
+            "popq %%rdi" "\n\t"
+            "popq %%rsi" "\n\t"
+            "popq %%rdx" "\n\t"
+            "popq %%rcx" "\n\t"
+            "popq %%rax" "\n\t"
+
+        "y86_rec_store_ok:" "\n\t"
+
+            "popq %%r10" "\n\t"
+            "popfq" "\n\t"
+
+            "ret" "\n\t"
+
+    // Handling interrupt etc.
+    "y86_int:" "\n\t"
+
+        // If stat < 8, just finished
+        "cmpl $8, %%r13d" "\n\t"
+        "jb y86_int_brk" "\n\t"
+
+        // If stat == 8 (ys_ima), do mem adr checking
+        "je y86_int_ima" "\n\t"
+
+        // If stat == 9 (ys_imc), do inst adr checking
+        "cmpl $9, %%r13d" "\n\t"
+        "je y86_int_imc" "\n\t"
+
+        // If stat == 10 (ys_ret), handle by outer
+        "jmp y86_fin" "\n\t"
+
+        "y86_int_ima:" "\n\t"
+
+            // If r12 < mem_size, safe (mem is padded), else adr error
+            "cmpl %c[mem_size](%%r15), %%r12d" "\n\t"
+            "jae y86_int_brk" "\n\t"
+
+            "xorl %%r13d, %%r13d" "\n\t"
+            "jmp y86_call" "\n\t"
+
+        "y86_int_imc:" "\n\t"
+
+            // Mark the written chunk (see y86_reset)
+            "movl %%r12d, %%r9d" "\n\t"
+            "shrl $%c[dirty_shift], %%r9d" "\n\t"
+            "movb $1, %c[mem_dirty](%%r15, %%r9)" "\n\t"
+
+            // If loaded insts are changed, handle by outer
+            "cmpl %c[x_code_size](%%r15), %%r12d" "\n\t"
+            "jae y86_int_imc_ok" "\n\t"
+
+            "movq %c[x_code](%%r15), %%r9" "\n\t"
+            "cmpl $0, (%%r9, %%r12)" "\n\t"
+            "jne y86_fin" "\n\t"
+
+        "y86_int_imc_ok:" "\n\t"
+
+            "xorl %%r13d, %%r13d" "\n\t"
+            "jmp y86_call" "\n\t"
+
+        "y86_int_stp:" "\n\t"
+
+            // Steps are not enough, handle by outer
+            "addl (%%r10, %%r9, 4), %%r14d" "\n\t"
+
+        "y86_int_lod:" "\n\t"
+
+            // Not loaded, handle by outer
+            "movl %%r9d, " Y_X_REG(0xB) "\n\t"
+            "movl $11, %%r13d" "\n\t"
+
+            // No return address
+            "pushq (%%rsp)" "\n\t"
+            "jmp y86_fin" "\n\t"
+
+        "y86_int_brk:" "\n\t"
+
+            "subl $1, %%r14d" "\n\t"
+
+    // Finished
+    "y86_fin:" "\n\t"
+
+        // Restore data
+        "movl %%edi, " Y_X_REG(0x0) "\n\t"
+        "movl %%esi, " Y_X_REG(0x1) "\n\t"
+        "movl %%ebp, " Y_X_REG(0x2) "\n\t"
+        "movl %%r8d, " Y_X_REG(0x3) "\n\t"
+        "movl %%ebx, " Y_X_REG(0x4) "\n\t"
+        "movl %%edx, " Y_X_REG(0x5) "\n\t"
+        "movl %%ecx, " Y_X_REG(0x6) "\n\t"
+        "movl %%eax, " Y_X_REG(0x7) "\n\t"
+        "movl %%r14d, " Y_X_REG(0xE) "\n\t"
+        "movl %%r13d, " Y_X_REG(0xF) "\n\t"
+        "movl %%r12d, " Y_X_REG(0x10) "\n\t"
+
+        "popq %%r9" "\n\t"
+        "movl %%r9d, " Y_X_REG(0x8) "\n\t"
+
+        "popq %%r9" "\n\t"
+        "subq %c[x_inst](%%r15), %%r9" "\n\t"
+        "movl %%r9d, " Y_X_REG(0x9) "\n\t"
+
+        "popq %%r15" "\n\t"
+        "popq %%r14" "\n\t"
+        "popq %%r13" "\n\t"
+        "popq %%r12" "\n\t"
+        "popq %%rbp" "\n\t"
+        "popq %%rbx" "\n\t"
+
+        "leaq 128(%%rsp), %%rsp"// "\n\t"
+        :
+        : [y] "r" (y),
+          [check] "r" (y86_adx ? y86_check_adx : y86_check),
+          [mem] "i" (offsetof(Y_data, mem)),
+          [reg] "i" (offsetof(Y_data, reg) - Y_DATA_SIZE),
+          [mem_size] "i" (offsetof(Y_data, mem_size) - Y_DATA_SIZE),
+          [x_code_size] "i" (offsetof(Y_data, x_code_size) - Y_DATA_SIZE),
+          [x_inst] "i" (offsetof(Y_data, x_inst) - Y_DATA_SIZE),
+          [x_map] "i" (offsetof(Y_data, x_map) - Y_DATA_SIZE),
+          [x_cnt] "i" (offsetof(Y_data, x_cnt) - Y_DATA_SIZE),
+          [x_code] "i" (offsetof(Y_data, x_code) - Y_DATA_SIZE),
+          [mem_dirty] "i" (offsetof(Y_data, mem_dirty) - Y_DATA_SIZE),
+          [p_cur] "i" (offsetof(Y_data, p_cur) - Y_DATA_SIZE),
+          [p_last] "i" (offsetof(Y_data, p_last) - Y_DATA_SIZE),
+          [p_tsc] "i" (offsetof(Y_data, p_tsc) - Y_DATA_SIZE),
+          [r_pos] "i" (offsetof(Y_data, r_pos) - Y_DATA_SIZE),
+          [r_end] "i" (offsetof(Y_data, r_end) - Y_DATA_SIZE),
+          [r_size] "i" (Y_REC_SIZE * sizeof(Y_word)),
+          [r_write] "i" (Y_REC_WRITE),
+          [data_size] "i" (Y_DATA_SIZE),
+          [dirty_shift] "i" (Y_DIRTY_SHIFT)
+        : "rax", "rcx", "rdx", "rsi", "rdi", "r8", "r9", "r10", "r11", "cc", "memory"
+    );
+}
+
+__thread Y_data *y86_guard_data; // Executing, for the signal handlers
+
+extern const Y_char y86_int_brk[];
+
+void y86_guard_segv(int sig, siginfo_t *info, void *context) {
+    Y_data *y = y86_guard_data;
+    greg_t *gregs = ((ucontext_t *) context)->uc_mcontext.gregs;
+    Y_char *rip = (Y_char *) gregs[REG_RIP];
+    Y_char *addr = info->si_addr;
+
+    if (
+        !y || !y->guard || rip < &(y->x_inst[0]) || rip >= y->x_end
+        || addr < &(y->mem[0]) || addr >= &(y->mem[0]) + Y_GUARD_SIZE
+    ) {
+        // Not from the guest, fault again
+        signal(sig, SIG_DFL);
+        return;
+    }
+
+    if ((unsigned) gregs[REG_R12] < (unsigned) y->mem_size) {
+        // Crossing the end of mem, open the page (as padding) for one instruction
+        y->guard_page = (Y_addr) ((size_t) addr & ~(size_t) (Y_PAGE_SIZE - 1));
+        mprotect(y->guard_page, Y_PAGE_SIZE, PROT_READ | PROT_WRITE);
+        gregs[REG_EFL] |= 0x100; // TF
+        return;
+    }
+
+    // As the ys_ima check is failed (see y86_check), the faulting inst is the return address
+    gregs[REG_RSP] -= sizeof(greg_t);
+    *(greg_t *) gregs[REG_RSP] = gregs[REG_RIP];
+    gregs[REG_RSP] -= sizeof(greg_t);
+    *(greg_t *) gregs[REG_RSP] = gregs[REG_EFL];
+    gregs[REG_R13] = ys_ima;
+    gregs[REG_RIP] = (greg_t) y86_int_brk;
+}
+
+void y86_guard_trap(int sig, siginfo_t *info, void *context) {
+    Y_data *y = y86_guard_data;
+    greg_t *gregs = ((ucontext_t *) context)->uc_mcontext.gregs;
+
+    (void) info;
+
+    if (!y || !y->guard_page) {
+        signal(sig, SIG_DFL);
+        raise(sig);
+        return;
+    }
+
+    // After the access crossing the end of mem
+    mprotect(y->guard_page, Y_PAGE_SIZE, PROT_NONE);
+    y->guard_page = 0;
+    gregs[REG_EFL] &= ~0x100; // TF
+}
+
+void y86_guard_init(void) {
+    struct sigaction action;
+
+    memset(&action, 0, sizeof(action));
+    action.sa_flags = SA_SIGINFO;
+
+    action.sa_sigaction = y86_guard_segv;
+    sigaction(SIGSEGV, &action, 0);
+    action.sa_sigaction = y86_guard_trap;
+    sigaction(SIGTRAP, &action, 0);
+}
+
+void y86_trace_pc(Y_data *y) {
+    Y_word index = y->reg[yr_rey];
+    Y_word pc;
+    Y_addr rey = &(y->x_inst[index]);
+
+    // Steps after the inst in the block are already counted, give back
+
+    // After step
+    if (y->x_rev[index]) {
+        pc = y->x_rev[index] - 1;
+
+        y->reg[yr_pc] = pc;
+        y->reg[yr_sc] += pc < y->y_inst_size ? y->x_cnt[pc] : !y->reg[yr_sm];
+        return;
+    }
+
+    // Before goto, the block is finished (see y86_gen_goto)
+    if (
+        y->p_mode && (rey[0] & 0xFF) == (y->p_mode > 1 ? 0x41 : 0x4C)
+        && (rey[1] & 0xFF) == (y->p_mode > 1 ? 0xB9 : 0x8B)
+    ) {
+        rey += y86_gen_prof_size(y);
+    }
+    if ((rey[0] & 0xFF) == 0xE9) {
+        rey += 5 + IO_WORD(&rey[1]);
+        y->reg[yr_pc] = IO_WORD(&rey[YX_ENT(PC)]);
+        return;
+    }
+
+    // After interrupt (the last one if insts have no code)
+    while (index > 0 && !y->x_rev[index]) {
+        --index;
+    }
+
+    pc = y->x_rev[index] - 1;
+    while (pc + 1 < y->y_inst_size && y->x_map[pc + 1] == y->x_map[pc]) {
+        ++pc;
+    }
+
+    y->reg[yr_pc] = pc;
+    y->reg[yr_sc] += pc < y->y_inst_size ? y->x_cnt[pc] - 1 : 0;
+}
+
+Y_word y86_get_im_ptr(Y_data *y) {
+    return y->reg[yr_im];
+}
+
+void y86_prof_enter(Y_data *y, Y_word value) {
+    // Entered at PC from outside the code (start, ret), or given back (stopped before the block)
+    if (y->p_mode && (unsigned) y->reg[yr_pc] < (unsigned) y->y_inst_size) {
+        y->p_cnt[y->reg[yr_pc]] += value;
+        if (value > 0) {
+            y->p_cur = y->reg[yr_pc];
+        }
+    }
+}
+
+void y86_prof_time(Y_data *y, Y_word stop) {
+    // Cycles in y86_exec only (see y86_prof_tsc)
+    if (y->p_mode > 1) {
+        if (stop) {
+            y->p_tsc[y->p_cur] += __rdtsc() - y->p_last;
+        } else {
+            y->p_last = __rdtsc();
+        }
+    }
+}
+
+void y86_prof_stop(Y_data *y) {
+    Y_word pc = y->reg[yr_pc] - 1;
+    Y_word begin;
+
+    if (!y->p_mode) {
+        return;
+    }
+    y86_prof_flush(y);
+
+    // Failed at an access in the block, the insts after it are not executed
+    if (y->reg[yr_st] == ys_adr && (unsigned) pc < (unsigned) y->y_inst_size && (y->x_code[pc] & 1)) {
+        begin = y->x_blk[pc];
+        for (pc = y86_prof_next(y, pc, begin); pc >= 0; pc = y86_prof_next(y, pc, begin)) {
+            y->p_inst[pc] -= 1;
+        }
+    }
+}
+
+// Trace file: Y_rec_head, then chunks of records (Y_word count, Y_word bytes, data)
+// A chunk of count 0 is a raw record (the state at the start of a run), others are encoded:
+// Byte: 0x80 written mem, 0x40 CC, 0x20 regs, 0x1F PC delta (zigzag, 0x1F: varint follows)
+// Then regs: byte of changed regs (Y_reg_lyt), each a varint (zigzag delta)
+// Then CC: byte of host flags >> 6, then written mem: address (varint, zigzag delta), value (varint)
+
+#define Y_REC_MAGIC 0x52543859 // "Y8TR"
+#define Y_REC_MAX 64 // Encoded bytes of a record at most
+
+typedef struct {
+    Y_word magic;
+    Y_word mem_size;
+    Y_word y_inst_size;
+} Y_rec_head;
+
+Y_char *y86_rec_varint(Y_char *out, unsigned value) {
+    while (value >= 0x80) {
+        *(out++) = (value & 0x7F) | 0x80;
+        value >>= 7;
+    }
+    *(out++) = value;
+
+    return out;
+}
+
+unsigned y86_rec_zigzag(Y_word value) {
+    return (unsigned) value << 1 ^ (unsigned) (value >> 31);
+}
+
+void y86_rec_write(Y_data *y, Y_word count, void *data, Y_word len) {
+    Y_word head[2] = {count, len};
+    struct iovec iov[2] = {{head, sizeof(head)}, {data, len}};
+
+    // Chunk head and data in one call
+    if (y->r_fd >= 0 && writev(y->r_fd, iov, 2) != (ssize_t) (sizeof(head) + len)) {
+        fprintf(stderr, "Can't write trace file\n");
+        close(y->r_fd);
+        y->r_fd = -1;
+    }
+}
+
+void y86_rec_flush(Y_data *y) {
+    if (y->r_cnt) {
+        y86_rec_write(y, y->r_cnt, y->r_out, y->r_len);
+    }
+
+    y->r_len = 0;
+    y->r_cnt = 0;
+}
+
+void y86_rec_encode(Y_data *y, Y_word *rec) {
+    Y_char *head = &(y->r_out[y->r_len]);
+    Y_char *out = head + 1;
+    Y_word *last = y->r_last;
+    Y_word mask = 0;
+    Y_word index;
+    unsigned delta = y86_rec_zigzag(rec[0] - last[0]);
+
+    if (delta < 0x1F) {
+        *head = delta;
+    } else {
+        *head = 0x1F;
+        out = y86_rec_varint(out, delta);
+    }
+
+    for (index = 0; index < yr_cnt; ++index) {
+        if (rec[2 + index] != last[2 + index]) {
+            mask |= 1 << index;
+        }
+    }
+    if (mask) {
+        *head |= 0x20;
+        *(out++) = mask;
+        for (index = 0; index < yr_cnt; ++index) {
+            if (mask >> index & 1) {
+                out = y86_rec_varint(out, y86_rec_zigzag(rec[2 + index] - last[2 + index]));
+            }
+        }
+    }
+
+    // ZF, SF, OF
+    if ((rec[1] ^ last[1]) & 0x8C0) {
+        *head |= 0x40;
+        *(out++) = (rec[1] & 0x8C0) >> 6;
+    }
+
+    if (rec[1] & Y_REC_WRITE) {
+        *head |= 0x80;
+        out = y86_rec_varint(out, y86_rec_zigzag(rec[10] - last[10]));
+        out = y86_rec_varint(out, rec[11]);
+        last[10] = rec[10];
+    }
+
+    memcpy(last, rec, 10 * sizeof(Y_word));
+    y->r_len = out - y->r_out;
+    y->r_cnt += 1;
+}
+
+void y86_rec_drain(Y_data *y) {
+    Y_word *rec;
+
+    // Raw records are full (called by y86_rec_store), or execution is stopped
+    for (rec = y->r_buf; rec < y->r_pos; rec += Y_REC_SIZE) {
+        if (y->r_len > Y_REC_OUT - Y_REC_MAX) {
+            y86_rec_flush(y);
+        }
+        y86_rec_encode(y, rec);
+    }
+
+    y->r_pos = y->r_buf;
+}
+
+void y86_rec_add(Y_data *y, Y_word pc) {
+    // An inst executed in C (ret), or the inst stopped at
+    y->r_pos[0] = pc;
+    y->r_pos[1] = y->reg[yr_cc];
+    memcpy(&(y->r_pos[2]), &(y->reg[0]), yr_cnt * sizeof(Y_word));
+
+    y->r_pos += Y_REC_SIZE;
+    if (y->r_pos >= y->r_end) {
+        y86_rec_drain(y);
+    }
+}
+
+void y86_rec_start(Y_data *y) {
+    if (!y->r_buf) {
+        return;
+    }
+
+    // The state before the first inst, records of the run are deltas from it
+    y86_rec_drain(y);
+    y86_rec_flush(y);
+
+    memset(y->r_last, 0, sizeof(y->r_last));
+    y->r_last[0] = y->reg[yr_pc];
+    y->r_last[1] = y->reg[yr_cc];
+    memcpy(&(y->r_last[2]), &(y->reg[0]), yr_cnt * sizeof(Y_word));
+    y86_rec_write(y, 0, y->r_last, sizeof(y->r_last));
+}
+
+void y86_rec_stop(Y_data *y) {
+    if (!y->r_buf) {
+        return;
+    }
+
+    // Stopped at an inst (halt or error), also counted as a step
+    if (y->reg[yr_st] != ys_aok) {
+        y86_rec_add(y, y->reg[yr_pc] - 1);
+    }
+    y86_rec_drain(y);
+}
+
+Y_word y86_rec_open(Y_data *y, Y_char *fname) {
+    Y_rec_head head = {Y_REC_MAGIC, y->mem_size, y->y_inst_size};
+
+    y->r_fd = open(fname, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if (y->r_fd < 0) {
+        fprintf(stderr, "Can't open trace file '%s'\n", fname);
+        return 1;
+    }
+
+    y->r_buf = malloc(Y_REC_RAW * Y_REC_SIZE * sizeof(Y_word));
+    y->r_out = malloc(Y_REC_OUT);
+    if (!y->r_buf || !y->r_out || write(y->r_fd, &head, sizeof(head)) != sizeof(head)) {
+        fprintf(stderr, "Can't write trace file '%s'\n", fname);
+        close(y->r_fd);
+        free(y->r_buf);
+        free(y->r_out);
+        y->r_buf = 0;
+        y->r_out = 0;
+        return 1;
+    }
+
+    // Before compiling, the code of insts is changed
+    y->r_pos = y->r_buf;
+    y->r_end = y->r_buf + Y_REC_RAW * Y_REC_SIZE;
+    y->r_func = y86_rec_store;
+
+    return 0;
+}
+
+void y86_rec_close(Y_data *y) {
+    if (!y->r_buf) {
+        return;
+    }
+
+    // Jumped out (longjmp) or finished
+    y86_rec_drain(y);
+    y86_rec_flush(y);
+
+    if (y->r_fd >= 0) {
+        close(y->r_fd);
+    }
+    free(y->r_buf);
+    free(y->r_out);
+    y->r_buf = 0;
+    y->r_out = 0;
+}
+
+void y86_continue(Y_data *y) {
+    Y_word goon = 0;
+    Y_word step;
+    Y_word pc;
+
+    y86_trace_ip(y);
+    do {
+        y86_guard_data = y;
+        y86_prof_time(y, 0);
+        y86_exec(y);
+        y86_prof_time(y, 1);
+        y86_guard_data = 0;
+
+        switch (y->reg[yr_st]) {
+            case ys_ima:
+                y86_trace_pc(y);
+
+                // Already failed
+                y->reg[yr_pc] += 1;
+                y->reg[yr_st] = ys_adr;
+
+                goon = 0;
+                break;
+
+            case ys_imc:
+                // In the block (not before goto), the rest is entered again if changed
+                if (y->x_rev[y->reg[yr_rey]]) {
+                    y86_trace_pc(y);
+                    y86_prof_enter(y, -1);
+                } else {
+                    y86_trace_pc(y);
+                }
+
+                if (y->x_end - &(y->x_inst[0]) > y->x_inst_size / 2) {
+                    // Too many unloaded blocks in x_inst
+                    y86_unload_decode(y, y86_get_im_ptr(y));
+                    y86_load_all(y);
+                } else {
+                    y86_unload_mem(y, y86_get_im_ptr(y));
+                }
+
+                if (y->reg[yr_pc] >= y->y_inst_size) {
+                    // Only the halt at the end is compiled beyond the code area (see y86_load)
+                    if (y->reg[yr_sc] <= 0) {
+                        // No steps left, as stopped before a block
+                        y->reg[yr_sc] -= 1;
+                        y->reg[yr_st] = ys_aok;
+                    } else {
+                        // Run and stopped as in the ret hack below
+                        y->reg[yr_sc] -= 2;
+                        y->reg[yr_st] = y86_tail_stat(y, y->reg[yr_pc]);
+                        y->reg[yr_pc] += 1;
+                    }
+
+                    goon = 0;
+                    break;
+                }
+
+                y->reg[yr_st] = ys_aok;
+
+                goon = 1;
+                y86_prof_enter(y, 1);
+                y86_trace_ip(y);
+                break;
+
+            case ys_stp:
+                if (!y->x_map[y->reg[yr_pc]]) {
+                    // Load when executed
+                    y->reg[yr_st] = ys_aok;
+
+                    goon = 1;
+                    y86_trace_ip(y);
+                    break;
+                }
+
+                if (y->reg[yr_sc] > 0 && !y->reg[yr_sm]) {
+                    // Count per instruction, entered again in the new blocks
+                    y86_prof_enter(y, -1);
+                    y->reg[yr_sm] = 1;
+                    y86_load_all(y);
+                    y86_prof_enter(y, 1);
+
+                    y->reg[yr_st] = ys_aok;
+
+                    goon = 1;
+                    y86_trace_ip(y);
+                    break;
+                }
+
+                // Stopped before the block
+                y86_prof_enter(y, -1);
+                y->reg[yr_sc] -= 1;
+                y->reg[yr_st] = ys_aok;
+
+                goon = 0;
+                break;
+
+            case ys_ret:
+                // y86_trace_pc(y);
+
+                if ((unsigned) y->reg[yrl_esp] >= (unsigned) y->mem_size) {
+                    y86_trace_pc(y);
+
+                    // Already failed
+                    y->reg[yr_pc] += 1;
+                    y->reg[yr_im] = y->reg[yrl_esp];
+                    y->reg[yr_sc] -= 1;
+
+                    y->reg[yr_st] = ys_adr;
+                    goon = 0;
+                    break;
+                }
+
+                // PC of the ret for the trace, steps are not given back
+                if (y->r_buf) {
+                    step = y->reg[yr_sc];
+                    y86_trace_pc(y);
+                    y->reg[yr_sc] = step;
+                }
+
+                // Do return
+                pc = y->reg[yr_pc];
+                y->reg[yr_pc] = IO_WORD(&(y->mem[y->reg[yrl_esp]]));
+                y->reg[yrl_esp] += 4;
+
+                if (y->r_buf) {
+                    y86_rec_add(y, pc);
+                }
+
+                if (y->reg[yr_pc] < 0 || y->reg[yr_pc] >= y->y_inst_size) { // TODO: change this hack
+                    y->reg[yr_sc] -= 2;
+                    y->reg[yr_pc] += 1;
+
+                    y->reg[yr_st] = ys_hlt;
+                    goon = 0;
+                    break;
+                }
+
+                y->reg[yr_st] = ys_aok;
+
+                goon = 1;
+                y86_prof_enter(y, 1);
+                y86_trace_ip(y);
+                break;
+
+            default:
+                y86_trace_pc(y);
+
+                if (y->reg[yr_pc] >= y->y_inst_size && y->reg[yr_sm]) {
+                    // The halt beyond the code area, not counted yet (see y86_load)
+                    if (y->reg[yr_sc] < 0) {
+                        y->reg[yr_st] = ys_aok;
+                    } else {
+                        y->reg[yr_sc] -= 1;
+                    }
+                }
+
+                if (y->reg[yr_pc] >= y->y_inst_size && y->reg[yr_st] == ys_hlt) {
+                    y->reg[yr_st] = y86_tail_stat(y, y->reg[yr_pc]);
+                }
+
+                // Stopped at the instruction
+                if (y->reg[yr_st] != ys_aok) {
+                    y->reg[yr_pc] += 1;
+                }
+
+                goon = 0;
+                break;
+        }
+    } while (goon);
+}
+
+void y86_go(Y_data *y, Y_word step) {
+    y86_ready(y, step);
+    y86_prof_enter(y, 1);
+    y86_rec_start(y);
+    y86_continue(y);
+    y86_prof_stop(y);
+    y86_rec_stop(y);
+}
+
+void y86_output_error(Y_data *y) {
+    switch (y->reg[yr_st]) {
+        case ys_adr:
+            if (y->mem[y->reg[yr_pc] - 1] >= 0 /*< yi_call*/) { // Evil hack !? TODO
+                fprintf(y->out, "PC = 0x%x, Invalid data address 0x%x\n", y->reg[yr_pc] - 1, y86_get_im_ptr(y));
+            } else {
+                fprintf(y->out, "PC = 0x%x, Invalid stack address 0x%x\n", y->reg[yr_pc] - 1, y86_get_im_ptr(y));
+            }
+            break;
+        case ys_ins:
+            fprintf(y->out, "PC = 0x%x, Invalid instruction %.2x\n", y->reg[yr_pc] - 1, y->mem[y->reg[yr_pc] - 1]);
+            break;
+        case ys_clf:
+            fprintf(y->out, "PC = 0x%x, File loading failed\n", /*y->reg[yr_pc] - 1*/ 0);
+            break;
+        case ys_ccf:
+            fprintf(y->out, "PC = 0x%x, Parsing or compiling failed\n", y->reg[yr_pc] - 1);
+            break;
+        case ys_adp:
+            fprintf(y->out, "PC = 0x%x, Invalid instruction address\n", y->reg[yr_pc] - 1);
+            break;
+        case ys_inp:
+            fprintf(y->out, "PC = 0x%x, Invalid instruction address\n", y->reg[yr_pc] - 1);
+            break;
+        default:
+            break;
+    }
+}
+
+Y_word y86_cc_transform(Y_word cc_x) {
+    return ((cc_x >> 11) & 1) | ((cc_x >> 6) & 2) | ((cc_x >> 4) & 4);
+}
+
+void y86_output_state(Y_data *y) {
+    const Y_char *stat_names[8] = {
+        "AOK", "HLT", "ADR", "INS", "", "", "ADR", "INS"
+    };
+
+    const Y_char *cc_names[8] = {
+        "Z=0 S=0 O=0",
+        "Z=0 S=0 O=1",
+        "Z=0 S=1 O=0",
+        "Z=0 S=1 O=1",
+        "Z=1 S=0 O=0",
+        "Z=1 S=0 O=1",
+        "Z=1 S=1 O=0",
+        "Z=1 S=1 O=1"
+    };
+
+    fprintf(
+        y->out,
+        "Stopped in %d steps at PC = 0x%x.  Status '%s', CC %s\n",
+        y->reg[yr_sx] - y->reg[yr_sc] - 1, y->reg[yr_pc] - !!y->reg[yr_st], stat_names[7 & y->reg[yr_st]], cc_names[y86_cc_transform(y->reg[yr_cc])]
+    );
+}
+
+void y86_output_reg(Y_data *y) {
+    Y_reg_lyt index;
+
+    const Y_char *reg_names[yr_cnt] = {
+        "%edi", "%esi", "%ebp", "%esp", "%ebx", "%edx", "%ecx", "%eax"
+    };
+
+    fprintf(y->out, "Changes to registers:\n");
+    for (index = yr_cnt - 1; (Y_word) index >= 0; --index) {
+        if (y->reg[index] != y->bak_reg[index]) {
+            fprintf(y->out, "%s:\t0x%.8x\t0x%.8x\n", reg_names[index], y->bak_reg[index], y->reg[index]);
+        }
+    }
+}
+
+void y86_output_mem(Y_data *y) {
+    Y_word index;
+
+    fprintf(y->out, "Changes to memory:\n");
+    for (index = 0; index < y->mem_size; index += 4) { // mem_size = 4 * n
+        if (IO_WORD(&(y->bak_mem[index])) != IO_WORD(&(y->mem[index]))) {
+            fprintf(y->out, "0x%.4x:\t0x%.8x\t0x%.8x\n", index, IO_WORD(&(y->bak_mem[index])), IO_WORD(&(y->mem[index])));
+        }
+    }
+}
+
+void y86_output(Y_data *y) {
+    y86_output_error(y);
+    y86_output_state(y);
+    y86_output_reg(y);
+    fprintf(y->out, "\n");
+    y86_output_mem(y);
+}
+
+void y86_disasm(Y_data *y, Y_word pc, Y_char *buf, size_t size) {
+    Y_char *inst = &(y->mem[pc]);
+    Y_inst op;
+    Y_reg_id ra;
+    Y_reg_id rb;
+    Y_word val;
+
+    const Y_char *reg_names[16] = {
+        "%eax", "%ecx", "%edx", "%ebx", "%esp", "%ebp", "%esi", "%edi",
+        "?", "?", "?", "?", "?", "?", "?", "?"
+    };
+    const Y_char *mov_names[7] = {"rrmovl", "cmovle", "cmovl", "cmove", "cmovne", "cmovge", "cmovg"};
+    const Y_char *op_names[4] = {"addl", "subl", "andl", "xorl"};
+    const Y_char *jmp_names[7] = {"jmp", "jle", "jl", "je", "jne", "jge", "jg"};
+
+    y86_decode_inst(y, &inst, &(y->mem[y->mem_size]), &op, &ra, &rb, &val);
+
+    switch (op & 0xF0) {
+        case yi_halt:
+            snprintf(buf, size, "halt");
+            break;
+        case yi_nop:
+            snprintf(buf, size, "nop");
+            break;
+        case yi_rrmovl:
+            snprintf(buf, size, "%s %s, %s", mov_names[op & 0xF], reg_names[ra], reg_names[rb]);
+            break;
+        case yi_irmovl:
+            snprintf(buf, size, "irmovl $0x%x, %s", val, reg_names[rb]);
+            break;
+        case yi_rmmovl:
+            snprintf(buf, size, "rmmovl %s, 0x%x(%s)", reg_names[ra], val, reg_names[rb]);
+            break;
+        case yi_mrmovl:
+            snprintf(buf, size, "mrmovl 0x%x(%s), %s", val, reg_names[rb], reg_names[ra]);
+            break;
+        case yi_addl:
+            snprintf(buf, size, "%s %s, %s", op_names[op & 0xF], reg_names[ra], reg_names[rb]);
+            break;
+        case yi_jmp:
+            snprintf(buf, size, "%s 0x%x", jmp_names[op & 0xF], val);
+            break;
+        case yi_call:
+            snprintf(buf, size, "call 0x%x", val);
+            break;
+        case yi_ret:
+            snprintf(buf, size, "ret");
+            break;
+        case yi_pushl:
+            snprintf(buf, size, "pushl %s", reg_names[ra]);
+            break;
+        case yi_popl:
+            snprintf(buf, size, "popl %s", reg_names[ra]);
+            break;
+        default:
+            snprintf(buf, size, ".byte 0x%.2x", y->mem[pc] & 0xFF);
+            break;
+    }
+}
+
+typedef struct {
+    Y_word pc;
+    unsigned long long cnt;
+} Y_prof;
+
+int y86_prof_cmp(const void *a, const void *b) {
+    const Y_prof *pa = a;
+    const Y_prof *pb = b;
+
+    // Hot first, then by PC
+    if (pa->cnt != pb->cnt) {
+        return pa->cnt < pb->cnt ? 1 : -1;
+    }
+    return pa->pc - pb->pc;
+}
+
+void y86_prof_output(Y_data *y, Y_char *fname) {
+    Y_prof *list = malloc(y->y_inst_size * sizeof(Y_prof));
+    Y_word count = 0;
+    Y_word index;
+    Y_word pc;
+    Y_char inst[64];
+    unsigned long long total = 0;
+    unsigned long long cycles = 0;
+    FILE *file;
+
+    if (!list) {
+        fprintf(stderr, "Out of memory\n");
+        return;
+    }
+
+    for (pc = 0; pc < y->y_inst_size; ++pc) {
+        if (y->p_inst[pc] || y->p_tsc[pc]) {
+            list[count].pc = pc;
+            list[count].cnt = y->p_inst[pc];
+            total += y->p_inst[pc];
+            cycles += y->p_tsc[pc];
+            ++count;
+        }
+    }
+
+    // Machine-readable, by PC: pc, insts, cycles of the block entered there, inst
+    if (fname) {
+        file = fopen(fname, "w");
+        if (file) {
+            fprintf(file, "# pc\tcount\tcycles\tinst\n");
+            for (index = 0; index < count; ++index) {
+                pc = list[index].pc;
+                y86_disasm(y, pc, inst, sizeof(inst));
+                fprintf(file, "0x%.4x\t%llu\t%llu\t%s\n", pc, y->p_inst[pc], y->p_tsc[pc], inst);
+            }
+            fclose(file);
+        } else {
+            fprintf(stderr, "Can't open profile file '%s'\n", fname);
+        }
+    }
+
+    // Flat profile, hot first
+    qsort(list, count, sizeof(Y_prof), y86_prof_cmp);
+
+    fprintf(y->out, "\nProfile: %llu insts", total);
+    if (y->p_mode > 1) {
+        fprintf(y->out, ", %llu cycles", cycles);
+    }
+    fprintf(y->out, "\n%12s %7s %14s  %-6s  %s\n", "count", "%", "cycles", "pc", "inst");
+    for (index = 0; index < count; ++index) {
+        pc = list[index].pc;
+        y86_disasm(y, pc, inst, sizeof(inst));
+        fprintf(
+            y->out, "%12llu %6.2f%% %14llu  0x%.4x  %s\n",
+            y->p_inst[pc], total ? 100.0 * y->p_inst[pc] / total : 0.0, y->p_tsc[pc], pc, inst
+        );
+    }
+
+    free(list);
+}
+
+void y86_copy_pad(Y_data *y, Y_char *pad, Y_word save) {
+    // Padding after mem, in the guard page if guard mode
+    if (y->guard) {
+        mprotect(&(y->mem[y->mem_size]), Y_PAGE_SIZE, PROT_READ | PROT_WRITE);
+    }
+    if (save) {
+        memcpy(pad, &(y->mem[y->mem_size]), sizeof(Y_word));
+    } else {
+        memcpy(&(y->mem[y->mem_size]), pad, sizeof(Y_word));
+    }
+    if (y->guard) {
+        mprotect(&(y->mem[y->mem_size]), Y_PAGE_SIZE, PROT_NONE);
+    }
+}
+
+void y86_reset(Y_data *y) {
+    Y_char zero[sizeof(Y_word)] = {0};
+    Y_word index;
+    Y_word begin;
+    Y_word size;
+
+    // Only the dirty parts: the loaded code, written chunks (and the spilled word), x_rev
+    memset(&(y->mem[0]), 0, y->reg[yr_len]);
+    memset(&(y->bak_mem[0]), 0, y->reg[yr_len]);
+
+    for (index = 0; index <= (y->mem_size - 1) >> Y_DIRTY_SHIFT; ++index) {
+        if (y->mem_dirty[index]) {
+            begin = index << Y_DIRTY_SHIFT;
+            size = (1 << Y_DIRTY_SHIFT) + sizeof(Y_word);
+            if (size > y->mem_size - begin) {
+                size = y->mem_size - begin;
+                y86_copy_pad(y, zero, 0);
+            }
+
+            memset(&(y->mem[begin]), 0, size);
+            y->mem_dirty[index] = 0;
+        }
+    }
+
+    memset(&(y->x_rev[0]), 0, (y->x_end - &(y->x_inst[0]) + 1) * sizeof(Y_word));
+    y86_decode_reset(y);
+
+    memset(&(y->bak_reg[0]), 0, sizeof(y->bak_reg));
+    memset(&(y->reg[0]), 0, sizeof(y->reg));
+}
+
+void y86_snap_copy_x(Y_data *y, Y_snap *snap, Y_word save) {
+    Y_word index;
+    size_t size_word = (y->y_inst_size + 1) * sizeof(Y_word);
+    size_t size_x_code = y->x_code_size + sizeof(Y_word);
+    size_t size_x_ent = (size_t) y->y_inst_size * Y_X_ENT_SIZE;
+
+    // x_inst is position independent (r15 based, rel32 to x_ent), x_map is saved as offsets
+    if (save) {
+        snap->x_len = y->x_end - &(y->x_inst[0]);
+        memcpy(&(snap->x_inst[0]), &(y->x_inst[0]), snap->x_len);
+        memcpy(&(snap->x_rev[0]), &(y->x_rev[0]), (snap->x_len + 1) * sizeof(Y_word));
+        memcpy(&(snap->x_cnt[0]), &(y->x_cnt[0]), size_word);
+        memcpy(&(snap->x_blk[0]), &(y->x_blk[0]), size_word);
+        memcpy(&(snap->x_code[0]), &(y->x_code[0]), size_x_code);
+        memcpy(&(snap->x_ent[0][0]), &(y->x_ent[0][0]), size_x_ent);
+
+        for (index = 0; index < y->y_inst_size; ++index) {
+            snap->x_map[index] = y->x_map[index] ? y->x_map[index] - &(y->x_inst[0]) + 1 : 0;
+        }
+    } else {
+        // Stale x_rev after the saved code
+        if (y->x_end - &(y->x_inst[0]) > snap->x_len) {
+            memset(&(y->x_rev[snap->x_len + 1]), 0, (y->x_end - &(y->x_inst[0]) - snap->x_len) * sizeof(Y_word));
+        }
+
+        y->x_end = &(y->x_inst[snap->x_len]);
+        memcpy(&(y->x_inst[0]), &(snap->x_inst[0]), snap->x_len);
+        memcpy(&(y->x_rev[0]), &(snap->x_rev[0]), (snap->x_len + 1) * sizeof(Y_word));
+        memcpy(&(y->x_cnt[0]), &(snap->x_cnt[0]), size_word);
+        memcpy(&(y->x_blk[0]), &(snap->x_blk[0]), size_word);
+        memcpy(&(y->x_code[0]), &(snap->x_code[0]), size_x_code);
+        memcpy(&(y->x_ent[0][0]), &(snap->x_ent[0][0]), size_x_ent);
+
+        for (index = 0; index < y->y_inst_size; ++index) {
+            y->x_map[index] = snap->x_map[index] ? &(y->x_inst[snap->x_map[index] - 1]) : 0;
+        }
+    }
+}
+
+void y86_snap_free(Y_snap *snap) {
+    if (snap) {
+        free(snap->mem);
+        free(snap->bak_mem);
+        free(snap->mem_dirty);
+        free(snap->x_inst);
+        free(snap->x_map);
+        free(snap->x_rev);
+        free(snap->x_cnt);
+        free(snap->x_blk);
+        free(snap->x_code);
+        free(snap->x_ent);
+        free(snap);
+    }
+}
+
+Y_snap *y86_snap_new(Y_data *y, Y_word code) {
+    Y_snap *snap = calloc(1, sizeof(Y_snap));
+    Y_word chunks = ((y->mem_size - 1) >> Y_DIRTY_SHIFT) + 1;
+    Y_word x_len = y->x_end - &(y->x_inst[0]);
+
+    if (!snap) {
+        return 0;
+    }
+
+    snap->y = y;
+    snap->mem_size = y->mem_size;
+    snap->x_inst_size = y->x_inst_size;
+    snap->y_inst_size = y->y_inst_size;
+    snap->guard = y->guard;
+    memcpy(&(snap->bak_reg[0]), &(y->bak_reg[0]), sizeof(y->bak_reg));
+    memcpy(&(snap->reg[0]), &(y->reg[0]), sizeof(y->reg));
+
+    // The whole mem once, restored by written chunks
+    snap->mem = malloc(y->mem_size + sizeof(Y_word));
+    snap->bak_mem = malloc(y->reg[yr_len] + 1);
+    snap->mem_dirty = malloc(chunks);
+    if (!snap->mem || !snap->bak_mem || !snap->mem_dirty) {
+        y86_snap_free(snap);
+        return 0;
+    }
+    memcpy(&(snap->mem[0]), &(y->mem[0]), y->mem_size);
+    y86_copy_pad(y, &(snap->mem[y->mem_size]), 1);
+    memcpy(&(snap->bak_mem[0]), &(y->bak_mem[0]), y->reg[yr_len]);
+    memcpy(&(snap->mem_dirty[0]), &(y->mem_dirty[0]), chunks);
+
+    // Compiled code, or only its version
+    snap->x_gen = y->x_gen;
+    snap->code = code;
+    if (code) {
+        snap->x_inst = malloc(x_len + 1);
+        snap->x_map = malloc(y->y_inst_size * sizeof(Y_word));
+        snap->x_rev = malloc((x_len + 1) * sizeof(Y_word));
+        snap->x_cnt = malloc((y->y_inst_size + 1) * sizeof(Y_word));
+        snap->x_blk = malloc((y->y_inst_size + 1) * sizeof(Y_word));
+        snap->x_code = malloc(y->x_code_size + sizeof(Y_word));
+        snap->x_ent = malloc((size_t) y->y_inst_size * Y_X_ENT_SIZE);
+        if (
+            !snap->x_inst || !snap->x_map || !snap->x_rev || !snap->x_cnt
+            || !snap->x_blk || !snap->x_code || !snap->x_ent
+        ) {
+            y86_snap_free(snap);
+            return 0;
+        }
+
+        y86_snap_copy_x(y, snap, 1);
+    }
+
+    return snap;
+}
+
+Y_word y86_snap_load(Y_data *y, Y_snap *snap) {
+    Y_word index;
+    Y_word begin;
+    Y_word size;
+    Y_word same = snap->y == y;
+
+    if (
+        snap->mem_size != y->mem_size || snap->x_inst_size != y->x_inst_size
+        || snap->y_inst_size != y->y_inst_size || snap->guard != y->guard
+    ) {
+        fprintf(stderr, "Snapshot of another memory size\n");
+        return 1;
+    }
+
+    memcpy(&(y->bak_reg[0]), &(snap->bak_reg[0]), sizeof(y->bak_reg));
+    memcpy(&(y->reg[0]), &(snap->reg[0]), sizeof(y->reg));
+    memcpy(&(y->bak_mem[0]), &(snap->bak_mem[0]), y->reg[yr_len]);
+
+    // Written chunks (see y86_reset), or all of mem if from another arena
+    for (index = 0; index <= (y->mem_size - 1) >> Y_DIRTY_SHIFT; ++index) {
+        if (y->mem_dirty[index] || !same) {
+            begin = index << Y_DIRTY_SHIFT;
+            size = (1 << Y_DIRTY_SHIFT) + sizeof(Y_word);
+            if (size > y->mem_size - begin) {
+                size = y->mem_size - begin;
+                y86_copy_pad(y, &(snap->mem[y->mem_size]), 0);
+            }
+
+            memcpy(&(y->mem[begin]), &(snap->mem[begin]), size);
+            y->mem_dirty[index] = snap->mem_dirty[index];
+        }
+    }
+
+    // Compiled code is not copied if not changed
+    if (!same || y->x_gen != snap->x_gen) {
+        // Decoded insts may be of other bytes
+        if (snap->code) {
+            y86_snap_copy_x(y, snap, 0);
+            y86_decode_reset(y);
+        } else {
+            y86_decode_reset(y);
+            y86_load_all(y);
+        }
+        y->x_gen = snap->x_gen;
+        if (y->x_gen_max < y->x_gen) {
+            y->x_gen_max = y->x_gen;
+        }
+    }
+
+    return 0;
+}
+
+// Translation cache file: Y_cache_head, x_map, x_rev, x_cnt, x_blk, then the image, x_inst, x_code, x_ent
+// Word tables first (aligned), x_map as offsets like Y_snap, the code needs no other relocation
+// The key is the image, the sizes and modes of the engine, and the format version
+
+#define Y_CACHE_MAGIC 0x43583859 // "Y8XC"
+#define Y_CACHE_VERSION 1 // Changed with the generated code or the layout of the file
+
+typedef struct {
+    Y_word magic;
+    Y_word version;
+    Y_word mem_size;
+    Y_word y_inst_size;
+    Y_word x_inst_size;
+    Y_word guard;
+    Y_word adx;
+    Y_word prof; // Profiling code in gotos (see y86_gen_prof)
+    Y_word rec; // Tracing code after insts (see y86_gen_rec)
+    Y_word len; // The image
+    Y_word len_loaded; // reg[yr_len] after loading
+    Y_word x_len;
+    unsigned long long hash;
+} Y_cache_head;
+
+unsigned long long y86_cache_hash(const void *data, size_t size, unsigned long long hash) {
+    const Y_char *pos = data;
+    size_t index;
+
+    // FNV-1a
+    for (index = 0; index < size; ++index) {
+        hash = (hash ^ (pos[index] & 0xFF)) * 0x100000001B3ULL;
+    }
+
+    return hash;
+}
+
+void y86_cache_head(Y_data *y, Y_cache_head *head, Y_word len) {
+    memset(head, 0, sizeof(*head));
+    head->magic = Y_CACHE_MAGIC;
+    head->version = Y_CACHE_VERSION;
+    head->mem_size = y->mem_size;
+    head->y_inst_size = y->y_inst_size;
+    head->x_inst_size = y->x_inst_size;
+    head->guard = y->guard;
+    head->adx = y86_adx;
+    head->prof = y->p_mode;
+    head->rec = !!y->r_buf;
+    head->len = len;
+
+    head->hash = y86_cache_hash(head, offsetof(Y_cache_head, len_loaded), 0xCBF29CE484222325ULL);
+    head->hash = y86_cache_hash(&(y->mem[0]), len, head->hash);
+}
+
+size_t y86_cache_size(Y_data *y, Y_cache_head *head) {
+    return sizeof(Y_cache_head) + (y->y_inst_size + (head->x_len + 1) + 2 * (y->y_inst_size + 1)) * sizeof(Y_word)
+        + head->len + head->x_len + y->x_code_size + sizeof(Y_word) + (size_t) y->y_inst_size * Y_X_ENT_SIZE;
+}
+
+void y86_cache_snap(Y_data *y, Y_cache_head *head, Y_char *pos, Y_snap *snap) {
+    // Y_snap pointing into the file, for y86_snap_copy_x
+    memset(snap, 0, sizeof(*snap));
+    snap->x_len = head->x_len;
+
+    pos += sizeof(Y_cache_head);
+    snap->x_map = (Y_word *) pos; pos += y->y_inst_size * sizeof(Y_word);
+    snap->x_rev = (Y_word *) pos; pos += (head->x_len + 1) * sizeof(Y_word);
+    snap->x_cnt = (Y_word *) pos; pos += (y->y_inst_size + 1) * sizeof(Y_word);
+    snap->x_blk = (Y_word *) pos; pos += (y->y_inst_size + 1) * sizeof(Y_word);
+    snap->mem = pos; pos += head->len;
+    snap->x_inst = pos; pos += head->x_len;
+    snap->x_code = pos; pos += y->x_code_size + sizeof(Y_word);
+    snap->x_ent = (Y_char (*)[Y_X_ENT_SIZE]) pos;
+}
+
+void y86_cache_path(Y_char *path, size_t size, Y_char *dir, Y_cache_head *head) {
+    snprintf(path, size, "%s/%.16llx.yxc", dir, head->hash);
+}
+
+Y_word y86_cache_load(Y_data *y, Y_char *dir) {
+    Y_cache_head head;
+    Y_cache_head *file;
+    Y_snap snap;
+    Y_char path[4096];
+    struct stat st;
+    Y_char *pos;
+    Y_word miss;
+    int fd;
+
+    y86_cache_head(y, &head, y->reg[yr_len]);
+    y86_cache_path(path, sizeof(path), dir, &head);
+
+    fd = open(path, O_RDONLY);
+    if (fd < 0) {
+        return 1;
+    }
+    if (fstat(fd, &st) || (size_t) st.st_size < sizeof(Y_cache_head)) {
+        close(fd);
+        return 1;
+    }
+
+    pos = mmap(0, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (pos == MAP_FAILED) {
+        return 1;
+    }
+
+    // Same key (with the image itself), and complete
+    file = (Y_cache_head *) pos;
+    head.len_loaded = file->len_loaded;
+    head.x_len = file->x_len;
+    miss = memcmp(file, &head, sizeof(head)) || head.x_len > y->x_inst_size
+        || head.len_loaded < head.len || head.len_loaded > y->y_inst_size
+        || (size_t) st.st_size != y86_cache_size(y, &head);
+
+    if (!miss) {
+        y86_cache_snap(y, &head, pos, &snap);
+        miss = memcmp(&(snap.mem[0]), &(y->mem[0]), head.len);
+    }
+
+    if (!miss) {
+        y86_load_reset(y);
+        y86_snap_copy_x(y, &snap, 0);
+        y86_decode_reset(y);
+        y->reg[yr_len] = head.len_loaded;
+    }
+
+    munmap(pos, st.st_size);
+    return miss;
+}
+
+void y86_cache_save(Y_data *y, Y_char *dir, Y_word len) {
+    Y_cache_head head;
+    Y_snap snap;
+    Y_char path[4096];
+    Y_char temp[sizeof(path) + 8];
+    Y_char *pos;
+    size_t size;
+    Y_word index;
+    FILE *file;
+    int fd;
+
+    y86_cache_head(y, &head, len);
+    head.len_loaded = y->reg[yr_len];
+    head.x_len = y->x_end - &(y->x_inst[0]);
+    y86_cache_path(path, sizeof(path), dir, &head);
+
+    size = y86_cache_size(y, &head);
+    pos = calloc(1, size);
+    if (!pos) {
+        return;
+    }
+
+    memcpy(pos, &head, sizeof(head));
+    y86_cache_snap(y, &head, pos, &snap);
+    memcpy(&(snap.mem[0]), &(y->mem[0]), len);
+
+    // As y86_snap_copy_x, the decoded bits are not saved
+    y86_snap_copy_x(y, &snap, 1);
+    for (index = 0; index < y->x_code_size + (Y_word) sizeof(Y_word); ++index) {
+        snap.x_code[index] &= Y_X_CODE_INST;
+    }
+
+    // Written aside, then renamed (other processes or workers may read it)
+    snprintf(temp, sizeof(temp), "%s.XXXXXX", path);
+    fd = mkstemp(temp);
+    if (fd >= 0) {
+        file = fdopen(fd, "wb");
+        if (file) {
+            index = fwrite(pos, 1, size, file) == size;
+            if (fclose(file) || !index || rename(temp, path)) {
+                unlink(temp);
+            }
+        } else {
+            close(fd);
+            unlink(temp);
+        }
+    }
+
+    free(pos);
+}
+
+void y86_free(Y_data *y) {
+    munmap(y->map, y->size);
+}
+
+void f_usage(Y_char *pname) {
+    fprintf(stderr, "Usage: %s [-g] [-m mem_size] [-c code_size] [-x cache_size] [-r repeat] [-d cache_dir] [-p|-P prof_file] [-t trace_file] file.bin [max_steps]\n", pname);
+    fprintf(stderr, "       %s [-g] [-m mem_size] [-c code_size] [-x cache_size] [-r repeat] [-d cache_dir] [-s max_steps] [-j threads] -b file.bin|dir ...\n", pname);
+    fprintf(stderr, "       %s -T trace_file [file.bin]\n", pname);
+}
+
+Y_stat f_run(Y_data *y, Y_char *fname, Y_word step, Y_word repeat, Y_char *cache, Y_char *prof) {
+    Y_snap *volatile snap = 0;
+    Y_word index;
+
+    y->reg[yr_st] = setjmp(y->jmp);
+
+    if (!(y->reg[yr_st])) {
+        // Load
+        if (strcmp(fname, "nil")) {
+            y86_load_file(y, fname);
+        } else {
+            y->reg[yr_len] = 1;
+            y->mem[0] = yi_halt;
+        }
+
+        // Compiled code of the same image from the cache dir, or saved there
+        if (!cache || y86_cache_load(y, cache)) {
+            index = y->reg[yr_len];
+            y86_load_all(y);
+
+            if (cache) {
+                y86_cache_save(y, cache, index);
+            }
+        }
+
+        // Exec, again from the snapshot if repeated
+        if (repeat > 1) {
+            snap = y86_snap_new(y, 1);
+        }
+
+        for (index = 0; index < repeat; ++index) {
+            if (index && (!snap || y86_snap_load(y, snap))) {
+                break;
+            }
+            y86_go(y, step);
+        }
+    } else {
+        // Jumped out
+    }
+
+    y86_snap_free(snap);
+    y86_rec_close(y);
+
+    // Output
+    y86_output(y);
+    if (y->p_mode) {
+        y86_prof_output(y, prof);
+    }
+
+    // Return
+    return y->reg[yr_st] == ys_clf || y->reg[yr_st] == ys_ccf;
+}
+
+Y_stat f_main(Y_char *fname, Y_word step, Y_word repeat, Y_char *cache, Y_word prof_mode, Y_char *prof, Y_char *trace, Y_word mem_size, Y_word y_inst_size, Y_word x_inst_size, Y_word guard) {
+    Y_data *y = y86_new(mem_size, y_inst_size, x_inst_size, guard);
+    Y_stat result;
+
+    if (!y) {
+        return 1;
+    }
+
+    // Before compiling, the code of gotos is changed
+    y->p_mode = prof_mode;
+    y->p_func = y86_prof_tsc;
+
+    if (trace && y86_rec_open(y, trace)) {
+        y86_free(y);
+        return 1;
+    }
+
+    result = f_run(y, fname, step, repeat, cache, prof);
+    y86_free(y);
+    return result;
+}
+
+unsigned f_dump_varint(Y_char **pos) {
+    unsigned value = 0;
+    Y_word shift = 0;
+
+    do {
+        value |= (unsigned) (**pos & 0x7F) << shift;
+        shift += 7;
+    } while ((*((*pos)++) & 0x80) && shift < 35);
+
+    return value;
+}
+
+Y_word f_dump_zigzag(Y_char **pos) {
+    unsigned value = f_dump_varint(pos);
+
+    return (Y_word) (value >> 1 ^ -(value & 1));
+}
+
+void f_dump_rec(Y_data *y, Y_char **pos, Y_word *last, Y_word disasm, unsigned long long step) {
+    const Y_char *reg_names[yr_cnt] = {
+        "%edi", "%esi", "%ebp", "%esp", "%ebx", "%edx", "%ecx", "%eax"
+    };
+
+    Y_char head = *((*pos)++);
+    Y_char inst[64];
+    Y_word mask;
+    Y_word index;
+    Y_word cc;
+
+    if ((head & 0x1F) == 0x1F) {
+        last[0] += f_dump_zigzag(pos);
+    } else {
+        last[0] += (Y_word) ((head & 0x1F) >> 1 ^ -(head & 1));
+    }
+
+    // The inst in mem as written so far
+    inst[0] = 0;
+    if (disasm && (unsigned) last[0] < (unsigned) y->mem_size) {
+        y86_disasm(y, last[0], inst, sizeof(inst));
+    }
+    fprintf(y->out, (head & 0xE0) ? "%10llu  0x%.4x  %-24s" : "%10llu  0x%.4x  %s", step, last[0], inst);
+
+    if (head & 0x20) {
+        mask = *((*pos)++) & 0xFF;
+        for (index = 0; index < yr_cnt; ++index) {
+            if (mask >> index & 1) {
+                last[2 + index] += f_dump_zigzag(pos);
+            }
+        }
+        for (index = yr_cnt - 1; index >= 0; --index) {
+            if (mask >> index & 1) {
+                fprintf(y->out, " %s=0x%.8x", reg_names[index], last[2 + index]);
+            }
+        }
+    }
+
+    if (head & 0x40) {
+        last[1] = (*((*pos)++) & 0xFF) << 6;
+        cc = y86_cc_transform(last[1]);
+        fprintf(y->out, " CC Z=%d S=%d O=%d", cc >> 2 & 1, cc >> 1 & 1, cc & 1);
+    }
+
+    if (head & 0x80) {
+        last[10] += f_dump_zigzag(pos);
+        last[11] = f_dump_varint(pos);
+        fprintf(y->out, " [0x%.4x]=0x%.8x", last[10], last[11]);
+
+        if ((unsigned) last[10] < (unsigned) y->mem_size) {
+            memcpy(&(y->mem[last[10]]), &(last[11]), sizeof(Y_word));
+        }
+        if ((unsigned) last[10] < (unsigned) y->x_code_size) {
+            // Decoded again when disassembled (see y86_decode_inst)
+            y86_unload_decode(y, last[10]);
+        }
+    }
+
+    fprintf(y->out, "\n");
+}
+
+Y_stat f_dump_file(Y_data *y, FILE *file, Y_char *data, Y_word disasm) {
+    Y_word chunk[2];
+    Y_word last[Y_REC_SIZE];
+    Y_word index;
+    Y_char *pos;
+    unsigned long long step = 0;
+
+    memset(last, 0, sizeof(last));
+    while (fread(chunk, sizeof(chunk), 1, file) == 1) {
+        if (chunk[1] < 0 || chunk[1] > Y_REC_OUT || (chunk[0] == 0 && chunk[1] != sizeof(last))) {
+            return 1;
+        }
+
+        // Zero after the data, a broken record never reads out of the buffer
+        memset(data, 0, Y_REC_OUT + Y_REC_MAX);
+        if (fread(data, 1, chunk[1], file) != (size_t) chunk[1]) {
+            return 1;
+        }
+
+        // A run starts
+        if (chunk[0] == 0) {
+            memcpy(last, data, sizeof(last));
+            fprintf(y->out, "# Run from PC = 0x%x\n", last[0]);
+            continue;
+        }
+
+        pos = data;
+        for (index = 0; index < chunk[0] && pos < data + chunk[1]; ++index) {
+            f_dump_rec(y, &pos, last, disasm, ++step);
+        }
+    }
+
+    fprintf(y->out, "# %llu steps\n", step);
+    return 0;
+}
+
+Y_stat f_dump(Y_char *fname, Y_char *binname) {
+    FILE *file = fopen(fname, "rb");
+    Y_data *y = 0;
+    Y_rec_head head;
+    Y_char *data = 0;
+    Y_stat result = 1;
+
+    if (!file) {
+        fprintf(stderr, "Can't open trace file '%s'\n", fname);
+        return 1;
+    }
+
+    if (fread(&head, sizeof(head), 1, file) == 1 && head.magic == Y_REC_MAGIC) {
+        // The image, written again by the records (disassembled as executed)
+        y = y86_new(head.mem_size, head.y_inst_size, Y_X_INST_SIZE, 0);
+        data = malloc(Y_REC_OUT + Y_REC_MAX);
+
+        if (y && data && !setjmp(y->jmp)) {
+            if (binname) {
+                y86_load_file(y, binname);
+            }
+
+            result = f_dump_file(y, file, data, !!binname);
+            if (result) {
+                fprintf(stderr, "Bad trace file '%s'\n", fname);
+            }
+        }
+    } else {
+        fprintf(stderr, "Bad trace file '%s'\n", fname);
+    }
+
+    fclose(file);
+    free(data);
+    if (y) {
+        y86_free(y);
+    }
+    return result;
+}
+
+int f_name_cmp(const void *a, const void *b) {
+    return strcmp(*(Y_char **) a, *(Y_char **) b);
+}
+
+Y_word f_batch_push(Y_char ***list, Y_word *count, Y_word *limit, Y_char *fname) {
+    if (*count == *limit) {
+        *limit = *limit ? *limit * 2 : 0x100;
+        *list = realloc(*list, *limit * sizeof(Y_char *));
+    }
+
+    if (!*list || !fname) {
+        fprintf(stderr, "Out of memory\n");
+        return 1;
+    }
+
+    (*list)[(*count)++] = fname;
+    return 0;
+}
+
+Y_word f_batch_add(Y_char ***list, Y_word *count, Y_word *limit, Y_char *fname) {
+    DIR *dir;
+    struct dirent *entry;
+    struct stat info;
+    Y_char *path;
+    Y_word begin = *count;
+    size_t size;
+
+    if (stat(fname, &info) || !S_ISDIR(info.st_mode)) {
+        // A file (reported when loading if bad)
+        return f_batch_push(list, count, limit, strdup(fname));
+    }
+
+    // All *.bin files in the directory, sorted
+    dir = opendir(fname);
+    if (!dir) {
+        fprintf(stderr, "Can't open directory '%s'\n", fname);
+        return 1;
+    }
+
+    while ((entry = readdir(dir))) {
+        size = strlen(entry->d_name);
+        if (size > 4 && !strcmp(&(entry->d_name[size - 4]), ".bin")) {
+            size += strlen(fname) + 2;
+            path = malloc(size);
+            if (path) {
+                snprintf(path, size, "%s/%s", fname, entry->d_name);
+            }
+
+            if (f_batch_push(list, count, limit, path)) {
+                closedir(dir);
+                return 1;
+            }
+        }
+    }
+
+    closedir(dir);
+    qsort(&((*list)[begin]), *count - begin, sizeof(Y_char *), f_name_cmp);
+    return 0;
+}
+
+typedef struct {
+    Y_char *fname;
+    Y_char *buf; // Output, printed in order
+    size_t size;
+    Y_word failed;
+    Y_word done;
+} Y_job;
+
+typedef struct {
+    Y_word next; // Taken by the owner and thieves (atomic)
+    Y_word end;
+} Y_range;
+
+typedef struct {
+    Y_job *jobs;
+    Y_word count;
+    Y_range *ranges; // One per worker
+    Y_word workers;
+    Y_word step;
+    Y_word repeat;
+    Y_char *cache;
+    pthread_mutex_t lock;
+    pthread_cond_t cond;
+} Y_batch;
+
+typedef struct {
+    Y_batch *batch;
+    Y_word id;
+    Y_data *y; // Arena of the worker
+    pthread_t thread;
+} Y_worker;
+
+Y_word f_batch_take(Y_batch *b, Y_word id) {
+    Y_range *range;
+    Y_word index;
+    Y_word offset;
+
+    // Own range first, then steal from the others
+    for (offset = 0; offset < b->workers; ++offset) {
+        range = &(b->ranges[(id + offset) % b->workers]);
+
+        if (__atomic_load_n(&(range->next), __ATOMIC_RELAXED) < range->end) {
+            index = __atomic_fetch_add(&(range->next), 1, __ATOMIC_RELAXED);
+            if (index < range->end) {
+                return index;
+            }
+        }
+    }
+
+    return -1;
+}
+
+void *f_batch_worker(void *arg) {
+    Y_worker *w = arg;
+    Y_batch *b = w->batch;
+    Y_data *y = w->y;
+    Y_job *job;
+    Y_word used = 0;
+    Y_word index;
+    FILE *out;
+
+    while ((index = f_batch_take(b, w->id)) >= 0) {
+        job = &(b->jobs[index]);
+
+        if (used) {
+            y86_reset(y);
+        }
+        used = 1;
+
+        out = open_memstream(&(job->buf), &(job->size));
+        if (out) {
+            if (index) {
+                fprintf(out, "\n");
+            }
+            fprintf(out, "==> %s <==\n", job->fname);
+
+            y->out = out;
+            job->failed = f_run(y, job->fname, b->step, b->repeat, b->cache, 0);
+            fclose(out);
+        } else {
+            job->failed = 1;
+        }
+
+        pthread_mutex_lock(&(b->lock));
+        job->done = 1;
+        pthread_cond_broadcast(&(b->cond));
+        pthread_mutex_unlock(&(b->lock));
+    }
+
+    return 0;
+}
+
+void f_batch_free(Y_char **list, Y_word count) {
+    Y_word index;
+
+    for (index = 0; index < count; ++index) {
+        free(list[index]);
+    }
+    free(list);
+}
+
+Y_stat f_batch(Y_char **fnames, Y_word argc, Y_word step, Y_word repeat, Y_char *cache, Y_word workers, Y_word mem_size, Y_word y_inst_size, Y_word x_inst_size, Y_word guard) {
+    Y_batch b;
+    Y_worker *w;
+    Y_char **list = 0;
+    Y_word count = 0;
+    Y_word limit = 0;
+    Y_word failed = 0;
+    Y_word started = 0;
+    Y_word index;
+    struct timespec begin, end;
+    double time;
+
+    for (index = 0; index < argc; ++index) {
+        if (f_batch_add(&list, &count, &limit, fnames[index])) {
+            f_batch_free(list, count);
+            return 1;
+        }
+    }
+
+    if (workers <= 0) {
+        workers = sysconf(_SC_NPROCESSORS_ONLN);
+    }
+    if (workers > count) {
+        workers = count;
+    }
+    if (workers <= 0) {
+        workers = 1;
+    }
+
+    memset(&b, 0, sizeof(b));
+    b.count = count;
+    b.workers = workers;
+    b.step = step;
+    b.repeat = repeat;
+    b.cache = cache;
+    b.jobs = calloc(count + 1, sizeof(Y_job));
+    b.ranges = calloc(workers, sizeof(Y_range));
+    w = calloc(workers, sizeof(Y_worker));
+    if (!b.jobs || !b.ranges || !w) {
+        fprintf(stderr, "Out of memory\n");
+        failed = -1;
+    }
+
+    // One arena per worker, only the dirty parts are reset between programs
+    for (index = 0; index < workers && !failed; ++index) {
+        b.ranges[index].next = count * index / workers;
+        b.ranges[index].end = count * (index + 1) / workers;
+
+        w[index].batch = &b;
+        w[index].id = index;
+        w[index].y = y86_new(mem_size, y_inst_size, x_inst_size, guard);
+        if (!w[index].y) {
+            failed = -1;
+        }
+    }
+
+    if (failed) {
+        for (index = 0; w && index < workers; ++index) {
+            if (w[index].y) {
+                y86_free(w[index].y);
+            }
+        }
+        free(w);
+        free(b.ranges);
+        free(b.jobs);
+        f_batch_free(list, count);
+        return 1;
+    }
+
+    pthread_mutex_init(&(b.lock), 0);
+    pthread_cond_init(&(b.cond), 0);
+
+    for (index = 0; index < count; ++index) {
+        b.jobs[index].fname = list[index];
+    }
+
+    clock_gettime(CLOCK_MONOTONIC, &begin);
+
+    // The started workers also take the jobs of the others (see f_batch_take)
+    for (started = 0; started < workers; ++started) {
+        if (pthread_create(&(w[started].thread), 0, f_batch_worker, &(w[started]))) {
+            fprintf(stderr, "pthread_create() failed, %d threads\n", started ? started : 1);
+            break;
+        }
+    }
+    if (!started) {
+        f_batch_worker(&(w[0]));
+    }
+
+    // Print in input order
+    for (index = 0; index < count; ++index) {
+        pthread_mutex_lock(&(b.lock));
+        while (!b.jobs[index].done) {
+            pthread_cond_wait(&(b.cond), &(b.lock));
+        }
+        pthread_mutex_unlock(&(b.lock));
+
+        fwrite(b.jobs[index].buf, 1, b.jobs[index].size, stdout);
+        failed += b.jobs[index].failed;
+
+        free(b.jobs[index].buf);
+    }
+
+    for (index = 0; index < workers; ++index) {
+        if (index < started) {
+            pthread_join(w[index].thread, 0);
+        }
+        y86_free(w[index].y);
+    }
+
+    clock_gettime(CLOCK_MONOTONIC, &end);
+    time = (end.tv_sec - begin.tv_sec) + (end.tv_nsec - begin.tv_nsec) / 1e9;
+
+    fflush(stdout);
+    fprintf(
+        stderr, "%d programs (%d failed to load) in %.3f s with %d threads, %.1f programs/s\n",
+        count, failed, time, started ? started : 1, time > 0 ? count / time : 0.0
+    );
+
+    pthread_cond_destroy(&(b.cond));
+    pthread_mutex_destroy(&(b.lock));
+    free(w);
+    free(b.ranges);
+    free(b.jobs);
+    f_batch_free(list, count);
+    return failed != 0;
+}
+
+int main(int argc, char *argv[]) {
+    Y_word mem_size = Y_MEM_SIZE;
+    Y_word y_inst_size = Y_Y_INST_SIZE;
+    Y_word x_inst_size = Y_X_INST_SIZE;
+    Y_word guard = 0;
+    Y_word batch = 0;
+    Y_word workers = 0;
+    Y_word step = 10000;
+    Y_word repeat = 1;
+    Y_char *cache = 0;
+    Y_word prof_mode = 0;
+    Y_char *prof = 0;
+    Y_char *trace = 0;
+    Y_char *dump = 0;
+    Y_word index = 1;
+
+    y86_adx_init();
+
+    // Options, sizes are decimal or hex (0x...)
+    for (; index < argc && argv[index][0] == '-'; ++index) {
+        if (argv[index][1] == 'g') {
+            guard = 1;
+            continue;
+        }
+
+        if (argv[index][1] == 'b') {
+            batch = 1;
+            continue;
+        }
+
+        if (index + 1 >= argc) {
+            f_usage(argv[0]);
+            return 0;
+        }
+
+        switch (argv[index][1]) {
+            case 'm':
+                mem_size = strtol(argv[++index], 0, 0);
+                break;
+            case 'c':
+                y_inst_size = strtol(argv[++index], 0, 0);
+                break;
+            case 'x':
+                x_inst_size = strtol(argv[++index], 0, 0);
+                break;
+            case 's':
+                step = atoi(argv[++index]);
+                break;
+            case 'j':
+                workers = atoi(argv[++index]);
+                break;
+            case 'r':
+                repeat = atoi(argv[++index]);
+                break;
+            case 'd':
+                cache = argv[++index];
+                break;
+            case 'p':
+            case 'P':
+                prof_mode = argv[index][1] == 'P' ? 2 : 1;
+                prof = argv[++index];
+                break;
+            case 't':
+                trace = argv[++index];
+                break;
+            case 'T':
+                dump = argv[++index];
+                break;
+            default:
+                f_usage(argv[0]);
+                return 0;
+        }
+    }
+
+    if (dump && argc - index <= 1) {
+        return f_dump(dump, index < argc ? argv[index] : 0);
+    }
+
+    if (batch && (prof || trace || dump)) {
+        // Per run outputs, not per program
+        fprintf(stderr, "-p, -P, -t and -T can't be used with -b\n");
+        f_usage(argv[0]);
+        return 1;
+    }
+
+    if (batch && index < argc) {
+        return f_batch(&(argv[index]), argc - index, step, repeat, cache, workers, mem_size, y_inst_size, x_inst_size, guard);
+    }
+
+    switch (argc - index) {
+        // Correct arg
+        case 1:
+            return f_main(argv[index], step, repeat, cache, prof_mode, prof, trace, mem_size, y_inst_size, x_inst_size, guard);
+        case 2:
+            return f_main(argv[index], atoi(argv[index + 1]), repeat, cache, prof_mode, prof, trace, mem_size, y_inst_size, x_inst_size, guard);
+
+        // Bad arg or no arg
+        default:
+            f_usage(argv[0]);
+            return 0;
+    }
+}